@@ -24,6 +24,7 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tileswap.h"
 #include "net/commands.h"
 
 #include "../shared/net/pen.h"
@@ -36,9 +37,19 @@
 #include <QDateTime>
 #include <QTimer>
 #include <QElapsedTimer>
+#include <QtConcurrent>
+#include <QFutureWatcher>
 
 namespace canvas {
 
+namespace {
+	// Number of newest savepoints that are never compressed
+	const int HOT_SAVEPOINTS = 2;
+
+	// Minimum time between tile evictions triggered by going over the memory limit (ms)
+	const int SWAP_INTERVAL = 250;
+}
+
 struct StateSavepoint::Data {
 	Data() : timestamp(0), streampointer(-1), canvas(0), _refcount(1) {}
 	Data(const Data &) = delete;
@@ -126,6 +137,8 @@ StateTracker::StateTracker(paintcore::LayerStack *image, int myId, QObject *pare
 	: QObject(parent),
 		_image(image),
 		m_myId(myId),
+		m_compressing(nullptr),
+		m_savepointBudget(512),
 		m_msgstream_sizelimit(1024 * 1024 * 10),
 		m_fullhistory(true),
 		_showallmarkers(false),
@@ -140,11 +153,27 @@ StateTracker::StateTracker(paintcore::LayerStack *image, int myId, QObject *pare
 	_localforkCleanupTimer->setSingleShot(true);
 	connect(_localforkCleanupTimer, &QTimer::timeout, this, &StateTracker::resetLocalFork);
 
+	// Tiles are swapped out when tile memory goes over the limit, not just at savepoints.
+	// The notification can come from any thread, so eviction is scheduled in this one.
+	m_swapTimer = new QTimer(this);
+	m_swapTimer->setSingleShot(true);
+	m_swapTimer->setInterval(SWAP_INTERVAL);
+	connect(m_swapTimer, &QTimer::timeout, this, &StateTracker::evictTiles);
+	connect(paintcore::tileswap::notifier(), &paintcore::tileswap::Notifier::overLimit, this, [this]() {
+		if(!m_swapTimer->isActive())
+			m_swapTimer->start();
+	}, Qt::QueuedConnection);
+
+	m_compressor = new QFutureWatcher<void>(this);
+	connect(m_compressor, &QFutureWatcher<void>::finished, this, &StateTracker::storeCompressedTiles);
+
 	connect(image, &paintcore::LayerStack::resized, m_annotations, &AnnotationState::offsetAll);
 }
 
 StateTracker::~StateTracker()
 {
+	// The compressor writes to m_coldTiles
+	m_compressor->waitForFinished();
 }
 
 void StateTracker::stop()
@@ -425,6 +454,12 @@ void StateTracker::previewLayerOpacity(int id, float opacity)
 	Q_ASSERT(layer);
 	if(!layer)
 		return;
+
+	// The layer stack treats the previewed layer as the hot layer. The composite
+	// of the layers below it is cached, so a dirty tile blends every layer from
+	// the hot layer to the top. (Not just two or three blends: a pre-composited
+	// tile of the layers above rounds differently from blending them one by one,
+	// so it was dropped to keep the result identical to the flattened image.)
 	layer->setOpacity(opacity*255);
 }
 
@@ -488,12 +523,17 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 		return;
 	}
 	
+	// All line segments of the message are drawn as a single batch
+	paintcore::PointVector line;
+	line.reserve(cmd.points().size() + 1);
+	if(ctx.pendown)
+		line << ctx.lastpoint;
+
 	foreach(const protocol::PenPoint &pp, cmd.points()) {
 		paintcore::Point p(pp.x / 4.0, pp.y / 4.0, pp.p/qreal(0xffff));
 		const int r = ctx.tool.brush.fsize(p.pressure())/2 + 1;
 
 		if(ctx.pendown) {
-			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.stroke);
 			ctx.boundingRect |= QRect(p.x() - r, p.y() - r, r*2, r*2);
 
 		} else {
@@ -502,9 +542,12 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 			ctx.boundingRect = QRect(p.x() - r, p.y() - r, r*2, r*2);
 			layer->dab(cmd.contextId(), ctx.tool.brush, p, ctx.stroke);
 		}
+		line << p;
 		ctx.lastpoint = p;
 	}
 
+	layer->drawLines(cmd.contextId(), ctx.tool.brush, line, ctx.stroke);
+
 	if(_showallmarkers || cmd.contextId() != localId())
 		emit userMarkerMove(cmd.contextId(), ctx.lastpoint, 0);
 }
@@ -748,8 +791,83 @@ void StateTracker::makeSavepoint(int pos)
 
 	// Looks like a good spot for a savepoint
 	_savepoints.append(createSavepoint(pos));
+
+	compressSavepoints();
+	swapOutTiles();
 }
 
+/**
+ * @brief Compress old savepoints if tile memory use is over budget
+ *
+ * The tiles held only by the oldest savepoint that has not been compressed
+ * yet are compressed in a background thread. When done, the next savepoint
+ * is compressed, if memory use is still over budget.
+ */
+void StateTracker::compressSavepoints()
+{
+	if(m_compressing || paintcore::TileData::megabytesUsed() <= m_savepointBudget)
+		return;
+
+	// The newest savepoints are the ones most likely to be restored
+	for(int i=0;i<_savepoints.size()-HOT_SAVEPOINTS;++i) {
+		paintcore::Savepoint *sp = _savepoints.at(i)->canvas;
+		if(sp->isCold())
+			continue;
+
+		m_compressing = sp;
+		m_coldTiles = sp->findColdTiles();
+		m_compressor->setFuture(QtConcurrent::run([this]() {
+			paintcore::Savepoint::compressTiles(m_coldTiles);
+		}));
+		return;
+	}
+}
+
+void StateTracker::storeCompressedTiles()
+{
+	paintcore::Savepoint *sp = m_compressing;
+	m_compressing = nullptr;
+
+	// The savepoint may have been deleted while it was being compressed
+	for(const StateSavepoint &s : _savepoints) {
+		if(s->canvas == sp) {
+			sp->storeColdTiles(m_coldTiles);
+			break;
+		}
+	}
+	m_coldTiles.clear();
+
+	compressSavepoints();
+}
+
+/**
+ * @brief Move least recently allocated or paged in tiles to the swap file if over the resident memory limit
+ *
+ * The candidates are the tiles of hidden layers and savepoints. (Loaded index
+ * snapshots are savepoints too.) The layer stack must be locked, so the view
+ * is not reading the tiles.
+ */
+void StateTracker::swapOutTiles()
+{
+	if(!paintcore::tileswap::isOverLimit() || !paintcore::tileswap::isEnabled())
+		return;
+
+	QVector<const paintcore::Tile*> tiles;
+	_image->findSwappableTiles(tiles);
+	for(const StateSavepoint &sp : _savepoints)
+		sp->canvas->findSwappableTiles(tiles);
+
+	paintcore::tileswap::swapOutLeastRecentlyUsed(tiles);
+}
+
+/**
+ * @brief Swap out tiles after being notified that memory use went over the limit
+ */
+void StateTracker::evictTiles()
+{
+	paintcore::LayerStack::Locker lock(_image);
+	swapOutTiles();
+}
 
 void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 {
@@ -25,6 +25,7 @@
 #include "retcon.h"
 #include "core/brush.h"
 #include "core/point.h"
+#include "core/tilestore.h"
 #include "../shared/net/message.h"
 #include "../shared/net/messagestream.h"
 
@@ -51,6 +52,7 @@ namespace paintcore {
 }
 
 class QTimer;
+template<typename T> class QFutureWatcher;
 
 namespace canvas {
 
@@ -170,6 +172,12 @@ public:
 	 */
 	void setMaxHistorySize(uint limit) { m_msgstream_sizelimit = limit; }
 
+	/**
+	 * @brief Set the tile memory use above which old savepoints are compressed
+	 * @param megabytes
+	 */
+	void setSavepointMemoryBudget(int megabytes) { m_savepointBudget = megabytes; }
+
 	/**
 	 * @brief Set if all user markers (own included) should be shown
 	 * @param showall
@@ -269,6 +277,10 @@ private:
 	void handleUndo(protocol::Undo &cmd);
 	void makeSavepoint(int pos);
 	void revertSavepointAndReplay(const StateSavepoint savepoint);
+	void compressSavepoints();
+	void storeCompressedTiles();
+	void swapOutTiles();
+	void evictTiles();
 
 	QHash<int, DrawingContext> _contexts;
 
@@ -284,6 +296,15 @@ private:
 	LocalFork _localfork;
 	QTimer *_localforkCleanupTimer;
 
+	// Delays tile eviction after going over the resident memory limit (see evictTiles())
+	QTimer *m_swapTimer;
+
+	// Old savepoint compression (see compressSavepoints())
+	QFutureWatcher<void> *m_compressor;
+	paintcore::Savepoint *m_compressing;
+	QList<paintcore::ColdTile> m_coldTiles;
+	int m_savepointBudget;
+
 	uint m_msgstream_sizelimit;
 	bool m_fullhistory;
 	bool _showallmarkers;
@@ -195,7 +195,7 @@ void TextCommandLoader::handleLayerAttr(const QString &args)
 		++i;
 	}
 
-	_messages.append(MessagePtr(new protocol::LayerAttributes(ctxid, id, layer.opacity*255, layer.blend)));
+	_messages.append(MessagePtr(new protocol::LayerAttributes(ctxid, id, layer.opacity, layer.blend)));
 }
 
 void TextCommandLoader::handleRetitleLayer(const QString &args)
@@ -19,7 +19,7 @@
 
 #include "brushmask.h"
 
-#include <QCache>
+#include <QMutex>
 
 #include <cmath>
 
@@ -31,7 +31,10 @@ template<typename T> T square(T x) { return x*x; }
 
 typedef QVector<float> LUT;
 static const int LUT_RADIUS = 128;
-static QCache<int, LUT> LUT_CACHE;
+
+// Brush mask parameter quantization
+static const int SIZE_STEPS = 16; // brush diameter is quantized to 1/16th of a pixel
+static const int OFFSET_STEPS = 16; // subpixel offset is quantized to 1/16th of a pixel
 
 // Generate a lookup table for Gimp style exponential brush shape
 // The value at r² (where r is distance from brush center, scaled to LUT_RADIUS) is
@@ -51,20 +54,95 @@ LUT makeGimpStyleBrushLUT(float hardness)
 	return lut;
 }
 
-LUT cachedGimpStyleBrushLUT(float hardness)
+/**
+ * @brief Get a lookup table for the given hardness percentage
+ *
+ * The tables are generated on first use and never freed, so the returned
+ * reference remains valid.
+ */
+const LUT &cachedGimpStyleBrushLUT(int hardness)
 {
-	const int h = hardness * 100;
-	Q_ASSERT(h>=0 && h<=100);
-	if(!LUT_CACHE.contains(h))
-		LUT_CACHE.insert(h, new LUT(makeGimpStyleBrushLUT(hardness)));
+	Q_ASSERT(hardness>=0 && hardness<=100);
+	static LUT luts[101];
+	static QMutex mutex;
+
+	QMutexLocker lock(&mutex);
+	LUT &lut = luts[hardness];
+	if(lut.isEmpty())
+		lut = makeGimpStyleBrushLUT(hardness / 100.0);
 
-	return *LUT_CACHE[h];
+	return lut;
 }
 
-BrushStamp makeMask(const Brush &brush, float pressure)
+/**
+ * @brief Quantized brush stamp parameters
+ *
+ * The brush mask is a function of these parameters only, so a mask
+ * generated for one dab can be reused for any other dab with the same key.
+ */
+struct StampParams {
+	StampParams(const Brush &brush, const Point &point);
+
+	//! Get the cache key for these parameters
+	quint64 key() const {
+		return quint64(size) |
+			(quint64(hardness) << 24) |
+			(quint64(opacity) << 32) |
+			(quint64(xoffset) << 40) |
+			(quint64(yoffset) << 48) |
+			(quint64(subpixel) << 56);
+	}
+
+	bool subpixel;
+	int size;     // brush diameter in 1/SIZE_STEPS pixels
+	int hardness; // 0-100
+	int opacity;  // 0-255
+	int xoffset, yoffset; // subpixel offset in 1/OFFSET_STEPS pixels
+
+	// Stamp position (not part of the key)
+	int x, y;
+};
+
+StampParams::StampParams(const Brush &brush, const Point &point)
+	: subpixel(brush.subpixel()),
+	  size(qBound(0, qRound(brush.fsize(point.pressure()) * SIZE_STEPS), 0xffffff)),
+	  hardness(qBound(0, qRound(brush.hardness(point.pressure()) * 100), 100)),
+	  opacity(qBound(0, qRound(brush.opacity(point.pressure()) * 255), 255)),
+	  xoffset(0), yoffset(0)
 {
-	const float r = brush.fsize(pressure) / 2.0f;
-	const float opacity = brush.opacity(pressure) * 255;
+	if(subpixel) {
+		const float fx = floor(point.x());
+		const float fy = floor(point.y());
+		x = fx;
+		y = fy;
+
+		float xfrac = point.x()-fx;
+		float yfrac = point.y()-fy;
+
+		if(xfrac<0.5) {
+			xfrac += 0.5;
+			x--;
+		} else
+			xfrac -= 0.5;
+
+		if(yfrac<0.5) {
+			yfrac += 0.5;
+			y--;
+		} else
+			yfrac -= 0.5;
+
+		xoffset = qRound(xfrac * OFFSET_STEPS);
+		yoffset = qRound(yfrac * OFFSET_STEPS);
+
+	} else {
+		x = floor(point.x());
+		y = floor(point.y());
+	}
+}
+
+BrushStamp makeMask(float size, int hardness, float opacity)
+{
+	const float r = size / 2.0f;
 
 	// generate mask
 	QVector<uchar> data;
@@ -80,7 +158,7 @@ BrushStamp makeMask(const Brush &brush, float pressure)
 		data[4] = opacity;
 
 	} else {
-		const LUT lut = cachedGimpStyleBrushLUT(brush.hardness(pressure));
+		const LUT &lut = cachedGimpStyleBrushLUT(hardness);
 		const float lut_scale = square((LUT_RADIUS-1) / r);
 
 		float offset;
@@ -120,11 +198,11 @@ BrushStamp makeMask(const Brush &brush, float pressure)
 	return BrushStamp(stampOffset, stampOffset, BrushMask(diameter, data));
 }
 
-BrushStamp makeHighresMask(const Brush &brush, float pressure)
+BrushStamp makeHighresMask(float size, int hardness, float opacity)
 {
 	// we calculate a double sized brush and downsample
-	const float r = brush.fsize(pressure);
-	const float opacity = brush.opacity(pressure) * (255 / 4); // opacity of each subsample
+	const float r = size;
+	opacity = opacity / 255 * (255 / 4); // opacity of each subsample
 
 	int diameter = ceil(r) + 2; // abstract brush is double size, but target diameter is normal
 	float offset = (ceil(r) - r) / -2;
@@ -137,7 +215,7 @@ BrushStamp makeHighresMask(const Brush &brush, float pressure)
 	}
 	const int stampOffset = -diameter/2;
 
-	const LUT lut = cachedGimpStyleBrushLUT(brush.hardness(pressure));
+	const LUT &lut = cachedGimpStyleBrushLUT(hardness);
 	const float lut_scale = square((LUT_RADIUS-1) / r);
 
 	QVector<uchar> data(square(diameter));
@@ -222,50 +300,101 @@ BrushMask offsetMask(const BrushMask &mask, float xfrac, float yfrac)
 	return BrushMask(diameter, data);
 }
 
+/**
+ * @brief Generate a brush stamp
+ *
+ * The returned stamp is positioned relative to the stamp parameter position.
+ */
+BrushStamp makeStamp(const StampParams &params)
+{
+	const float size = params.size / float(SIZE_STEPS);
+	BrushStamp s;
+
+	if(params.subpixel) {
+		// optimization: don't bother with a high resolution mask for large brushes
+		if(size < 8)
+			s = makeHighresMask(size, params.hardness, params.opacity);
+		else
+			s = makeMask(size, params.hardness, params.opacity);
+
+		s.mask = offsetMask(s.mask, params.xoffset / float(OFFSET_STEPS), params.yoffset / float(OFFSET_STEPS));
+
+	} else {
+		s = makeMask(size, params.hardness, params.opacity);
+	}
+
+	return s;
+}
+
 }
 
 BrushStamp makeGimpStyleBrushStamp(const Brush &brush, const Point &point)
 {
-	BrushStamp s;
+	const StampParams params(brush, point);
 
-	if(brush.subpixel()) {
-		// optimization: don't bother with a high resolution mask for large brushes
-		float radius = brush.fsize(point.pressure());
+	BrushStamp s = makeStamp(params);
+	s.left += params.x;
+	s.top += params.y;
 
-		if(radius < 8)
-			s = makeHighresMask(brush, point.pressure());
-		else
-			s = makeMask(brush, point.pressure());
+	return s;
+}
 
-		const float fx = floor(point.x());
-		const float fy = floor(point.y());
-		s.left += fx;
-		s.top += fy;
+/**
+ * The stamp parameters are quantized exactly as in makeGimpStyleBrushStamp(),
+ * and the size is monotonic in pressure, so checking the extremes is enough.
+ */
+bool isSinglePixelBrush(const Brush &brush)
+{
+	if(brush.subpixel())
+		return false;
 
-		float xfrac = point.x()-fx;
-		float yfrac = point.y()-fy;
+	// See makeMask(): radius below one means a single pixel stamp
+	return StampParams(brush, Point(0, 0, 0)).size < 2 * SIZE_STEPS &&
+		StampParams(brush, Point(0, 0, 1)).size < 2 * SIZE_STEPS;
+}
 
-		if(xfrac<0.5) {
-			xfrac += 0.5;
-			s.left--;
-		} else
-			xfrac -= 0.5;
+uchar singlePixelStampValue(const Brush &brush, qreal pressure)
+{
+	return StampParams(brush, Point(0, 0, pressure)).opacity;
+}
 
-		if(yfrac<0.5) {
-			yfrac += 0.5;
-			s.top--;
-		} else
-			yfrac -= 0.5;
+BrushMaskCache::BrushMaskCache(int budget)
+	: m_cache(budget), m_hits(0), m_misses(0)
+{
+}
+
+/**
+ * The brush parameters are quantized exactly as in makeGimpStyleBrushStamp,
+ * so the result is the same whether the stamp was found in the cache or not.
+ */
+BrushStamp BrushMaskCache::stamp(const Brush &brush, const Point &point)
+{
+	const StampParams params(brush, point);
+	const quint64 key = params.key();
 
-		s.mask = offsetMask(s.mask, xfrac, yfrac);
+	BrushStamp s;
+	const BrushStamp *cached = m_cache.object(key);
+	if(cached) {
+		m_hits.fetch_add(1, std::memory_order_relaxed);
+		s = *cached;
 
 	} else {
-		s = makeMask(brush, point.pressure());
-		s.left += point.x();
-		s.top += point.y();
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		s = makeStamp(params);
+		m_cache.insert(key, new BrushStamp(s), square(s.mask.diameter()));
 	}
 
+	s.left += params.x;
+	s.top += params.y;
+
 	return s;
 }
 
+void BrushMaskCache::clear()
+{
+	m_cache.clear();
+	m_hits.store(0, std::memory_order_relaxed);
+	m_misses.store(0, std::memory_order_relaxed);
+}
+
 }
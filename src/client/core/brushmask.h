@@ -23,6 +23,9 @@
 #include "point.h"
 
 #include <QVector>
+#include <QCache>
+
+#include <atomic>
 
 namespace paintcore {
 
@@ -63,8 +66,72 @@ struct BrushStamp {
 	BrushStamp(int x, int y, const BrushMask &m) : left(x), top(y), mask(m) { }
 };
 
+/**
+ * @brief Generate a brush stamp for a dab
+ *
+ * The brush size, hardness, opacity and subpixel offset are quantized
+ * before the mask is generated.
+ */
 BrushStamp makeGimpStyleBrushStamp(const Brush &brush, const Point &point);
 
+/**
+ * @brief Does the brush produce single pixel stamps at every pressure level?
+ *
+ * A single pixel stamp is a 3x3 mask where only the center pixel is nonzero.
+ * Its value is given by singlePixelStampValue().
+ */
+bool isSinglePixelBrush(const Brush &brush);
+
+//! Get the center value of a single pixel stamp
+uchar singlePixelStampValue(const Brush &brush, qreal pressure);
+
+/**
+ * @brief A least recently used cache of brush stamps
+ *
+ * Since the brush parameters are quantized, most dabs of a stroke
+ * can reuse a previously generated mask. The oldest masks are discarded
+ * when the total size exceeds the memory budget.
+ *
+ * This class is not thread safe.
+ */
+class BrushMaskCache
+{
+public:
+	//! Default memory budget in bytes
+	static const int DEFAULT_BUDGET = 8 * 1024 * 1024;
+
+	explicit BrushMaskCache(int budget=DEFAULT_BUDGET);
+
+	//! Get a brush stamp (see makeGimpStyleBrushStamp())
+	BrushStamp stamp(const Brush &brush, const Point &point);
+
+	//! Set the memory budget in bytes
+	void setBudget(int bytes) { m_cache.setMaxCost(bytes); }
+
+	//! Get the memory budget in bytes
+	int budget() const { return m_cache.maxCost(); }
+
+	//! Get the total size of the cached masks in bytes
+	int bytesUsed() const { return m_cache.totalCost(); }
+
+	//! Get the number of cached masks
+	int count() const { return m_cache.count(); }
+
+	//! Get the number of stamps found in the cache (safe to call from any thread)
+	quint64 hits() const { return m_hits.load(std::memory_order_relaxed); }
+
+	//! Get the number of stamps that had to be generated (safe to call from any thread)
+	quint64 misses() const { return m_misses.load(std::memory_order_relaxed); }
+
+	//! Remove all masks from the cache and reset the statistics
+	void clear();
+
+private:
+	QCache<quint64, BrushStamp> m_cache;
+	std::atomic<quint64> m_hits;
+	std::atomic<quint64> m_misses;
+};
+
 }
 
 #endif
@@ -22,8 +22,11 @@
 #include "layer.h"
 
 #include <QStack>
-#include <QPainter>
 #include <QVarLengthArray>
+#include <QtConcurrent>
+
+#include <numeric>
+#include <cmath>
 
 namespace paintcore {
 
@@ -33,63 +36,105 @@ class Floodfill {
 public:
 	Floodfill(const LayerStack *image, int sourceLayer, bool merge, const QColor &color, int colorTolerance) :
 		source(image),
-		scratch(0, 0, QString(), Qt::transparent, image->size()),
-		fill(0, 0, QString(), Qt::transparent, image->size()),
+		width(image->width()),
+		height(image->height()),
+		scratch(Tile::roundTiles(width), Tile::roundTiles(height)),
+		fill(scratch.xtiles(), scratch.ytiles()),
+		fetched(scratch.size(), false),
+		left(width), top(height), right(-1), bottom(-1),
 		layer(sourceLayer),
 		merge(merge),
 		fillColor(color.rgba()),
+		fillPixel(Tile::fromArgb(color.rgba())),
+		layerSeedColor(0),
 		tolerance(colorTolerance)
 	{ }
 
-	Tile &scratchTile(int x, int y)
+	/**
+	 * @brief Fetch a source tile into the scratch map
+	 *
+	 * In merged mode, flattening is the expensive part, so the unfetched
+	 * tiles of the aligned block around the requested tile are flattened
+	 * in parallel. The fill is likely to need them next.
+	 */
+	void fetchTile(int tx, int ty)
 	{
-		Tile &t = scratch.rtile(x, y);
-		if(t.isNull()) {
-			if(merge) {
-				t = source->getFlatTile(x, y);
-			} else {
-				const Layer *sl = source->getLayer(layer);
-				Q_ASSERT(sl);
-				const Tile &st = sl->tile(x, y);
-				if(st.isNull())
-					t = Tile(Qt::transparent);
-				else
-					t = st;
+		if(merge) {
+			const int x0 = tx - tx % PREFETCH_BLOCK;
+			const int y0 = ty - ty % PREFETCH_BLOCK;
+			const int x1 = qMin(x0 + PREFETCH_BLOCK, scratch.xtiles());
+			const int y1 = qMin(y0 + PREFETCH_BLOCK, scratch.ytiles());
+
+			QVector<QPoint> tiles;
+			for(int y=y0;y<y1;++y) {
+				for(int x=x0;x<x1;++x) {
+					const int i = y * scratch.xtiles() + x;
+					if(!fetched.at(i)) {
+						tiles.append(QPoint(x, y));
+						fetched[i] = true;
+					}
+				}
 			}
-		}
 
-		return t;
-	}
+			// Allocate the tile slots up front: rtile() is not thread safe
+			QVector<Tile*> targets;
+			targets.reserve(tiles.size());
+			for(const QPoint &p : tiles)
+				targets.append(&scratch.rtile(p.x(), p.y()));
 
-	Tile &fillTile(int x, int y) {
-		Tile &t = fill.rtile(x, y);
-		if(t.isNull())
-			t = Tile(Qt::transparent);
+			QVector<int> indices(tiles.size());
+			std::iota(indices.begin(), indices.end(), 0);
 
-		return t;
-	}
-
-	QRgb colorAt(int x, int y)
-	{
-		int tx = x / Tile::SIZE;
-		int ty = y / Tile::SIZE;
-		x = x - tx * Tile::SIZE;
-		y = y - ty * Tile::SIZE;
+			QtConcurrent::blockingMap(indices, [this, &tiles, &targets](int i) {
+				*targets[i] = source->getFlatTile(tiles[i].x(), tiles[i].y());
+			});
 
-		const Tile &t = scratchTile(tx, ty);
+		} else {
+			const Layer *sl = source->getLayer(layer);
+			Q_ASSERT(sl);
 
-		return t.data()[y*Tile::SIZE + x];
+			// The tile is shared with the layer until the fill writes to it
+			scratch.rtile(tx, ty) = sl->tile(tx, ty);
+			fetched[ty * scratch.xtiles() + tx] = true;
+		}
 	}
 
-	void setPixel(int x, int y) {
-		int tx = x / Tile::SIZE;
-		int ty = y / Tile::SIZE;
-		x = x - tx * Tile::SIZE;
-		y = y - ty * Tile::SIZE;
+	//! Get a pixel row of a scratch tile for reading
+	const quint32 *scratchRow(int tx, int y)
+	{
+		const int ty = y / Tile::SIZE;
+		if(!fetched.at(ty * scratch.xtiles() + tx))
+			fetchTile(tx, ty);
+
+		const Tile &t = scratch.tile(tx, ty);
+		if(t.isUniform()) {
+			// Read uniform tiles without giving them pixel data
+			std::fill(uniformRow, uniformRow+Tile::SIZE, t.rawPixel(0, 0));
+			return uniformRow;
+		}
+		return t.data() + (y - ty*Tile::SIZE) * Tile::SIZE;
+	}
 
-		int i = y*Tile::SIZE+x;
-		scratchTile(tx, ty).data()[i] = fillColor;
-		fillTile(tx, ty).data()[i] = fillColor;
+	//! Fill pixels x0..x1 (inclusive) of a row that is contained in a single tile
+	void fillSpan(int x0, int x1, int y)
+	{
+		const int tx = x0 / Tile::SIZE;
+		const int ty = y / Tile::SIZE;
+		Q_ASSERT(x1 / Tile::SIZE == tx);
+
+		const int offset = (y - ty*Tile::SIZE) * Tile::SIZE + x0 - tx*Tile::SIZE;
+		const int len = x1 - x0 + 1;
+
+		// The scratch tile is updated too, so filled pixels won't be visited again
+		quint32 *s = scratch.rtile(tx, ty).data() + offset;
+		quint32 *f = fill.rtile(tx, ty).data() + offset;
+		std::fill(s, s+len, fillPixel);
+		std::fill(f, f+len, fillPixel);
+
+		left = qMin(left, x0);
+		right = qMax(right, x1);
+		top = qMin(top, y);
+		bottom = qMax(bottom, y);
 	}
 
 	bool isSameColor(QRgb c1, QRgb c2) {
@@ -101,13 +146,92 @@ public:
 		return r*r + g*g + b*b + a*a <= tolerance * tolerance;
 	}
 
-	inline bool isOldColorAt(int x, int y) {
-		return isSameColor(colorAt(x, y), oldColor);
+	//! Does the pixel (in the tile storage format) match the seed color?
+	inline bool isOldPixel(quint32 pixel) {
+		return pixel == oldPixel || isSameColor(Tile::toArgb(pixel), oldColor);
+	}
+
+	/**
+	 * @brief Find the leftmost matching pixel of the span that contains x
+	 *
+	 * The pixel at x must match.
+	 */
+	int spanLeft(int x, int y)
+	{
+		while(x>0) {
+			const int tx = (x-1) / Tile::SIZE;
+			const int tileLeft = tx * Tile::SIZE;
+			const quint32 *row = scratchRow(tx, y);
+
+			int i = x - 1 - tileLeft;
+			while(i>=0 && isOldPixel(row[i]))
+				--i;
+
+			x = tileLeft + i + 1;
+			if(i>=0)
+				break;
+		}
+		return x;
+	}
+
+	/**
+	 * @brief Find the rightmost matching pixel of the span that contains x
+	 *
+	 * The pixel at x must match.
+	 */
+	int spanRight(int x, int y)
+	{
+		const int w1 = width - 1;
+		while(x<w1) {
+			const int tx = (x+1) / Tile::SIZE;
+			const int tileLeft = tx * Tile::SIZE;
+			const int end = qMin(Tile::SIZE, width - tileLeft);
+			const quint32 *row = scratchRow(tx, y);
+
+			int i = x + 1 - tileLeft;
+			while(i<end && isOldPixel(row[i]))
+				++i;
+
+			x = tileLeft + i - 1;
+			if(i<end)
+				break;
+		}
+		return x;
+	}
+
+	/**
+	 * @brief Push a seed for each run of matching pixels on row y between x0 and x1
+	 */
+	void pushSeeds(int x0, int x1, int y, QStack<QPoint> &stack)
+	{
+		bool inRun = false;
+		for(int tx=x0/Tile::SIZE;tx<=x1/Tile::SIZE;++tx) {
+			const int tileLeft = tx * Tile::SIZE;
+			const int start = qMax(x0 - tileLeft, 0);
+			const int end = qMin(x1 - tileLeft + 1, Tile::SIZE);
+			const quint32 *row = scratchRow(tx, y);
+
+			for(int i=start;i<end;++i) {
+				if(isOldPixel(row[i])) {
+					if(!inRun) {
+						stack.push(QPoint(tileLeft + i, y));
+						inRun = true;
+					}
+				} else {
+					inRun = false;
+				}
+			}
+		}
 	}
 
 	void start(const QPoint &startPoint)
 	{
-		oldColor = colorAt(startPoint.x(), startPoint.y());
+		{
+			const int tx = startPoint.x() / Tile::SIZE;
+			oldPixel = scratchRow(tx, startPoint.y())[startPoint.x() - tx*Tile::SIZE];
+			oldColor = Tile::toArgb(oldPixel);
+		}
+
 		if(isSameColor(oldColor, fillColor))
 			return;
 
@@ -127,60 +251,62 @@ public:
 		QStack<QPoint> stack;
 		stack.push(startPoint);
 
-		const int w1 = scratch.width()-1;
+		const int h1 = height-1;
 
 		while(!stack.isEmpty()) {
-			QPoint p = stack.pop();
-
-			const int x = p.x();
-			int y = p.y();
+			const QPoint p = stack.pop();
+			const int y = p.y();
 
-			bool spanLeft = false;
-			bool spanRight = false;
+			// The seed may have been filled after it was pushed
+			const int tx = p.x() / Tile::SIZE;
+			if(!isOldPixel(scratchRow(tx, y)[p.x() - tx*Tile::SIZE]))
+				continue;
 
-			while(y>=0 && isOldColorAt(x, y)) --y;
-			++y;
+			const int x0 = spanLeft(p.x(), y);
+			const int x1 = spanRight(p.x(), y);
 
-			while(y < scratch.height() && isOldColorAt(x, y)) {
-				setPixel(x, y);
+			for(int x=x0;x<=x1;x=Tile::roundDown(x)+Tile::SIZE)
+				fillSpan(x, qMin(x1, Tile::roundDown(x)+Tile::SIZE-1), y);
 
-				if(!spanLeft && x>0 && isOldColorAt(x-1, y)) {
-					stack.push(QPoint(x-1, y));
-					spanLeft = true;
-
-				} else if(spanLeft && x>0 && !isOldColorAt(x-1, y)) {
-					spanLeft = false;
-
-				} else if(!spanRight && x<w1 && isOldColorAt(x+1, y)) {
-					stack.push(QPoint(x+1, y));
-					spanRight = true;
-
-				} else if(spanRight && x<w1 && !isOldColorAt(x+1, y)) {
-					spanRight = false;
-				}
-				++y;
-			}
+			if(y>0)
+				pushSeeds(x0, x1, y-1, stack);
+			if(y<h1)
+				pushSeeds(x0, x1, y+1, stack);
 		}
 	}
 
 	FillResult result() const
 	{
 		FillResult res;
-		res.image = fill.toCroppedImage(&res.x, &res.y);
+		res.tiles = fill;
+		if(right>=0)
+			res.bounds = QRect(QPoint(left, top), QPoint(right, bottom));
 		res.layerSeedColor = layerSeedColor;
 		return res;
 	}
 
 private:
+	// Size (in tiles) of the blocks that are flattened together in merged mode
+	static const int PREFETCH_BLOCK = 4;
 
 	const LayerStack *source;
+	int width, height;
 
-	// The (optionally) merged tile from the image. This layer is also
+	// The (optionally) merged tiles from the image. These are also
 	// updated during the fill.
-	Layer scratch;
+	TileMap scratch;
+
+	// The filled pixels
+	TileMap fill;
 
-	// The fill layer, containing just the filled pixels
-	Layer fill;
+	// Scratch tiles fetched so far
+	QVector<bool> fetched;
+
+	// Row buffer for reading uniform scratch tiles
+	quint32 uniformRow[Tile::SIZE];
+
+	// Bounding rectangle of the filled pixels
+	int left, top, right, bottom;
 
 	// Target layer
 	int layer;
@@ -191,8 +317,12 @@ private:
 	// Fill color
 	QRgb fillColor;
 
+	// Fill color in the tile storage format
+	quint32 fillPixel;
+
 	// Seed color
 	QRgb oldColor;
+	quint32 oldPixel;
 	QRgb layerSeedColor;
 
 	// Color matching tolerance
@@ -200,42 +330,222 @@ private:
 };
 
 /**
- * @brief find the bounding rectangle of non-transparent content
+ * @brief Get the vertical distance to the nearest non-transparent pixel in each column
+ *
+ * The distances are written to the output image, which is used as scratch space.
+ * Distances greater than the radius are stored as radius+1.
+ */
+void columnDistances(const uchar *in, uchar *out, int stride, const QRect &bounds, int radius, int x0, int x1)
+{
+	const quint32 far = radius + 1;
+
+	// Downward pass: distance to the nearest pixel above (or at) this one
+	for(int y=bounds.top();y<=bounds.bottom();++y) {
+		const uchar *alpha = in + y*stride + 3;
+		quint32 *dist = reinterpret_cast<quint32*>(out + y*stride);
+		const quint32 *above = y>bounds.top() ? dist - stride/4 : nullptr;
+
+		for(int x=x0;x<x1;++x) {
+			if(alpha[x*4])
+				dist[x] = 0;
+			else if(above)
+				dist[x] = qMin(above[x] + 1, far);
+			else
+				dist[x] = far;
+		}
+	}
+
+	// Upward pass: distance to the nearest pixel below
+	for(int y=bounds.bottom()-1;y>=bounds.top();--y) {
+		quint32 *dist = reinterpret_cast<quint32*>(out + y*stride);
+		const quint32 *below = dist + stride/4;
+
+		for(int x=x0;x<x1;++x)
+			dist[x] = qMin(dist[x], below[x] + 1);
+	}
+}
+
+/**
+ * @brief Fill the pixels of a row that are within the radius from a non-transparent pixel
+ *
+ * This uses the lower envelope of parabolas method from Felzenszwalb & Huttenlocher's
+ * "Distance Transforms of Sampled Functions" to calculate the squared euclidean distance
+ * from the column distances of the row.
+ *
+ * @param row the row (column distances in, fill color out)
+ * @param v scratch buffer for parabola positions
+ * @param z scratch buffer for parabola boundaries
+ */
+void fillRowWithinRadius(quint32 *row, int x0, int x1, int radius, QRgb color, int *v, double *z)
+{
+	// Squared distances don't fit in an int on very wide canvases
+	const int n = x1 - x0;
+	const quint32 *g = row + x0;
+	const qint64 RR = qint64(radius) * radius;
+
+	// Build the lower envelope. Columns further away than the radius are skipped.
+	int k = -1;
+	for(int q=0;q<n;++q) {
+		if(int(g[q]) > radius)
+			continue;
+
+		const qint64 fq = qint64(g[q])*g[q] + qint64(q)*q;
+		if(k<0) {
+			k = 0;
+			v[0] = q;
+			z[0] = -HUGE_VAL;
+			z[1] = HUGE_VAL;
+			continue;
+		}
+
+		double s;
+		while(true) {
+			const int p = v[k];
+			s = double(fq - (qint64(g[p])*g[p] + qint64(p)*p)) / (2.0 * (q - p));
+			if(s > z[k])
+				break;
+			--k;
+		}
+		++k;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = HUGE_VAL;
+	}
+
+	quint32 *out = row + x0;
+	if(k<0) {
+		std::fill(out, out+n, 0);
+		return;
+	}
+
+	// Sample the envelope. The distance values are overwritten as we go, so the
+	// distances of the parabola positions are saved first.
+	const int last = k;
+	QVarLengthArray<qint64> f(last+1);
+	for(int i=0;i<=last;++i)
+		f[i] = qint64(g[v[i]]) * g[v[i]];
+
+	k = 0;
+	for(int q=0;q<n;++q) {
+		while(z[k+1] < q)
+			++k;
+		const qint64 dx = q - v[k];
+		out[q] = dx*dx + f[k] <= RR ? color : 0;
+	}
+}
+
+/**
+ * @brief Fill the pixels within the radius from non-transparent input pixels
+ *
+ * The running time does not depend on the radius. Column bands and then row bands
+ * are processed in parallel.
+ *
+ * @param in the input image
+ * @param out the output image (same size as input)
+ * @param bounds the area to fill. Everything outside must be further than radius away from any input pixels
+ * @param radius the expansion radius
+ * @param color the fill color
+ */
+void expandAlpha(const QImage &in, QImage &out, const QRect &bounds, int radius, QRgb color)
+{
+	static const int BAND = 64;
+
+	Q_ASSERT(in.bytesPerLine() == out.bytesPerLine());
+	const int stride = out.bytesPerLine();
+	const uchar *inBits = in.constBits();
+	uchar *outBits = out.bits();
+
+	QVector<int> columnBands;
+	for(int x=bounds.left();x<=bounds.right();x+=BAND)
+		columnBands.append(x);
+
+	QtConcurrent::blockingMap(columnBands, [inBits, outBits, stride, &bounds, radius](int x0) {
+		columnDistances(inBits, outBits, stride, bounds, radius, x0, qMin(x0 + BAND, bounds.right() + 1));
+	});
+
+	QVector<int> rowBands;
+	for(int y=bounds.top();y<=bounds.bottom();y+=BAND)
+		rowBands.append(y);
+
+	QtConcurrent::blockingMap(rowBands, [outBits, stride, &bounds, radius, color](int y0) {
+		const int n = bounds.width();
+		QVector<int> v(n);
+		QVector<double> z(n+1);
+
+		const int y1 = qMin(y0 + BAND, bounds.bottom() + 1);
+		for(int y=y0;y<y1;++y) {
+			quint32 *row = reinterpret_cast<quint32*>(outBits + y*stride);
+			fillRowWithinRadius(row, bounds.left(), bounds.right() + 1, radius, color, v.data(), z.data());
+		}
+	});
+}
+
+/**
+ * @brief Convert an image into a sparse tile map
+ *
+ * Tiles with no non-transparent pixels are left null.
  *
- * An empty rectangle is returned if the whole image is transparent
- * @param image
+ * @param image the image to convert
+ * @param offset image position in canvas coordinates
  */
-QRect findOpaqueBoundingRect(const QImage &image)
+TileMap imageToTiles(const QImage &image, const QPoint &offset)
 {
-	Q_ASSERT(image.depth()==32);
-	Q_ASSERT(!image.isNull());
-
-	int top=image.height(), bottom=0;
-	int left=image.width(), right=0;
-
-	const uchar *alpha = image.bits()+3;
-	for(int y=0;y<image.height();++y) {
-		for(int x=0;x<image.width();++x, alpha+=4) {
-			if(*alpha) {
-				if(x<left)
-					left=x;
-				if(x>right)
-					right=x;
-				if(y<top)
-					top=y;
-				if(y>bottom)
-					bottom=y;
+	Q_ASSERT(image.format() == QImage::Format_ARGB32);
+	const QRect rect(offset, image.size());
+	TileMap tiles(Tile::roundTiles(rect.right()+1), Tile::roundTiles(rect.bottom()+1));
+
+	for(int ty=rect.top()/Tile::SIZE;ty<tiles.ytiles();++ty) {
+		for(int tx=rect.left()/Tile::SIZE;tx<tiles.xtiles();++tx) {
+			const QRect r = rect & QRect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+
+			Tile t;
+			quint32 *pixels = t.data();
+			quint32 alpha = 0;
+			for(int y=r.top();y<=r.bottom();++y) {
+				const quint32 *src = reinterpret_cast<const quint32*>(image.constScanLine(y - rect.top())) + r.left() - rect.left();
+				quint32 *dest = pixels + (y - ty*Tile::SIZE) * Tile::SIZE + r.left() - tx*Tile::SIZE;
+				for(int x=0;x<r.width();++x) {
+					dest[x] = Tile::fromArgb(src[x]);
+					alpha |= src[x];
+				}
 			}
+
+			if(alpha & 0xff000000)
+				tiles.rtile(tx, ty) = t;
 		}
 	}
 
-	if(top>bottom || left>right)
-		return QRect();
-	return QRect(QPoint(left, top), QPoint(right, bottom));
+	return tiles;
 }
 
 }
 
+QImage FillResult::toImage() const
+{
+	if(isEmpty())
+		return QImage();
+
+	QImage image(bounds.size(), QImage::Format_ARGB32);
+	image.fill(0);
+
+	for(int ty=bounds.top()/Tile::SIZE;ty<=bounds.bottom()/Tile::SIZE;++ty) {
+		for(int tx=bounds.left()/Tile::SIZE;tx<=bounds.right()/Tile::SIZE;++tx) {
+			const Tile &t = tiles.tile(tx, ty);
+			if(t.isNull())
+				continue;
+
+			const QRect r = bounds & QRect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+			for(int y=r.top();y<=r.bottom();++y) {
+				quint32 *dest = reinterpret_cast<quint32*>(image.scanLine(y - bounds.top())) + r.left() - bounds.left();
+				for(int x=r.left();x<=r.right();++x)
+					*(dest++) = t.pixel(x - tx*Tile::SIZE, y - ty*Tile::SIZE);
+			}
+		}
+	}
+
+	return image;
+}
+
 FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge)
 {
 	Q_ASSERT(image);
@@ -251,11 +561,9 @@ FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor
 
 FillResult expandFill(const FillResult &input, int expansion, const QColor &color)
 {
-	if(input.image.isNull() || expansion<1)
+	if(input.isEmpty() || expansion<1)
 		return input;
 
-	Q_ASSERT(input.image.format() == QImage::Format_ARGB32);
-
 	FillResult out;
 
 	out.layerSeedColor = input.layerSeedColor;
@@ -263,95 +571,52 @@ FillResult expandFill(const FillResult &input, int expansion, const QColor &colo
 	const int R = expansion;
 	const int D = R*2 + 1;
 
-	// Step 1. Pad image to make sure there is room for expansion
-	QRect BOUNDS = findOpaqueBoundingRect(input.image);
-	if(BOUNDS.isEmpty())
-		return input;
-
-	QImage inputImg;
-	if(QRect(0, 0, input.image.width(), input.image.height()).contains(BOUNDS.adjusted(-D,-D,D,D))) {
-		// Original image has enough padding around the content
-		inputImg = input.image;
-		out.x = input.x;
-		out.y = input.y;
-
-	} else {
-		// Not enough padding: add some
-		inputImg = QImage(input.image.width() + 2*D, input.image.height() + 2*D, input.image.format());
-		inputImg.fill(0);
-
-		QPainter p(&inputImg);
-		p.drawImage(D, D, input.image);
-
-		out.x = input.x - D;
-		out.y = input.y - D;
-		BOUNDS.translate(D, D);
-	}
-
-	// Step 2. Generate convolution matrix for expanding the alpha channel
-	QVarLengthArray<int> kernel(D*D);
-	int i=0;
-	const int RR = R*R;
-	for(int y=0;y<D;++y) {
-		const int y0 = y-R;
-		for(int x=0;x<D;++x) {
-			const int x0 = x-R;
-			// TODO use a gaussian kernel?
-			kernel[i++] = x0*x0 + y0*y0 <= RR;
-		}
+	// Step 1. Pad the image to make sure there is room for expansion.
+	// The fill bounds are exact, so the content touches every edge.
+	const QImage fillImage = input.toImage();
+	QImage inputImg(fillImage.width() + 2*D, fillImage.height() + 2*D, fillImage.format());
+	inputImg.fill(0);
+	for(int y=0;y<fillImage.height();++y) {
+		memcpy(inputImg.scanLine(y+D) + D*4, fillImage.constScanLine(y), fillImage.width() * 4);
 	}
-	Q_ASSERT(i==kernel.length());
 
-	// Step 3. Generate expanded image
-	out.image = QImage(inputImg.width(), inputImg.height(), inputImg.format());
-	out.image.fill(0);
+	int outx = input.bounds.x() - D;
+	int outy = input.bounds.y() - D;
+	const QRect BOUNDS(D, D, fillImage.width(), fillImage.height());
 
-	const uchar *alphaIn = inputImg.bits()+3;
-	const QRgb fillColor = color.rgba();
-	quint32 *colorOut = reinterpret_cast<quint32*>(out.image.bits());
+	// Step 2. Generate expanded image
+	QImage expanded(inputImg.width(), inputImg.height(), inputImg.format());
+	expanded.fill(0);
 
 	// Optimization: skip extra padding
-	QRect expBounds = BOUNDS.adjusted(-R, -R, R+1, R+1);
+	const QRect expBounds = BOUNDS.adjusted(-R, -R, R, R);
 	Q_ASSERT(QRect(0, 0, inputImg.width(), inputImg.height()).contains(expBounds));
 
-	for(int y=expBounds.top();y<expBounds.bottom();++y) {
-		for(int x=expBounds.left();x<expBounds.right();++x) {
-			int i=0, a=0;
-			for(int ky=y-R;ky<=y+R;++ky) {
-				for(int kx=x-R;kx<=x+R;++kx) {
-					a += alphaIn[ky*inputImg.bytesPerLine() + 4*kx] * kernel[i++];
-				}
-			}
-			Q_ASSERT(i==kernel.length());
-
-			// TODO adjustable threshold
-			if(a>0) {
-				int j = y*inputImg.width() + x;
-				Q_ASSERT(j <= out.image.width() * out.image.height());
-				colorOut[j] = fillColor;
-			}
-		}
-	}
+	expandAlpha(inputImg, expanded, expBounds, R, color.rgba());
+	const QRect expandedRect = expBounds.translated(outx, outy);
 
-	// Step 4. Crop image in case of negative offset
+	// Step 3. Crop image in case of negative offset
 	// (since the protocol doesn't support signed PutImage coordinates)
-	if(out.x<0 || out.y<0) {
-		const int cropx = out.x<0 ? -out.x : 0;
-		const int cropy = out.y<0 ? -out.y : 0;
+	if(outx<0 || outy<0) {
+		const int cropx = outx<0 ? -outx : 0;
+		const int cropy = outy<0 ? -outy : 0;
 
-		Q_ASSERT(cropx < out.image.width());
-		Q_ASSERT(cropy < out.image.height());
+		Q_ASSERT(cropx < expanded.width());
+		Q_ASSERT(cropy < expanded.height());
 
-		QImage cropped = QImage(out.image.width() - cropx, out.image.height() - cropy, out.image.format());
+		QImage cropped = QImage(expanded.width() - cropx, expanded.height() - cropy, expanded.format());
 		for(int y=0;y<cropped.height();++y) {
-			memcpy(cropped.scanLine(y), out.image.scanLine(y+cropy) + cropx*4, cropped.width() * 4);
+			memcpy(cropped.scanLine(y), expanded.scanLine(y+cropy) + cropx*4, cropped.width() * 4);
 		}
 
-		out.image = cropped;
-		out.x += cropx;
-		out.y += cropy;
+		expanded = cropped;
+		outx += cropx;
+		outy += cropy;
 	}
 
+	out.tiles = imageToTiles(expanded, QPoint(outx, outy));
+	out.bounds = expandedRect & QRect(QPoint(outx, outy), expanded.size());
+
 	// All done!
 	return out;
 }
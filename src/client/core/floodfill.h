@@ -20,6 +20,8 @@
 #ifndef FLOODFILL_H
 #define FLOODFILL_H
 
+#include "tilemap.h"
+
 #include <QImage>
 
 namespace paintcore {
@@ -27,17 +29,20 @@ namespace paintcore {
 class LayerStack;
 
 struct FillResult {
-	//! The fill bitmap.
-	QImage image;
-
-	//! bitmap X offset
-	int x;
+	//! The filled tiles. Tiles with no filled pixels are null.
+	TileMap tiles;
 
-	//! bitmap Y offset
-	int y;
+	//! Bounding rectangle of the filled pixels
+	QRect bounds;
 
 	//! The pixel value of the point on the target layer where the fill started
 	QRgb layerSeedColor;
+
+	//! Was nothing filled?
+	bool isEmpty() const { return bounds.isEmpty(); }
+
+	//! Get the fill bitmap cropped to the bounding rectangle
+	QImage toImage() const;
 };
 
 /**
@@ -49,7 +54,7 @@ struct FillResult {
  * @param tolerance color matching tolerance
  * @param layer the active layer
  * @param merge if true, use merged pixel values from all layers
- * @return fill bitmap
+ * @return filled tiles
  */
 FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge);
 
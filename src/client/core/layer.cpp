@@ -21,12 +21,15 @@
 #include <QtConcurrent>
 #include <QDataStream>
 #include <cmath>
+#include <algorithm>
+#include <numeric>
 
 #include "layerstack.h"
 #include "layer.h"
 #include "tile.h"
 #include "brush.h"
 #include "brushmask.h"
+#include "tileintern.h"
 #include "point.h"
 #include "blendmodes.h"
 #include "rasterop.h"
@@ -116,7 +119,10 @@ Layer::Layer(LayerStack *owner, int id, const QString& title, const QColor& colo
 Layer::Layer(LayerStack *owner, int id, const QSize &size)
 	: Layer(owner, id, "", Qt::transparent, size)
 {
-	// sublayers are used for indirect drawing and previews
+	// sublayers are used for indirect drawing and previews.
+	// They are short lived and usually touch just a few tiles, so
+	// keep track of the touched tiles to make merging and removal fast.
+	m_tiles.setTouchTracking(true);
 }
 
 Layer::Layer(const Layer &layer)
@@ -154,15 +160,16 @@ void Layer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
+	TileMap tiles(xtiles, ytiles);
+	tiles.setTouchTracking(m_tiles.isTrackingTouches());
 
 	// if there is no old content, resizing is simple
-	bool hascontent = false;
-	for(int i=0;i<m_tiles.count();++i) {
-		if(!m_tiles.at(i).isBlank()) {
-			hascontent = true;
-			break;
-		}
+	bool hascontent = !m_tiles.fillTile().isBlank();
+	if(!hascontent) {
+		m_tiles.forEachStored([&hascontent](int, const Tile &t) {
+			if(!hascontent && !t.isBlank())
+				hascontent = true;
+		});
 	}
 	if(!hascontent) {
 		m_width = width;
@@ -218,20 +225,24 @@ void Layer::resize(int top, int right, int bottom, int left)
 		const int firstrow = Tile::roundTiles(-top);
 		const int firstcol = Tile::roundTiles(-left);
 
-		int oldy = firstrow;
-		for(int y=0;y<ytiles;++y,++oldy) {
-			int oldx = firstcol;
-			const int oldyy = m_xtiles * oldy;
-			const int yy = xtiles * y;
-			for(int x=0;x<xtiles;++x,++oldx) {
-				const int i = yy + x;
+		tiles.fill(bgtile);
 
-				if(oldy<0 || oldy>=m_ytiles || oldx<0 || oldx>=m_xtiles) {
-					tiles[i] = bgtile;
+		if(m_tiles.fillTile() == bgtile) {
+			// Only the stored tiles need to be moved
+			m_tiles.forEachStored([this, &tiles, firstrow, firstcol, xtiles, ytiles](int i, const Tile &t) {
+				const int x = i % m_xtiles - firstcol;
+				const int y = i / m_xtiles - firstrow;
+				if(x>=0 && x<xtiles && y>=0 && y<ytiles && t != tiles.fillTile())
+					tiles.rtile(x, y) = t;
+			});
 
-				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = m_tiles.at(oldi);
+		} else {
+			int oldy = firstrow;
+			for(int y=0;y<ytiles;++y,++oldy) {
+				int oldx = firstcol;
+				for(int x=0;x<xtiles;++x,++oldx) {
+					if(oldy>=0 && oldy<m_ytiles && oldx>=0 && oldx<m_xtiles)
+						tiles.rtile(x, y) = m_tiles.tile(oldx, oldy);
 				}
 			}
 		}
@@ -268,7 +279,7 @@ QImage Layer::toImage() const {
 	int i=0;
 	for(int y=0;y<m_ytiles;++y) {
 		for(int x=0;x<m_xtiles;++x,++i)
-			m_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
+			m_tiles.tile(i).copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
 	}
 	return image;
 }
@@ -279,10 +290,17 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	int left=m_xtiles, right=0;
 
 	// Find bounding rectangle of non-blank tiles
-	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x) {
-			const Tile &t = m_tiles.at(y*m_xtiles + x);
+	if(!m_tiles.fillTile().isBlank()) {
+		top = 0;
+		bottom = m_ytiles-1;
+		left = 0;
+		right = m_xtiles-1;
+
+	} else {
+		m_tiles.forEachStored([&](int i, const Tile &t) {
 			if(!t.isBlank()) {
+				const int x = i % m_xtiles;
+				const int y = i / m_xtiles;
 				if(x<left)
 					left=x;
 				if(x>right)
@@ -292,7 +310,7 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 				if(y>bottom)
 					bottom=y;
 			}
-		}
+		});
 	}
 
 	if(top==m_ytiles) {
@@ -304,7 +322,7 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	QImage image((right-left+1)*Tile::SIZE, (bottom-top+1)*Tile::SIZE, QImage::Format_ARGB32);
 	for(int y=top;y<=bottom;++y) {
 		for(int x=left;x<=right;++x) {
-			m_tiles.at(y*m_xtiles+x).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
+			m_tiles.tile(x, y).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
 		}
 	}
 
@@ -409,7 +427,7 @@ Layer Layer::padImageToTileBoundary(int xpos, int ypos, const QImage &original,
 	
 	// Pad the image to tile boundaries
 	QImage image;
-	if(image.width() == w && image.height() == h) {
+	if(original.width() == w && original.height() == h) {
 		image = original;
 
 	} else {
@@ -471,6 +489,48 @@ Layer Layer::padImageToTileBoundary(int xpos, int ypos, const QImage &original,
 	return scratch;
 }
 
+/**
+ * @brief Put a tile aligned image directly into the tiles
+ *
+ * The image pixels are copied straight into new tiles, which then replace
+ * or are merged with the existing tiles. No scratch layers are needed.
+ * This is the common case, since PutImages are split at tile boundaries
+ * (see net::command::splitImageAtTileBoundaries()).
+ *
+ * In replace mode, the image must cover every tile it touches (up to the
+ * layer edge.) In other modes, the transparent padding of partial tiles
+ * has no effect.
+ *
+ * @return false if the image could not be put using this method
+ */
+bool Layer::putAlignedImage(int x, int y, const QImage &image, BlendMode::Mode mode)
+{
+	Q_ASSERT(x % Tile::SIZE == 0 && y % Tile::SIZE == 0);
+
+	const int right = qMin(x + image.width(), m_width);
+	const int bottom = qMin(y + image.height(), m_height);
+
+	const bool replace = mode == BlendMode::MODE_REPLACE;
+	if(replace) {
+		if(!(right == m_width || right % Tile::SIZE == 0) || !(bottom == m_height || bottom % Tile::SIZE == 0))
+			return false;
+	}
+
+	const PixelCompositeFunc kernel = pixelCompositor(mode, 255);
+
+	for(int ty=y;ty<bottom;ty+=Tile::SIZE) {
+		for(int tx=x;tx<right;tx+=Tile::SIZE) {
+			Tile t(image, tx-x, ty-y);
+			if(replace)
+				rtile(tx/Tile::SIZE, ty/Tile::SIZE) = t;
+			else
+				rtile(tx/Tile::SIZE, ty/Tile::SIZE).merge(t, 255, mode, kernel);
+		}
+	}
+
+	return true;
+}
+
 /**
  * @param x x coordinate
  * @param y y coordinate
@@ -491,6 +551,16 @@ void Layer::putImage(int x, int y, QImage image, BlendMode::Mode mode)
 	if(x >= m_width || y >= m_height)
 		return;
 
+	if(x % Tile::SIZE == 0 && y % Tile::SIZE == 0 && putAlignedImage(x, y, image, mode)) {
+		internTiles(QRect(x / Tile::SIZE, y / Tile::SIZE, Tile::roundTiles(image.width()), Tile::roundTiles(image.height())));
+
+		if(m_owner && isVisible()) {
+			m_owner->markDirty(QRect(x, y, image.width(), image.height()));
+			m_owner->notifyAreaChanged();
+		}
+		return;
+	}
+
 	const int x0 = Tile::roundDown(x);
 	const int y0 = Tile::roundDown(y);
 	
@@ -507,7 +577,10 @@ void Layer::putImage(int x, int y, QImage image, BlendMode::Mode mode)
 			rtile(tx, ty) = imageLayer.tile(tx-tx0, ty-ty0);
 		}
 	}
-	
+
+	// Images are often put repeatedly (e.g. when a session is reset)
+	internTiles(QRect(QPoint(tx0, ty0), QPoint(tx1, ty1)));
+
 	if(m_owner && isVisible()) {
 		m_owner->markDirty(QRect(x, y, image.width(), image.height()));
 		m_owner->notifyAreaChanged();
@@ -547,6 +620,8 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, BlendMode::Mod
 		else
 			canIncrOpacity = findBlendMode(blendmode).flags.testFlag(BlendMode::IncrOpacity);
 
+		const MaskCompositeFunc kernel = maskCompositor(blendmode);
+
 		for(int ty=ty0;ty<=ty1;++ty) {
 			for(int tx=tx0;tx<=tx1;++tx) {
 				int left = qMax(tx * size, rect.x()) - tx*size;
@@ -554,10 +629,14 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, BlendMode::Mod
 				int w = qMin((tx+1)*size, right) - tx*size - left;
 				int h = qMin((ty+1)*size, bottom) - ty*size - top;
 
-				Tile &t = m_tiles[ty*m_xtiles+tx];
+				if(!canIncrOpacity && m_tiles.tile(tx, ty).isNull())
+					continue;
 
-				if(!t.isNull() || canIncrOpacity)
-					t.composite(blendmode, mask, color, left, top, w, h, 0);
+				Tile &t = m_tiles.rtile(tx, ty);
+				if(w==size && h==size)
+					t.fill(blendmode, kernel, mask[0], color);
+				else
+					t.composite(blendmode, kernel, mask, color, left, top, w, h, 0);
 			}
 		}
 	}
@@ -568,32 +647,70 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, BlendMode::Mod
 	}
 }
 
-void Layer::dab(int contextId, const Brush &brush, const Point &point, StrokeState &state)
+/**
+ * @brief A batch of dabs waiting to be composited
+ *
+ * The dabs are composited one tile at a time: each tile receives its
+ * dabs in the original order, so the result is the same as if the dabs
+ * were drawn one by one.
+ */
+struct DabBatch {
+	struct Dab {
+		BrushStamp stamp;
+		QColor color;
+	};
+
+	explicit DabBatch(BlendMode::Mode mode) : mode(mode), kernel(maskCompositor(mode)) { }
+
+	BlendMode::Mode mode;
+	MaskCompositeFunc kernel;
+	QVector<Dab> dabs;
+};
+
+/**
+ * Indirect strokes are drawn on a sublayer. The brush is adjusted
+ * to draw with full opacity, since opacity is applied when the sublayer is merged.
+ *
+ * @param contextId drawing context id (needed for indirect drawing)
+ * @param brush the brush
+ * @param effectiveBrush the brush that should actually be used is stored here
+ * @return the layer to draw on
+ */
+Layer *Layer::getStrokeLayer(int contextId, const Brush &brush, Brush &effectiveBrush)
 {
-	Brush effective_brush = brush;
-	Layer *l = this;
+	effectiveBrush = brush;
 
 	if(!brush.incremental()) {
 		// Indirect brush: use a sublayer
-		l = getSubLayer(contextId, brush.blendingMode(), brush.opacity(1) * 255);
+		effectiveBrush.setOpacity(1.0);
+		effectiveBrush.setOpacity2(brush.isOpacityVariable() ? 0.0 : 1.0);
+		effectiveBrush.setBlendingMode(BlendMode::MODE_NORMAL);
 
-		effective_brush.setOpacity(1.0);
-		effective_brush.setOpacity2(brush.isOpacityVariable() ? 0.0 : 1.0);
-		effective_brush.setBlendingMode(BlendMode::MODE_NORMAL);
+		return getSubLayer(contextId, brush.blendingMode(), brush.opacity(1) * 255);
 
 	} else if(contextId<0) {
 		// Special case: negative context IDs are temporary overlay strokes
-		l = getSubLayer(contextId, brush.blendingMode(), 255);
-		effective_brush.setBlendingMode(BlendMode::MODE_NORMAL);
+		effectiveBrush.setBlendingMode(BlendMode::MODE_NORMAL);
+		return getSubLayer(contextId, brush.blendingMode(), 255);
 	}
 
+	return this;
+}
+
+void Layer::dab(int contextId, const Brush &brush, const Point &point, StrokeState &state)
+{
+	Brush effective_brush;
+	Layer *l = getStrokeLayer(contextId, brush, effective_brush);
+
 	Point p = point;
 	if(!effective_brush.subpixel()) {
 		p.setX(qFloor(p.x()));
 		p.setY(qFloor(p.y()));
 	}
 
-	l->directDab(effective_brush, p, state);
+	DabBatch batch(effective_brush.blendingMode());
+	l->directDab(effective_brush, p, state, batch);
+	l->flushDabs(batch);
 
 	if(m_owner)
 		m_owner->notifyAreaChanged();
@@ -606,27 +723,39 @@ void Layer::dab(int contextId, const Brush &brush, const Point &point, StrokeSta
  */
 void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, StrokeState &state)
 {
-	Brush effective_brush = brush;
-	Layer *l = this;
-
-	if(!brush.incremental()) {
-		// Indirect brush: use a sublayer
-		l = getSubLayer(contextId, brush.blendingMode(), brush.opacity(1) * 255);
-
-		effective_brush.setOpacity(1.0);
-		effective_brush.setOpacity2(brush.isOpacityVariable() ? 0.0 : 1.0);
-		effective_brush.setBlendingMode(BlendMode::MODE_NORMAL);
+	drawLines(contextId, brush, PointVector() << from << to, state);
+}
 
-	} else if(contextId<0) {
-		// Special case: negative context IDs are temporary overlay strokes
-		l = getSubLayer(contextId, brush.blendingMode(), 255);
-		effective_brush.setBlendingMode(BlendMode::MODE_NORMAL);
+/**
+ * This is the same as calling drawLine for each consecutive pair of points,
+ * but the dabs of the whole line are composited as a single batch.
+ *
+ * @param context drawing context id (needed for indirect drawing)
+ * @param points the points to connect
+ */
+void Layer::drawLines(int contextId, const Brush& brush, const PointVector &points, StrokeState &state)
+{
+	Brush effective_brush;
+	Layer *l = getStrokeLayer(contextId, brush, effective_brush);
+
+	// Single pixel brushes can skip the stamps. The zero valued pixels
+	// around a single pixel stamp are no-ops in all but the color erase
+	// and replace modes, so those still need the full stamp.
+	const BlendMode::Mode mode = effective_brush.blendingMode();
+	const bool pencil = isSinglePixelBrush(effective_brush) &&
+		effective_brush.smudge1()==0 && effective_brush.smudge2()==0 &&
+		mode != BlendMode::MODE_COLORERASE && mode != BlendMode::MODE_REPLACE;
+
+	DabBatch batch(mode);
+	for(int i=1;i<points.size();++i) {
+		if(effective_brush.subpixel())
+			l->drawSoftLine(effective_brush, points.at(i-1), points.at(i), state, batch);
+		else if(pencil)
+			l->drawPencilLine(effective_brush, points.at(i-1), points.at(i), state, batch);
+		else
+			l->drawHardLine(effective_brush, points.at(i-1), points.at(i), state, batch);
 	}
-
-	if(effective_brush.subpixel())
-		l->drawSoftLine(effective_brush, from, to, state);
-	else
-		l->drawHardLine(effective_brush, from, to, state);
+	l->flushDabs(batch);
 
 	if(m_owner)
 		m_owner->notifyAreaChanged();
@@ -639,7 +768,7 @@ void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const
  * @param to ending point
  * @param distance distance from previous dab.
  */
-void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to, StrokeState &state)
+void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch)
 {
 	qreal dx = to.x() - from.x();
 	qreal dy = to.y() - from.y();
@@ -661,7 +790,7 @@ void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to,
 
 	while(i<=dist) {
 		const qreal spacing = qMax(1.0, brush.spacingDist(p.pressure()));
-		directDab(brush, p, state);
+		directDab(brush, p, state, batch);
 		p.rx() += dx * spacing;
 		p.ry() += dy * spacing;
 		p.setPressure(qBound(0.0, p.pressure() + dp * spacing, 1.0));
@@ -675,7 +804,7 @@ void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to,
  * precision.
  * The last point is not drawn, so successive lines can be drawn blotches.
  */
-void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state) {
+void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch) {
 	const qreal dp = (to.pressure()-from.pressure()) / hypot(to.x()-from.x(), to.y()-from.y());
 
 	int x0 = qFloor(from.x());
@@ -716,7 +845,146 @@ void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to,
 			x0 += stepx;
 			fraction += dy;
 			if(++distance >= spacing) {
-				directDab(brush, Point(x0, y0, p), state);
+				directDab(brush, Point(x0, y0, p), state, batch);
+				distance = 0;
+			}
+			p += dp;
+		}
+	} else {
+		int fraction = dx - (dy >> 1);
+		while (y0 != y1) {
+			const qreal spacing = brush.spacingDist(p);
+			if (fraction >= 0) {
+				x0 += stepx;
+				fraction -= dy;
+			}
+			y0 += stepy;
+			fraction += dx;
+			if(++distance >= spacing) {
+				directDab(brush, Point(x0, y0, p), state, batch);
+				distance = 0;
+			}
+			p += dp;
+		}
+	}
+
+	state.distance = distance;
+}
+
+/**
+ * @brief Draw a line with a single pixel brush
+ *
+ * This gives the same result as drawHardLine(), but instead of generating
+ * a stamp for each dab, consecutive pixels in the same tile are composited
+ * as a single run.
+ *
+ * The brush must be a single pixel brush (see isSinglePixelBrush()) with no smudging.
+ */
+void Layer::drawPencilLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch) {
+	const qreal dp = (to.pressure()-from.pressure()) / hypot(to.x()-from.x(), to.y()-from.y());
+
+	int x0 = qFloor(from.x());
+	int y0 = qFloor(from.y());
+	qreal p = from.pressure();
+	int x1 = qFloor(to.x());
+	int y1 = qFloor(to.y());
+	int dy = y1 - y0;
+	int dx = x1 - x0;
+	int stepx, stepy;
+
+	if (dy < 0) {
+		dy = -dy;
+		stepy = -1;
+	} else {
+		stepy = 1;
+	}
+	if (dx < 0) {
+		dx = -dx;
+		stepx = -1;
+	} else {
+		stepx = 1;
+	}
+
+	dy *= 2;
+	dx *= 2;
+
+	const bool horizontal = dx > dy;
+	const int step = horizontal ? stepx : stepy;
+	const QColor color = brush.color();
+	const uchar value0 = singlePixelStampValue(brush, 0);
+	const bool constantValue = value0 == singlePixelStampValue(brush, 1);
+	const bool dirty = m_owner && isVisible();
+
+	// The current run: consecutive pixels on a single row (or column) of a tile.
+	// Mask values are indexed by the position along the run direction.
+	uchar run[Tile::SIZE];
+	int runTile = -1, runRow = 0, runStart = 0, runEnd = 0;
+	int lastDirty = -1;
+
+	auto flushRun = [&]() {
+		if(runTile<0)
+			return;
+
+		const int first = qMin(runStart, runEnd);
+		const int len = qAbs(runEnd - runStart) + 1;
+		Tile &t = m_tiles.rtile(runTile);
+		if(horizontal)
+			t.composite(batch.mode, batch.kernel, run + first, color, first, runRow, len, 1, 0);
+		else
+			t.composite(batch.mode, batch.kernel, run + first, color, runRow, first, 1, len, 0);
+
+		if(dirty && runTile != lastDirty)
+			m_owner->markDirty(runTile);
+		lastDirty = runTile;
+		runTile = -1;
+	};
+
+	auto plot = [&](int x, int y, qreal pressure) {
+		// Same clipping as directDab() and flushDabs() do for a 3x3 stamp:
+		// the stamp is clipped at the tile edge, so a pixel just past the
+		// layer edge is drawn if it is still in the last tile.
+		if(x<-1 || y<-1 || x>m_width || y>m_height)
+			return;
+		++state.smudgeDistance;
+
+		if(x<0 || y<0 || (x==m_width && x%Tile::SIZE==0) || (y==m_height && y%Tile::SIZE==0))
+			return;
+
+		const int tx = x / Tile::SIZE;
+		const int ty = y / Tile::SIZE;
+		const int tile = ty * m_xtiles + tx;
+		const int lx = x - tx * Tile::SIZE;
+		const int ly = y - ty * Tile::SIZE;
+		const int along = horizontal ? lx : ly;
+		const int row = horizontal ? ly : lx;
+
+		if(tile != runTile || row != runRow || along != runEnd + step) {
+			flushRun();
+			runTile = tile;
+			runRow = row;
+			runStart = along;
+		}
+		run[along] = constantValue ? value0 : singlePixelStampValue(brush, pressure);
+		runEnd = along;
+	};
+
+	// Dabs already in the batch must be drawn first
+	flushDabs(batch);
+
+	qreal distance = state.distance;
+
+	if (horizontal) {
+		int fraction = dy - (dx >> 1);
+		while (x0 != x1) {
+			const qreal spacing = brush.spacingDist(p);
+			if (fraction >= 0) {
+				y0 += stepy;
+				fraction -= dx;
+			}
+			x0 += stepx;
+			fraction += dy;
+			if(++distance >= spacing) {
+				plot(x0, y0, p);
 				distance = 0;
 			}
 			p += dp;
@@ -732,31 +1000,30 @@ void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to,
 			y0 += stepy;
 			fraction += dx;
 			if(++distance >= spacing) {
-				directDab(brush, Point(x0, y0, p), state);
+				plot(x0, y0, p);
 				distance = 0;
 			}
 			p += dp;
 		}
 	}
+	flushRun();
 
 	state.distance = distance;
 }
 
 /**
- * Apply a single dab of the brush to the layer
+ * Add a single dab of the brush to the batch
  * @param brush brush to use
  * @param point where to dab. May be outside the image.
- * @param sampleSmudgeColor if true (and smudging is enabled for the brush), sample the layer color before applying dab
  * @param state stroke state (used for the smudge color)
+ * @param batch the batch to add the dab to
  */
-void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state)
+void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state, DabBatch &batch)
 {
 	// Render the brush
-	const BrushStamp bs = makeGimpStyleBrushStamp(brush, point);
+	const BrushStamp bs = m_owner ? m_owner->brushMaskCache().stamp(brush, point) : makeGimpStyleBrushStamp(brush, point);
 	const int top=bs.top, left=bs.left;
 	const int dia = bs.mask.diameter();
-	const int bottom = qMin(top + dia, m_height);
-	const int right = qMin(left + dia, m_width);
 
 	if(left+dia<=0 || top+dia<=0 || left>=m_width || top>=m_height)
 		return;
@@ -764,6 +1031,9 @@ void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state
 	const qreal smudge = brush.smudge(point.pressure());
 
 	if(++state.smudgeDistance > brush.resmudge() && smudge>0) {
+		// The color must be sampled after the preceding dabs have been drawn
+		flushDabs(batch);
+
 		const QColor sampled = getDabColor(bs);
 
 		const qreal a = sampled.alphaF() * smudge;
@@ -776,45 +1046,73 @@ void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state
 		state.smudgeDistance = 0;
 	}
 
-	// Composite the brush mask onto the layer
-	const uchar *values = bs.mask.data();
-	QColor color = smudge > 0 ? state.smudgeColor : brush.color();
+	const DabBatch::Dab dab = { bs, smudge > 0 ? state.smudgeColor : brush.color() };
+	batch.dabs.append(dab);
+}
 
-	// A single dab can (and often does) span multiple tiles.
-	int y = top<0?0:top;
-	int yb = top<0?-top:0; // y in relation to brush origin
-	const int x0 = left<0?0:left;
-	const int xb0 = left<0?-left:0;
-	while(y<bottom) {
-		const int yindex = y / Tile::SIZE;
-		const int yt = y - yindex * Tile::SIZE;
-		const int hb = yt+dia-yb < Tile::SIZE ? dia-yb : Tile::SIZE-yt;
-		int x = x0;
-		int xb = xb0; // x in relation to brush origin
-		while(x<right) {
-			const int xindex = x / Tile::SIZE;
-			const int xt = x - xindex * Tile::SIZE;
-			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = m_xtiles * yindex + xindex;
-			m_tiles[i].composite(
-					brush.blendingMode(),
-					values + yb * dia + xb,
-					color,
-					xt, yt,
-					wb, hb,
-					dia-wb
-					);
+/**
+ * Composite all the dabs in the batch onto the layer and empty the batch.
+ *
+ * Each tile is visited only once and receives the dabs that overlap it in order.
+ * @param batch
+ */
+void Layer::flushDabs(DabBatch &batch)
+{
+	if(batch.dabs.isEmpty())
+		return;
 
-			x = (xindex+1) * Tile::SIZE;
-			xb = xb + wb;
+	// Split dabs into (tile, dab) pairs. Sorting the pairs groups them by tile
+	// while keeping the dabs of each tile in their original order.
+	QVector<quint64> parts;
+	for(int d=0;d<batch.dabs.size();++d) {
+		const BrushStamp &bs = batch.dabs.at(d).stamp;
+		const int dia = bs.mask.diameter();
+		const int tx0 = qMax(0, bs.left) / Tile::SIZE;
+		const int tx1 = (qMin(bs.left + dia, m_width) - 1) / Tile::SIZE;
+		const int ty0 = qMax(0, bs.top) / Tile::SIZE;
+		const int ty1 = (qMin(bs.top + dia, m_height) - 1) / Tile::SIZE;
+
+		for(int ty=ty0;ty<=ty1;++ty) {
+			for(int tx=tx0;tx<=tx1;++tx)
+				parts.append(quint64(ty * m_xtiles + tx) << 32 | quint64(d));
 		}
-		y = (yindex+1) * Tile::SIZE;
-		yb = yb + hb;
+	}
+	std::sort(parts.begin(), parts.end());
+
+	const bool dirty = m_owner && isVisible();
+	int lastTile = -1;
+
+	for(const quint64 part : parts) {
+		const int i = int(part >> 32);
+		const DabBatch::Dab &dab = batch.dabs.at(int(part & 0xffffffff));
+		const int dia = dab.stamp.mask.diameter();
+
+		// The part of the dab that overlaps this tile.
+		// Note: the dab is clipped at the tile edge, not the layer edge
+		const int tileLeft = (i % m_xtiles) * Tile::SIZE;
+		const int tileTop = (i / m_xtiles) * Tile::SIZE;
+		const int x0 = qMax(tileLeft, dab.stamp.left);
+		const int x1 = qMin(tileLeft + Tile::SIZE, dab.stamp.left + dia);
+		const int y0 = qMax(tileTop, dab.stamp.top);
+		const int y1 = qMin(tileTop + Tile::SIZE, dab.stamp.top + dia);
+		const int w = x1 - x0;
+
+		m_tiles.rtile(i).composite(
+				batch.mode,
+				batch.kernel,
+				dab.stamp.mask.data() + (y0 - dab.stamp.top) * dia + (x0 - dab.stamp.left),
+				dab.color,
+				x0 - tileLeft, y0 - tileTop,
+				w, y1 - y0,
+				dia - w
+				);
+
+		if(dirty && i != lastTile)
+			m_owner->markDirty(i);
+		lastTile = i;
 	}
 
-	if(m_owner && isVisible())
-		m_owner->markDirty(QRect(left, top, right-left, bottom-top));
-
+	batch.dabs.clear();
 }
 
 /**
@@ -852,7 +1150,7 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
 			const int i = m_xtiles * yindex + xindex;
 
-			std::array<quint32, 5> avg = m_tiles.at(i).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
+			std::array<quint32, 5> avg = m_tiles.tile(i).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
 			weight += avg[0];
 			red += avg[1];
 			green += avg[2];
@@ -897,41 +1195,63 @@ void Layer::merge(const Layer *layer, bool sublayers)
 
 	// Gather a list of non-null tiles to merge
 	QVector<int> mergeidx;
-	mergeidx.reserve(m_tiles.size());
-	for(int i=0;i<m_tiles.size();++i) {
-		bool isnull = layer->m_tiles[i].isNull();
-
-		if(isnull && sublayers) {
-			for(Layer *sl : m_sublayers) {
-				if(sl->m_tiles[i].isNull()) {
-					isnull = false;
-					break;
-				}
-			}
+	auto collect = [&mergeidx](const TileMap &tiles) {
+		if(!tiles.fillTile().isNull()) {
+			// Every tile has content
+			mergeidx.resize(tiles.size());
+			std::iota(mergeidx.begin(), mergeidx.end(), 0);
+		} else {
+			tiles.forEachStored([&mergeidx](int i, const Tile &t) {
+				if(!t.isNull())
+					mergeidx.append(i);
+			});
 		}
+	};
 
-		if(!isnull)
-			mergeidx.append(i);
+	collect(layer->m_tiles);
+	if(sublayers) {
+		for(const Layer *sl : layer->m_sublayers) {
+			if(sl->isVisible())
+				collect(sl->m_tiles);
+		}
 	}
 
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
-	m_tiles.detach();
+	std::sort(mergeidx.begin(), mergeidx.end());
+	mergeidx.erase(std::unique(mergeidx.begin(), mergeidx.end()), mergeidx.end());
+
+	// Get the target tiles before going concurrent, since getting
+	// an editable tile may allocate a tile block.
+	QVector<Tile*> targets(mergeidx.size());
+	for(int i=0;i<mergeidx.size();++i)
+		targets[i] = &m_tiles.rtile(mergeidx.at(i));
+
+	// Select compositing kernels
+	const PixelCompositeFunc kernel = pixelCompositor(layer->blendmode(), layer->opacity());
+	QVector<PixelCompositeFunc> sublayerKernels;
+	if(sublayers) {
+		for(const Layer *sl : layer->m_sublayers)
+			sublayerKernels.append(pixelCompositor(sl->blendmode(), sl->opacity()));
+	}
+
+	QVector<int> jobs(mergeidx.size());
+	std::iota(jobs.begin(), jobs.end(), 0);
 
 	// Merge tiles
-	QtConcurrent::blockingMap(mergeidx, [this, layer, sublayers](int idx) {
+	QtConcurrent::blockingMap(jobs, [layer, sublayers, kernel, &sublayerKernels, &mergeidx, &targets](int job) {
+		const int idx = mergeidx.at(job);
 		if(sublayers) {
-			Tile t = layer->m_tiles[idx];
+			Tile t = layer->m_tiles.tile(idx);
 
-			for(Layer *sl : layer->m_sublayers) {
+			for(int i=0;i<layer->m_sublayers.size();++i) {
+				const Layer *sl = layer->m_sublayers.at(i);
 				if(sl->isVisible()) {
-					t.merge(sl->m_tiles[idx], sl->opacity(), sl->blendmode());
+					t.merge(sl->m_tiles.tile(idx), sl->opacity(), sl->blendmode(), sublayerKernels.at(i));
 				}
 			}
-			m_tiles[idx].merge(t, layer->opacity(), layer->blendmode());
+			targets.at(job)->merge(t, layer->opacity(), layer->blendmode(), kernel);
 
 		} else {
-			m_tiles[idx].merge(layer->m_tiles[idx], layer->opacity(), layer->blendmode());
+			targets.at(job)->merge(layer->m_tiles.tile(idx), layer->opacity(), layer->blendmode(), kernel);
 		}
 	});
 
@@ -940,15 +1260,27 @@ void Layer::merge(const Layer *layer, bool sublayers)
 }
 
 /**
- * Free all tiles that are completely transparent
+ * Free all tiles that are completely transparent and
+ * convert single color tiles to uniform tiles.
  */
-void Layer::optimize()
+int Layer::optimize()
 {
-	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
-	}
+	// Optimize tile memory usage. Tiles are looked up read-only first
+	// so that blocks shared with savepoints are not needlessly detached.
+	QVector<int> dirty;
+	m_tiles.forEachStored([&dirty](int i, const Tile &t) {
+		if(!t.isOptimized())
+			dirty.append(i);
+	});
+
+	for(const int i : dirty)
+		m_tiles.rtile(i).optimize();
+
+	// Free blocks that no longer contain anything but the background
+	if(!dirty.isEmpty())
+		m_tiles.compact();
+
+	const int scanned = dirty.size();
 
 	// Delete unused sublayers
 	QMutableListIterator<Layer*> li(m_sublayers);
@@ -959,6 +1291,32 @@ void Layer::optimize()
 			li.remove();
 		}
 	}
+
+	return scanned;
+}
+
+void Layer::internTiles(const QRect &tiles)
+{
+	if(!tileintern::isEnabled())
+		return;
+
+	// Tiles are looked up read-only first, like in optimize()
+	QVector<int> pending;
+	m_tiles.forEachStored([this, &tiles, &pending](int i, const Tile &t) {
+		if(!t.isInterned() && (tiles.isNull() || tiles.contains(i % m_xtiles, i / m_xtiles)))
+			pending.append(i);
+	});
+
+	for(const int i : pending)
+		m_tiles.rtile(i).intern();
+}
+
+void Layer::findSwappableTiles(QVector<const Tile*> &tiles) const
+{
+	m_tiles.forEachStored([&tiles](int, const Tile &t) {
+		if(!t.isUniform())
+			tiles.append(&t);
+	});
 }
 
 void Layer::makeBlank()
@@ -1059,10 +1417,15 @@ void Layer::markOpaqueDirty(bool forceVisible)
 	if(!m_owner || !(forceVisible || isVisible()))
 		return;
 
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles.at(i).isNull())
-			m_owner->markDirty(i);
+	if(!m_tiles.fillTile().isNull()) {
+		m_owner->markDirty();
+		return;
 	}
+
+	m_tiles.forEachStored([this](int i, const Tile &t) {
+		if(!t.isNull())
+			m_owner->markDirty(i);
+	});
 	m_owner->notifyAreaChanged();
 }
 
@@ -1073,13 +1436,53 @@ QColor Layer::isSolidColor() const
 
 	const QRgb p0 = pixelAt(0, 0);
 
-	for(int y=0;y<m_height;++y) {
-		for(int x=0;x<m_width;++x) {
-			QRgb p = pixelAt(x, y);
-			if(p != p0)
-				return QColor();
+	// Check the tiles that are not stored separately
+	if(m_tiles.storedCount() < m_tiles.size()) {
+		const Tile &fill = m_tiles.fillTile();
+		for(int y=0;y<Tile::SIZE;++y) {
+			for(int x=0;x<Tile::SIZE;++x) {
+				if(fill.pixel(x, y) != p0)
+					return QColor();
+			}
+			if(fill.isUniform())
+				break;
 		}
 	}
+
+	bool solid = true;
+	m_tiles.forEachStored([this, p0, &solid](int i, const Tile &t) {
+		if(!solid)
+			return;
+
+		if(t.isUniform()) {
+			if(t.pixel(0, 0) != p0)
+				solid = false;
+			return;
+		}
+
+		// Only check the part of the edge tiles that is inside the layer
+		const int w = qMin(Tile::SIZE, m_width - (i % m_xtiles)*Tile::SIZE);
+		const int h = qMin(Tile::SIZE, m_height - (i / m_xtiles)*Tile::SIZE);
+
+		// An optimized tile with pixel data has more than one color
+		if(t.isOptimized() && w==Tile::SIZE && h==Tile::SIZE) {
+			solid = false;
+			return;
+		}
+
+		for(int y=0;y<h && solid;++y) {
+			for(int x=0;x<w;++x) {
+				if(t.pixel(x, y) != p0) {
+					solid = false;
+					break;
+				}
+			}
+		}
+	});
+
+	if(!solid)
+		return QColor();
+
 	return QColor::fromRgba(p0);
 }
 
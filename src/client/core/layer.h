@@ -20,6 +20,8 @@
 #define LAYER_H
 
 #include "tile.h"
+#include "tilemap.h"
+#include "point.h"
 
 #include <QColor>
 #include <QVector>
@@ -34,9 +36,9 @@ namespace paintcore {
 
 class Brush;
 struct BrushStamp;
-class Point;
 class LayerStack;
 struct StrokeState;
+struct DabBatch;
 
 /**
  * @brief The non-pixeldata part of the layer
@@ -156,6 +158,9 @@ class Layer {
 		//! Draw a line using either drawHardLine or drawSoftLine
 		void drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, StrokeState &state);
 
+		//! Draw a line through all the given points
+		void drawLines(int contextId, const Brush& brush, const PointVector &points, StrokeState &state);
+
 		//! Merge a sublayer with this layer
 		void mergeSublayer(int id);
 
@@ -165,25 +170,38 @@ class Layer {
 		//! Merge a layer
 		void merge(const Layer *layer, bool sublayers=false);
 
-		//! Optimize layer memory usage
-		void optimize();
+		/**
+		 * @brief Optimize layer memory usage
+		 *
+		 * Only tiles written to since the last call are scanned.
+		 * @return number of tiles scanned
+		 */
+		int optimize();
+
+		/**
+		 * @brief Share the pixel data of tiles with identical content
+		 *
+		 * @param tiles the tiles to intern (in tile indices.) A null rectangle means the whole layer.
+		 */
+		void internTiles(const QRect &tiles=QRect());
 
 		//! Get a tile
-		const Tile &tile(int x, int y) const {
-			Q_ASSERT(x>=0 && x<m_xtiles);
-			Q_ASSERT(y>=0 && y<m_ytiles);
-			return m_tiles[y*m_xtiles+x];
-		}
+		const Tile &tile(int x, int y) const { return m_tiles.tile(x, y); }
 
 		//! Get an editable reference to a tile
-		Tile &rtile(int x, int y) {
-			Q_ASSERT(x>=0 && x<m_xtiles);
-			Q_ASSERT(y>=0 && y<m_ytiles);
-			return m_tiles[y*m_xtiles+x];
-		}
+		Tile &rtile(int x, int y) { return m_tiles.rtile(x, y); }
 
 		//! Get a tile
-		const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
+		const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles.tile(index); }
+
+		//! Get an editable reference to a tile
+		Tile &rtile(int index) { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles.rtile(index); }
+
+		//! Is this layer the only user of the tile's pixel data? (See TileMap::isExclusive())
+		bool isTileExclusive(int index) const { return m_tiles.isExclusive(index); }
+
+		//! Append the tiles with pixel data to the list of swap candidates (see tileswap.h)
+		void findSwappableTiles(QVector<const Tile*> &tiles) const;
 
 		//! Get the sublayers
 		const QList<Layer*> &sublayers() const { return m_sublayers; }
@@ -221,13 +239,19 @@ class Layer {
 		Layer(LayerStack *owner, int id, const QSize& size);
 
 		Layer padImageToTileBoundary(int leftpad, int toppad, const QImage &original, BlendMode::Mode mode) const;
+		bool putAlignedImage(int x, int y, const QImage &image, BlendMode::Mode mode);
 
 		//! Get a sublayer
 		Layer *getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity);
 
-		void directDab(const Brush &brush, const Point& point, StrokeState &state);
-		void drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state);
-		void drawSoftLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state);
+		//! Get the layer a brush stroke should be drawn on and the brush to use for it
+		Layer *getStrokeLayer(int contextId, const Brush &brush, Brush &effectiveBrush);
+
+		void directDab(const Brush &brush, const Point& point, StrokeState &state, DabBatch &batch);
+		void drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch);
+		void drawSoftLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch);
+		void drawPencilLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, DabBatch &batch);
+		void flushDabs(DabBatch &batch);
 
 		QColor getDabColor(const BrushStamp &stamp) const;
 
@@ -238,7 +262,7 @@ class Layer {
 		int m_height;
 		int m_xtiles;
 		int m_ytiles;
-		QVector<Tile> m_tiles;
+		TileMap m_tiles;
 
 		QList<Layer*> m_sublayers;
 };
@@ -22,18 +22,94 @@
 #include <QMimeData>
 #include <QtConcurrent>
 #include <QDataStream>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <algorithm>
 
 #include "layer.h"
 #include "layerstack.h"
 #include "tile.h"
+#include "rendersnapshot.h"
 #include "rasterop.h"
 
 namespace paintcore {
 
+namespace {
+
+//! Maximum number of cached tiles (with pixel data) in the flattening cache
+static const int FLAT_CACHE_BUDGET = 2048;
+
+//! Minimum number of tiles flattened per render snapshot, even when over the frame budget
+static const int MIN_FRAME_TILES = 16;
+
+}
+
+/**
+ * @brief Cached partial composite of a single tile
+ *
+ * The "hot" layer is the layer most recently changed at this tile.
+ * The composite below it is valid as long as its key matches
+ * the current state of the layers it covers.
+ */
+struct LayerStack::FlatCacheEntry {
+	FlatCacheEntry() : hotLayer(-1), belowKey(0) { }
+
+	//! Number of cached tiles with pixel data
+	int cost() const {
+		return qMax(1, int(!below.isUniform()));
+	}
+
+	int hotLayer;
+
+	//! Background and all layers below the hot layer
+	quint64 belowKey;
+	Tile below;
+};
+
+namespace {
+
+struct UpdateTile {
+	UpdateTile() : x(-1), y(-1), index(-1), slot(-1), cacheChanged(false) {}
+	UpdateTile(int x_, int y_, int index_, int slot_) : x(x_), y(y_), index(index_), slot(slot_), cacheChanged(false) {}
+
+	int x, y;
+	int index; // tile index
+	int slot; // flattening cache entry slot
+	Tile tile;
+	QVector<quint32> lod;
+	bool cacheChanged;
+};
+
+}
+
+/**
+ * @brief Dirty tiles taken for flattening
+ *
+ * The tiles are taken (and their dirty flags cleared) while the layer stack
+ * is locked, but the layer stack's own thread may flatten them after releasing
+ * the lock, since no other thread modifies the layers.
+ */
+struct LayerStack::FlattenJob {
+	FlattenJob() : maxTiles(-1), requested(false), publish(false) { }
+
+	QVector<UpdateTile> updates;
+
+	// Copies of the cached partial composites. The worker threads
+	// only touch their own copies of the cache entries.
+	QVector<FlatCacheEntry> cache;
+
+	// Render snapshot parameters (see prepareSnapshot())
+	int maxTiles;
+	bool requested;
+	bool publish;
+};
+
 LayerStack::LayerStack(QObject *parent)
-	: QObject(parent), _width(0), _height(0), _viewmode(NORMAL), _viewlayeridx(0),
+	: QObject(parent), _width(0), _height(0), m_dirtyClock(0), _viewmode(NORMAL), _viewlayeridx(0),
 	  _onionskinsBelow(4), _onionskinsAbove(4), _onionskinTint(true), _viewBackgroundLayer(true),
-	  m_locked(false)
+	  m_locked(false), m_flatCache(FLAT_CACHE_BUDGET), m_tileCost(50), m_hotLayerId(0), m_hotLayerGeneration(0),
+	  m_savepointTilesScanned(0)
 {
 }
 
@@ -41,6 +117,7 @@ LayerStack::~LayerStack()
 {
 	for(Layer *l : m_layers)
 		delete l;
+	delete m_snapshot.load();
 }
 
 void LayerStack::reset()
@@ -53,6 +130,8 @@ void LayerStack::reset()
 	for(Layer *l : m_layers)
 		delete l;
 	m_layers.clear();
+	m_flatCache.clear();
+	m_lod.resize(0, 0);
 	emit resized(0, 0, oldsize);
 	emit layersChanged(QList<LayerInfo>());
 }
@@ -68,13 +147,63 @@ bool LayerStack::lock(int timeout)
 void LayerStack::unlock()
 {
 	Q_ASSERT(m_locked);
+
+	// Snapshots are only made in the layer stack's own thread. The dirty
+	// tiles are taken while still locked, but flattened only after the lock
+	// is released. Other threads (e.g. tools in the GUI thread) ask for a
+	// snapshot instead.
+	const bool ownThread = QThread::currentThread() == thread();
+	FlattenJob snapshotJob;
+	if(ownThread)
+		prepareSnapshot(snapshotJob);
+
+	++m_dirtyClock;
 	m_locked = false;
 	QRect dr = m_dirtyrect;
 	m_dirtyrect = QRect();
 	m_mutex.unlock();
 
+	if(ownThread)
+		publishSnapshot(snapshotJob);
+
 	if(!dr.isEmpty())
-		emit areaChanged(dr);
+		addChangedArea(dr);
+
+	if(!ownThread)
+		QMetaObject::invokeMethod(this, "publishRequestedSnapshot", Qt::QueuedConnection);
+}
+
+/**
+ * @brief Add to the area the view has not been told about yet
+ *
+ * areaChanged is emitted only for the first change after the view
+ * has taken the changed area, so a storm of small changes queues
+ * just one signal per frame.
+ */
+void LayerStack::addChangedArea(const QRect &area)
+{
+	bool first;
+	{
+		QMutexLocker lock(&m_viewLock);
+		first = m_changedArea.isEmpty();
+		m_changedArea |= area;
+	}
+
+	if(first)
+		emit areaChanged(area);
+}
+
+QRect LayerStack::takeChangedArea()
+{
+	QMutexLocker lock(&m_viewLock);
+	const QRect area = m_changedArea;
+	m_changedArea = QRect();
+	return area;
+}
+
+void LayerStack::setFrameBudget(int usecs)
+{
+	m_frameBudget.store(usecs);
 }
 
 void LayerStack::resize(int top, int right, int bottom, int left)
@@ -95,6 +224,9 @@ void LayerStack::resize(int top, int right, int bottom, int left)
 	_xtiles = Tile::roundTiles(_width);
 	_ytiles = Tile::roundTiles(_height);
 	_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+	m_dirtyStamps = QVector<quint32>(_xtiles*_ytiles, m_dirtyClock);
+	m_flatCache.clear();
+	m_lod.resize(_width, _height);
 
 	for(Layer *l : m_layers)
 		l->resize(top, right, bottom, left);
@@ -277,18 +409,6 @@ int LayerStack::indexOf(int id) const
 	return -1;
 }
 
-namespace {
-
-struct UpdateTile {
-	UpdateTile() : x(-1), y(-1) {}
-	UpdateTile(int x_, int y_) : x(x_), y(y_) {}
-
-	int x, y;
-	quint32 data[Tile::LENGTH];
-};
-
-}
-
 /**
  * The dirty flag for each painted tile will be cleared.
  *
@@ -297,7 +417,39 @@ struct UpdateTile {
  */
 void LayerStack::paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean)
 {
-	if(_width<=0 || _height<=0)
+	RenderSnapshot(size(), flattenChangedTiles(rect, clean)).paint(target, &m_lod);
+}
+
+/**
+ * @brief Flatten the dirty tiles in the given area
+ *
+ * @param rect area of the image to flatten (rounded upwards to tile boundaries)
+ * @param clean clear the dirty flags of the flattened tiles
+ * @param maxTiles if not negative, flatten at most this many of the most recently changed tiles
+ * @return the flattened tiles (with pixel data) and their downsampled LOD levels
+ */
+QVector<FlatTile> LayerStack::flattenChangedTiles(const QRect &rect, bool clean, int maxTiles)
+{
+	FlattenJob job;
+	takeChangedTiles(job, rect, clean, maxTiles);
+	const QVector<FlatTile> flattened = flattenTiles(job);
+	storeFlatCache(job);
+	return flattened;
+}
+
+/**
+ * @brief Take the dirty tiles in the given area for flattening
+ *
+ * The layer stack must be locked.
+ *
+ * @param job the job to add the tiles to
+ * @param rect area of the image to flatten (rounded upwards to tile boundaries)
+ * @param clean clear the dirty flags of the taken tiles
+ * @param maxTiles if not negative, take at most this many of the most recently changed tiles
+ */
+void LayerStack::takeChangedTiles(FlattenJob &job, const QRect &rect, bool clean, int maxTiles)
+{
+	if(_width<=0 || _height<=0 || rect.isEmpty())
 		return;
 
 	// Affected tile range
@@ -307,52 +459,208 @@ void LayerStack::paintChangedTiles(const QRect& rect, QPaintDevice *target, bool
 	const int ty1 = qBound(ty0, rect.bottom() / Tile::SIZE, _ytiles-1);
 
 	// Gather list of tiles in need of updating
-	QList<UpdateTile*> updates;
-
+	QVector<int> dirty;
 	for(int ty=ty0;ty<=ty1;++ty) {
 		const int y = ty*_xtiles;
 		for(int tx=tx0;tx<=tx1;++tx) {
-			const int i = y+tx;
-			if(_dirtytiles.testBit(i)) {
-				updates.append(new UpdateTile(tx, ty));
-
-				// TODO this conditional is for transitioning to QtQuick. Remove once old view is removed.
-				if(clean)
-					_dirtytiles.clearBit(i);
-			}
+			if(_dirtytiles.testBit(y+tx))
+				dirty.append(y+tx);
 		}
 	}
 
-	if(!updates.isEmpty()) {
-		// Flatten tiles
-		QtConcurrent::blockingMap(updates, [this](UpdateTile *t) {
-			// TODO: don't draw the checkerboard here: use a QML item instead to draw the background
-			Tile::fillChecker(t->data, QColor(128,128,128), Qt::white);
-			flattenTile(t->data, t->x, t->y);
+	// Over budget: the most recently changed tiles go first, the rest stay dirty
+	if(maxTiles>=0 && dirty.size() > maxTiles) {
+		const quint32 *stamps = m_dirtyStamps.constData();
+		std::nth_element(dirty.begin(), dirty.begin() + maxTiles, dirty.end(), [stamps](int a, int b) {
+			return stamps[a] > stamps[b];
 		});
+		dirty.resize(maxTiles);
+	}
+
+	job.updates.reserve(dirty.size());
+	for(const int i : dirty) {
+		const int tx = i % _xtiles;
+		const int ty = i / _xtiles;
+		job.updates.append(UpdateTile(tx, ty, i, job.updates.size()));
+
+		// TODO this conditional is for transitioning to QtQuick. Remove once old view is removed.
+		if(clean)
+			_dirtytiles.clearBit(i);
+	}
+
+	// Fetch cached partial composites
+	job.cache.resize(job.updates.size());
+	for(int i=0;i<job.updates.size();++i) {
+		const FlatCacheEntry *e = m_flatCache.object(job.updates.at(i).index);
+		if(e)
+			job.cache[i] = *e;
+	}
+}
+
+/**
+ * @brief Flatten the tiles taken by takeChangedTiles()
+ *
+ * This does not need the lock when called from the layer stack's own thread.
+ *
+ * @return the flattened tiles (with pixel data) and their downsampled LOD levels
+ */
+QVector<FlatTile> LayerStack::flattenTiles(FlattenJob &job) const
+{
+	QVector<FlatTile> flattened;
+	if(job.updates.isEmpty())
+		return flattened;
+
+	// TODO: don't draw the checkerboard here: use a QML item instead to draw the background
+	Tile checker;
+	Tile::fillChecker(checker.data(), QColor(128,128,128), Qt::white);
+
+	// Flatten tiles and downsample them for the LOD pyramid. (The pyramid
+	// is only read here, to get the level sizes.)
+	FlatCacheEntry *cacheEntries = job.cache.data();
+	QtConcurrent::blockingMap(job.updates, [this, &checker, cacheEntries](UpdateTile &t) {
+		t.tile = checker;
+		t.cacheChanged = flattenTileCached(t.tile, t.x, t.y, cacheEntries[t.slot]);
+
+		// An opaque uniform layer may hide the checkerboard
+		if(t.tile.isUniform())
+			t.tile.detach();
+
+		t.lod = m_lod.downsampleTile(t.x, t.y, t.tile);
+	});
+
+	flattened.reserve(job.updates.size());
+	for(const UpdateTile &ut : job.updates) {
+		const FlatTile t = { ut.x, ut.y, ut.tile, ut.lod };
+		flattened.append(t);
+	}
 
-		// Paint flattened tiles
-		QPainter painter(target);
-		painter.setCompositionMode(QPainter::CompositionMode_Source);
-		while(!updates.isEmpty()) {
-			UpdateTile *ut = updates.takeLast();
-			painter.drawImage(
-				ut->x*Tile::SIZE,
-				ut->y*Tile::SIZE,
-				QImage(reinterpret_cast<const uchar*>(ut->data),
-					Tile::SIZE, Tile::SIZE,
-					QImage::Format_ARGB32
-				)
-			);
-			delete ut;
+	return flattened;
+}
+
+/**
+ * @brief Store the cache entries updated by flattenTiles()
+ *
+ * The layer stack must be locked.
+ */
+void LayerStack::storeFlatCache(const FlattenJob &job)
+{
+	for(int i=0;i<job.updates.size();++i) {
+		if(job.updates.at(i).cacheChanged) {
+			FlatCacheEntry *e = new FlatCacheEntry(job.cache.at(i));
+			m_flatCache.insert(job.updates.at(i).index, e, e->cost());
 		}
 	}
 }
 
+void LayerStack::setViewArea(const QRect &area)
+{
+	QMutexLocker lock(&m_viewLock);
+	if(area != m_viewArea) {
+		// Tiles that were already dirty in the new area need a snapshot too
+		m_viewArea = area;
+		m_requestedArea |= area;
+		QMetaObject::invokeMethod(this, "publishRequestedSnapshot", Qt::QueuedConnection);
+	}
+}
+
+void LayerStack::requestSnapshot(const QRect &area)
+{
+	QMutexLocker lock(&m_viewLock);
+	m_requestedArea |= area;
+	QMetaObject::invokeMethod(this, "publishRequestedSnapshot", Qt::QueuedConnection);
+}
+
+RenderSnapshot *LayerStack::takeSnapshot()
+{
+	RenderSnapshot *snapshot = m_snapshot.fetchAndStoreAcquire(nullptr);
+
+	// The canvas thread may have skipped changes while the mailbox was full
+	if(m_snapshotWanted.fetchAndStoreAcquire(0))
+		QMetaObject::invokeMethod(this, "publishRequestedSnapshot", Qt::QueuedConnection);
+
+	return snapshot;
+}
+
+void LayerStack::publishRequestedSnapshot()
+{
+	// The snapshot is published when the lock is released
+	Locker locker(this);
+}
+
+/**
+ * @brief Take the dirty tiles the view wants for the next render snapshot
+ *
+ * This is called when the layer stack is about to be unlocked in its own
+ * thread. The tiles are flattened and published by publishSnapshot() after
+ * the lock is released, so other threads are not kept waiting.
+ */
+void LayerStack::prepareSnapshot(FlattenJob &job)
+{
+	// Don't pile up snapshots the view hasn't taken yet. The view asks
+	// for a new one when it takes the old one. (It may have just taken it,
+	// in which case it may or may not have seen the flag, so check again.)
+	if(m_snapshot.loadAcquire()) {
+		m_snapshotWanted.fetchAndStoreRelease(1);
+		if(m_snapshot.loadAcquire())
+			return;
+	}
+
+	QRect area;
+	{
+		QMutexLocker lock(&m_viewLock);
+		area = (m_viewArea | m_requestedArea) & QRect(0, 0, _width, _height);
+		job.requested = !m_requestedArea.isNull();
+		m_requestedArea = QRect();
+	}
+
+	// Flatten as many tiles as fit in the frame budget, based on how long
+	// flattening has taken recently. The rest go in the next snapshot.
+	const int budget = m_frameBudget.load();
+	job.maxTiles = budget>0 ? qMax(MIN_FRAME_TILES, int(budget / m_tileCost)) : -1;
+	job.publish = true;
+
+	takeChangedTiles(job, area, true, job.maxTiles);
+}
+
+/**
+ * @brief Flatten the tiles taken by prepareSnapshot() and publish them as a render snapshot
+ *
+ * This is called after the layer stack is unlocked in its own thread, so the
+ * view gets a new snapshot after each batch of changes.
+ */
+void LayerStack::publishSnapshot(FlattenJob &job)
+{
+	if(!job.publish)
+		return;
+
+	QElapsedTimer timer;
+	timer.start();
+	const QVector<FlatTile> tiles = flattenTiles(job);
+
+	if(!tiles.isEmpty()) {
+		const qreal cost = timer.nsecsElapsed() / 1000.0 / tiles.size();
+		m_tileCost = qMax(0.1, (m_tileCost * 3 + cost) / 4);
+
+		if(tiles.size() == job.maxTiles)
+			m_snapshotWanted.fetchAndStoreRelease(1);
+
+		QMutexLocker lock(&m_mutex);
+		storeFlatCache(job);
+	}
+
+	// Requests are always answered, so the view can pace itself
+	if(tiles.isEmpty() && !job.requested && size() == m_publishedSize)
+		return;
+
+	m_publishedSize = size();
+	m_snapshot.storeRelease(new RenderSnapshot(m_publishedSize, tiles));
+	emit snapshotPublished();
+}
+
 Tile LayerStack::getFlatTile(int x, int y) const
 {
-	Tile t(Qt::transparent);
-	flattenTile(t.data(), x, y);
+	Tile t;
+	flattenTile(t, x, y);
 	return t;
 }
 
@@ -365,30 +673,92 @@ QColor LayerStack::colorAt(int x, int y, int dia) const
 		return QColor();
 
 	if(dia<=1) {
-		// TODO some more efficient way of doing this
-		Tile tile = getFlatTile(x/Tile::SIZE, y/Tile::SIZE);
-		quint32 c = tile.data()[(y-Tile::roundDown(y)) * Tile::SIZE + (x-Tile::roundDown(x))];
-		return QColor(c);
+		return QColor(pixelAt(x, y));
 
 	} else {
+		// Flatten just the tiles under the sampling window
 		const int r = dia/2+1;
-		const int x1 = (x-r) / Tile::SIZE;
-		const int x2 = (x+r) / Tile::SIZE;
-		const int y1 = (y-r) / Tile::SIZE;
-		const int y2 = (y+r) / Tile::SIZE;
+		const int x1 = qMax(0, x-r) / Tile::SIZE;
+		const int x2 = qMin(_width-1, x+r) / Tile::SIZE;
+		const int y1 = qMax(0, y-r) / Tile::SIZE;
+		const int y2 = qMin(_height-1, y+r) / Tile::SIZE;
 
-		Layer flat(nullptr, 0, QString(), Qt::transparent, QSize(_width, _height));
+		const int left = x1 * Tile::SIZE;
+		const int top = y1 * Tile::SIZE;
+
+		Layer flat(nullptr, 0, QString(), Qt::transparent, QSize(
+			qMin((x2+1) * Tile::SIZE, _width) - left,
+			qMin((y2+1) * Tile::SIZE, _height) - top
+			));
 
 		for(int tx=x1;tx<=x2;++tx) {
 			for(int ty=y1;ty<=y2;++ty) {
-				flat.rtile(tx,ty) = getFlatTile(tx, ty);
+				flat.rtile(tx-x1, ty-y1) = getFlatTile(tx, ty);
 			}
 		}
 
-		return flat.colorAt(x, y, dia);
+		return flat.colorAt(x - left, y - top, dia);
 	}
 }
 
+/**
+ * The layers are composited one pixel at a time, the same way flattenLayers()
+ * composites whole tiles.
+ */
+QRgb LayerStack::pixelAt(int x, int y) const
+{
+	if(x<0 || y<0 || x>=_width || y>=_height)
+		return 0;
+
+	const int xindex = x / Tile::SIZE;
+	const int yindex = y / Tile::SIZE;
+	const int px = x - xindex * Tile::SIZE;
+	const int py = y - yindex * Tile::SIZE;
+
+	quint32 dest = 0;
+
+	for(int layeridx=0;layeridx<m_layers.size();++layeridx) {
+		if(!isVisible(layeridx))
+			continue;
+
+		const Layer *l = m_layers.at(layeridx);
+		const Tile &tile = l->tile(xindex, yindex);
+		const quint32 tint = layerTint(layeridx);
+
+		// Null tiles are skipped when merging, so keep track of them
+		// to get exactly the same result as a tile merge.
+		bool isNull = tile.isNull();
+		quint32 pixel = tile.rawPixel(px, py);
+
+		if(tint!=0 || hasSublayerContent(l, xindex, yindex)) {
+			for(const Layer *sl : l->sublayers()) {
+				if(!sl->isVisible())
+					continue;
+
+				const Tile &st = sl->tile(xindex, yindex);
+				if(st.isNull())
+					continue;
+
+				const quint32 sp = st.rawPixel(px, py);
+				pixelCompositor(sl->blendmode(), sl->opacity())(&pixel, &sp, sl->opacity(), 1);
+				isNull = false;
+			}
+
+			if(tint) {
+				tintPixels(&pixel, 1, tint);
+				isNull = false;
+			}
+		}
+
+		if(!isNull) {
+			const uchar opacity = layerOpacity(layeridx);
+			pixelCompositor(l->blendmode(), opacity)(&dest, &pixel, opacity, 1);
+		}
+	}
+
+	return Tile::toArgb(dest);
+}
+
 QImage LayerStack::toFlatImage() const
 {
 	Layer flat(nullptr, 0, QString(), Qt::transparent, QSize(_width, _height));
@@ -417,47 +787,242 @@ QImage LayerStack::flatLayerImage(int layerIdx, bool useBgLayer, const QColor &b
 	return flat->toImage();
 }
 
-// Flatten a single tile
-void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
+/**
+ * Flatten a single tile by compositing all visible layers on top of the given tile.
+ *
+ * If the tiles of all visible layers are uniform, the result is a uniform tile as well.
+ */
+void LayerStack::flattenTile(Tile &dest, int xindex, int yindex) const
 {
-	// Composite visible layers
-	int layeridx = 0;
-	for(const Layer *l : m_layers) {
-		if(isVisible(layeridx)) {
-			const Tile &tile = l->tile(xindex, yindex);
-			const quint32 tint = layerTint(layeridx);
-
-			if(l->sublayers().count() || tint!=0) {
-				// Sublayers (or tint) present, composite them first
-				quint32 ldata[Tile::SIZE*Tile::SIZE];
-				tile.copyTo(ldata);
-
-				for(const Layer *sl : l->sublayers()) {
-					if(sl->isVisible()) {
-						const Tile &subtile = sl->tile(xindex, yindex);
-						if(!subtile.isNull()) {
-							compositePixels(sl->blendmode(), ldata, subtile.data(),
-									Tile::SIZE*Tile::SIZE, sl->opacity());
-						}
-					}
-				}
+	flattenLayers(dest, xindex, yindex, 0, m_layers.size());
+}
 
-				if(tint)
-					tintPixels(ldata, sizeof ldata / sizeof *ldata, tint);
+/**
+ * Composite the visible layers in range [first, last) on top of the given tile.
+ *
+ * Compositing starts from the topmost layer that hides everything beneath it.
+ */
+void LayerStack::flattenLayers(Tile &dest, int xindex, int yindex, int first, int last) const
+{
+	const int occluder = occludingLayerAt(xindex, yindex, first, last);
+	if(occluder>=0) {
+		const Layer *l = m_layers.at(occluder);
+		if(!hasSublayerContent(l, xindex, yindex)) {
+			// Compositing an opaque tile in normal mode just copies it
+			dest = l->tile(xindex, yindex);
+			first = occluder + 1;
+		} else {
+			dest = Tile();
+			first = occluder;
+		}
+	}
+
+	for(int layeridx=first;layeridx<last;++layeridx) {
+		if(!isVisible(layeridx))
+			continue;
+
+		const Layer *l = m_layers.at(layeridx);
+		const Tile &tile = l->tile(xindex, yindex);
+		const quint32 tint = layerTint(layeridx);
 
-				// Composite merged tile
-				compositePixels(l->blendmode(), data, ldata,
-						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
+		if(tint!=0 || hasSublayerContent(l, xindex, yindex)) {
+			// Sublayers (or tint) present, composite them first
+			Tile ltile = tile;
 
-			} else if(!tile.isNull()) {
-				// No sublayers or tint, just this tile as it is
-				compositePixels(l->blendmode(), data, tile.data(),
-						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
+			for(const Layer *sl : l->sublayers()) {
+				if(sl->isVisible())
+					ltile.merge(sl->tile(xindex, yindex), sl->opacity(), sl->blendmode());
 			}
+
+			if(tint)
+				tintPixels(ltile.data(), Tile::LENGTH, tint);
+
+			// Composite merged tile
+			dest.merge(ltile, layerOpacity(layeridx), l->blendmode());
+
+		} else {
+			// No sublayers or tint, just this tile as it is
+			dest.merge(tile, layerOpacity(layeridx), l->blendmode());
 		}
+	}
+}
+
+/**
+ * Flatten a tile using a cached composite of the layers below the layer
+ * that was changed last. The layers from the hot layer up are composited
+ * on top of it in order, so the result is identical to that of flattenTile.
+ *
+ * The layers above the hot layer are not pre-composited together:
+ * compositing them over a transparent tile first would round differently
+ * than compositing them one by one onto the layers below.
+ *
+ * The cache entry is (re)built only when the same layer is changed twice in a row,
+ * so one-off updates of the whole canvas do not fill the cache.
+ *
+ * @param dest the background tile
+ * @param entry cache entry for this tile
+ * @return true if the cache entry was changed
+ */
+bool LayerStack::flattenTileCached(Tile &dest, int xindex, int yindex, FlatCacheEntry &entry) const
+{
+	const int hot = hotLayerAt(xindex, yindex);
+
+	if(hot>=0 && occludingLayerAt(xindex, yindex, hot, m_layers.size())>=0) {
+		// Everything below is hidden anyway
+		flattenTile(dest, xindex, yindex);
+		return false;
+	}
+
+	if(hot<0 || hot != entry.hotLayer) {
+		const bool changed = entry.hotLayer != hot || entry.belowKey;
+		entry = FlatCacheEntry();
+		entry.hotLayer = hot;
+		flattenTile(dest, xindex, yindex);
+		return changed;
+	}
+
+	bool changed = false;
 
-		++layeridx;
+	// Background and layers below
+	const quint64 belowKey = layerRangeKey(xindex, yindex, 0, hot);
+	if(belowKey != entry.belowKey) {
+		entry.below = dest;
+		flattenLayers(entry.below, xindex, yindex, 0, hot);
+		entry.belowKey = belowKey;
+		changed = true;
 	}
+
+	// The hot layer and everything above it. None of these is occluding,
+	// so compositing continues exactly where flattenTile would.
+	dest = entry.below;
+	flattenLayers(dest, xindex, yindex, hot, m_layers.size());
+
+	return changed;
+}
+
+/**
+ * Calculate a key that changes whenever the flattened result of the given
+ * layer range may change.
+ *
+ * The key covers the content (tile write generation) and the effective
+ * visibility, opacity, blending mode and tint of each layer and its sublayers.
+ */
+quint64 LayerStack::layerRangeKey(int xindex, int yindex, int first, int last) const
+{
+	// FNV-1a style hash
+	quint64 key = Q_UINT64_C(14695981039346656037);
+	auto mix = [&key](quint64 value) {
+		key = (key ^ value) * Q_UINT64_C(1099511628211);
+	};
+
+	mix(first);
+	mix(last);
+
+	for(int i=first;i<last;++i) {
+		if(!isVisible(i))
+			continue;
+
+		const Layer *l = m_layers.at(i);
+		mix(l->id());
+		mix(l->tile(xindex, yindex).generation());
+		mix(layerOpacity(i) | (l->blendmode() << 8));
+		mix(layerTint(i));
+
+		for(const Layer *sl : l->sublayers()) {
+			if(sl->isVisible()) {
+				mix(sl->tile(xindex, yindex).generation());
+				mix(sl->opacity() | (sl->blendmode() << 8));
+			}
+		}
+	}
+
+	return key;
+}
+
+/**
+ * Check if any visible sublayer of the given layer has content at the given tile.
+ *
+ * Sublayers only store the tiles their strokes have touched, so this is cheap
+ * even when there are many sublayers.
+ */
+bool LayerStack::hasSublayerContent(const Layer *layer, int xindex, int yindex)
+{
+	for(const Layer *sl : layer->sublayers()) {
+		if(sl->isVisible() && !sl->tile(xindex, yindex).isNull())
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Find the topmost layer in range [first, last) that completely hides
+ * the layers beneath it at the given tile.
+ *
+ * An occluding layer is a visible, fully opaque normal mode layer whose
+ * tile is known to be fully opaque and which has no visible sublayers that
+ * could erase pixels.
+ *
+ * @return layer index or -1 if no layer in the range is occluding
+ */
+int LayerStack::occludingLayerAt(int xindex, int yindex, int first, int last) const
+{
+	for(int i=last-1;i>=first;--i) {
+		if(!isVisible(i))
+			continue;
+
+		const Layer *l = m_layers.at(i);
+		if(layerOpacity(i) != 255 || l->blendmode() != BlendMode::MODE_NORMAL || layerTint(i) != 0)
+			continue;
+
+		if(!l->tile(xindex, yindex).isOpaque())
+			continue;
+
+		bool sublayersOk = true;
+		for(const Layer *sl : l->sublayers()) {
+			if(sl->isVisible() && !sl->tile(xindex, yindex).isNull() &&
+					findBlendMode(sl->blendmode()).flags.testFlag(BlendMode::DecrOpacity)) {
+				sublayersOk = false;
+				break;
+			}
+		}
+
+		if(sublayersOk)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Find the layer that was changed most recently at the given tile.
+ *
+ * Changes to the sublayers count as changes to the parent layer.
+ * A change of layer attributes counts as a change to every tile of the layer.
+ *
+ * @return layer index or -1 if there are no layers
+ */
+int LayerStack::hotLayerAt(int xindex, int yindex) const
+{
+	int hot = -1;
+	quint64 newest = 0;
+
+	for(int i=0;i<m_layers.size();++i) {
+		const Layer *l = m_layers.at(i);
+		quint64 gen = l->tile(xindex, yindex).generation();
+
+		for(const Layer *sl : l->sublayers())
+			gen = qMax(gen, sl->tile(xindex, yindex).generation());
+
+		if(l->id() == m_hotLayerId)
+			gen = qMax(gen, m_hotLayerGeneration);
+
+		if(hot<0 || gen > newest) {
+			hot = i;
+			newest = gen;
+		}
+	}
+
+	return hot;
 }
 
 void LayerStack::markDirty(const QRect &area)
@@ -471,6 +1036,7 @@ void LayerStack::markDirty(const QRect &area)
 	
 	for(;ty0<=ty1;++ty0) {
 		_dirtytiles.fill(true, ty0*_xtiles + tx0, ty0*_xtiles + tx1);
+		std::fill(m_dirtyStamps.begin() + ty0*_xtiles + tx0, m_dirtyStamps.begin() + ty0*_xtiles + tx1, m_dirtyClock);
 	}
 	m_dirtyrect |= area;
 }
@@ -480,6 +1046,7 @@ void LayerStack::markDirty()
 	if(m_layers.isEmpty() || _width<=0 || _height<=0)
 		return;
 	_dirtytiles.fill(true);
+	m_dirtyStamps.fill(m_dirtyClock);
 
 	m_dirtyrect = QRect(0, 0, _width, _height);
 	notifyAreaChanged();
@@ -491,6 +1058,7 @@ void LayerStack::markDirty(int x, int y)
 	Q_ASSERT(y>=0 && y < _ytiles);
 
 	_dirtytiles.setBit(y*_xtiles + x);
+	m_dirtyStamps[y*_xtiles + x] = m_dirtyClock;
 
 	m_dirtyrect |= QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
 }
@@ -500,6 +1068,7 @@ void LayerStack::markDirty(int index)
 	Q_ASSERT(index>=0 && index < _dirtytiles.size());
 
 	_dirtytiles.setBit(index);
+	m_dirtyStamps[index] = m_dirtyClock;
 
 	const int y = index / _xtiles;
 	const int x = index % _xtiles;
@@ -510,8 +1079,12 @@ void LayerStack::markDirty(int index)
 void LayerStack::notifyAreaChanged()
 {
 	if(!m_locked && !m_dirtyrect.isEmpty()) {
-		emit areaChanged(m_dirtyrect);
+		++m_dirtyClock;
+		addChangedArea(m_dirtyrect);
 		m_dirtyrect = QRect();
+
+		// No unlock() follows to publish the change
+		QMetaObject::invokeMethod(this, "publishRequestedSnapshot", Qt::QueuedConnection);
 	}
 }
 
@@ -523,6 +1096,11 @@ void LayerStack::notifyLayerInfoChange(const Layer *layer)
 	// only and we don't need to announce changes to them.
 	const int idx = indexOf(layer->id());
 	if(idx>=0) {
+		if(m_layers.at(idx) == layer) {
+			// Let the flattening cache treat this as the hot layer
+			m_hotLayerId = layer->id();
+			m_hotLayerGeneration = Tile::nextGeneration();
+		}
 		emit layerChanged(idx, layer->info());
 	}
 }
@@ -629,10 +1207,14 @@ Savepoint::~Savepoint()
 Savepoint *LayerStack::makeSavepoint()
 {
 	Savepoint *sp = new Savepoint;
+	int scanned = 0;
 	for(Layer *l : m_layers) {
-		l->optimize();
+		scanned += l->optimize();
+		// Interned before copying, so the savepoint shares the result
+		l->internTiles();
 		sp->layers.append(new Layer(*l));
 	}
+	m_savepointTilesScanned.storeRelease(scanned);
 
 	sp->width = _width;
 	sp->height = _height;
@@ -640,6 +1222,14 @@ Savepoint *LayerStack::makeSavepoint()
 	return sp;
 }
 
+void LayerStack::findSwappableTiles(QVector<const Tile*> &tiles) const
+{
+	for(const Layer *l : m_layers) {
+		if(l->isHidden())
+			l->findSwappableTiles(tiles);
+	}
+}
+
 void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 {
 	const QSize oldsize(_width, _height);
@@ -650,6 +1240,9 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 		_xtiles = Tile::roundTiles(_width);
 		_ytiles = Tile::roundTiles(_height);
 		_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+		m_dirtyStamps = QVector<quint32>(_xtiles*_ytiles, m_dirtyClock);
+		m_flatCache.clear();
+		m_lod.resize(_width, _height);
 		emit resized(0, 0, oldsize);
 	} else {
 		// Mark changed tiles as changed. Usually savepoints are quite close together
@@ -658,6 +1251,7 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 			// Layers added or deleted, just refresh everything
 			// (force refresh even if layer stack is empty)
 			_dirtytiles.fill(true);
+			m_dirtyStamps.fill(m_dirtyClock);
 			m_dirtyrect = QRect(0, 0, _width, _height);
 
 		} else {
@@ -684,8 +1278,8 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 	// Restore layers
 	while(!m_layers.isEmpty())
 		delete m_layers.takeLast();
-	for(const Layer *l : savepoint->layers)
-		m_layers.append(new Layer(*l));
+	for(int i=0;i<savepoint->layers.size();++i)
+		m_layers.append(savepoint->restoredLayer(i));
 
 	notifyAreaChanged();
 	emit layersChanged(layerInfos());
@@ -707,9 +1301,73 @@ void Savepoint::toDatastream(QDataStream &out) const
 
 	// Write layers
 	out << quint8(layers.size());
-	for(const Layer *layer : layers) {
-		layer->toDatastream(out);
+	for(int i=0;i<layers.size();++i) {
+		if(coldtiles.isEmpty()) {
+			layers.at(i)->toDatastream(out);
+		} else {
+			const Layer *layer = restoredLayer(i);
+			layer->toDatastream(out);
+			delete layer;
+		}
+	}
+}
+
+Layer *Savepoint::restoredLayer(int index) const
+{
+	Layer *layer = new Layer(*layers.at(index));
+	coldtiles.forEachTile(index, [layer](int i, const Tile &t) {
+		layer->rtile(i) = t;
+	});
+	return layer;
+}
+
+QList<ColdTile> Savepoint::findColdTiles()
+{
+	cold = true;
+
+	QList<ColdTile> tiles;
+	for(int l=0;l<layers.size();++l) {
+		const Layer *layer = layers.at(l);
+		const int count = Tile::roundTiles(layer->width()) * Tile::roundTiles(layer->height());
+		for(int i=0;i<count;++i) {
+			if(layer->isTileExclusive(i)) {
+				const ColdTile t = { l, i, layer->tile(i), QByteArray() };
+				tiles << t;
+			}
+		}
 	}
+	return tiles;
+}
+
+void Savepoint::compressTiles(QList<ColdTile> &tiles)
+{
+	for(ColdTile &t : tiles)
+		t.data = TileStore::compress(t.tile);
+}
+
+void Savepoint::storeColdTiles(QList<ColdTile> &tiles)
+{
+	for(ColdTile &t : tiles) {
+		if(t.data.isEmpty() || t.layer >= layers.size())
+			continue;
+
+		Layer *layer = layers.at(t.layer);
+		const bool unchanged = layer->tile(t.index) == t.tile;
+
+		// Release our reference first, so the exclusivity check sees only the layer's
+		t.tile = Tile();
+		if(unchanged && layer->isTileExclusive(t.index)) {
+			coldtiles.insert(t.layer, t.index, t.data);
+			layer->rtile(t.index) = Tile();
+		}
+	}
+	tiles.clear();
+}
+
+void Savepoint::findSwappableTiles(QVector<const Tile*> &tiles) const
+{
+	for(const Layer *l : layers)
+		l->findSwappableTiles(tiles);
 }
 
 Savepoint *Savepoint::fromDatastream(QDataStream &in, LayerStack *owner)
@@ -26,6 +26,14 @@
 #include <QImage>
 #include <QBitArray>
 #include <QMutex>
+#include <QCache>
+#include <QAtomicPointer>
+#include <QAtomicInt>
+
+#include "brushmask.h"
+#include "lodpyramid.h"
+#include "rendersnapshot.h"
+#include "tilestore.h"
 
 class QDataStream;
 
@@ -115,9 +123,60 @@ public:
 	//! Paint all changed tiles in the given area
 	void paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean=true);
 
+	/**
+	 * @brief Set the area shown in the view
+	 *
+	 * The dirty tiles in this area are flattened into a new render snapshot
+	 * whenever the layer stack is unlocked in its own thread. Changes made from
+	 * other threads or without locking are published from a queued call.
+	 * This is thread safe.
+	 */
+	void setViewArea(const QRect &area);
+
+	/**
+	 * @brief Ask for the dirty tiles in the area to be flattened into a new snapshot
+	 *
+	 * The snapshot is published from the canvas thread as soon as it gets
+	 * to it. This is thread safe.
+	 */
+	void requestSnapshot(const QRect &area);
+
+	/**
+	 * @brief Take the latest render snapshot
+	 *
+	 * A new snapshot is published only after the previous one has been taken,
+	 * so changes made in the meantime are coalesced into the next one.
+	 * This is thread safe and does not lock the layer stack.
+	 *
+	 * @return new snapshot (the caller takes ownership) or null if none has been published
+	 */
+	RenderSnapshot *takeSnapshot();
+
+	/**
+	 * @brief Take the area changed since this was last called
+	 *
+	 * areaChanged is not emitted again until this is called.
+	 * This is thread safe.
+	 */
+	QRect takeChangedArea();
+
+	/**
+	 * @brief Set the time allowed for flattening tiles per render snapshot
+	 *
+	 * When there are more changed tiles than fit in the budget, the most
+	 * recently changed ones are flattened first and the rest are left for
+	 * the following snapshots. This is thread safe.
+	 *
+	 * @param usecs budget in microseconds (0 for no limit)
+	 */
+	void setFrameBudget(int usecs);
+
 	//! Get the merged color value at the point
 	QColor colorAt(int x, int y, int dia=0) const;
 
+	//! Get the merged value (straight ARGB) of a single pixel
+	QRgb pixelAt(int x, int y) const;
+
 	//! Return a flattened image of the layer stack
 	QImage toFlatImage() const;
 
@@ -127,6 +186,19 @@ public:
 	//! Get a merged tile
 	Tile getFlatTile(int x, int y) const;
 
+	/**
+	 * @brief Get the downscaled copies of the flattened image
+	 *
+	 * The pyramid is updated by paintChangedTiles()
+	 */
+	const LodPyramid &lodPyramid() const { return m_lod; }
+
+	//! Get the brush mask cache shared by all drawing contexts
+	BrushMaskCache &brushMaskCache() { return m_brushMaskCache; }
+
+	//! Get the brush mask cache shared by all drawing contexts
+	const BrushMaskCache &brushMaskCache() const { return m_brushMaskCache; }
+
 	//! Mark the tiles under the area dirty
 	void markDirty(const QRect &area);
 
@@ -148,9 +220,15 @@ public:
 	//! Create a new savepoint
 	Savepoint *makeSavepoint();
 
+	//! Get the number of tiles whose pixels were scanned when the last savepoint was made (safe to call from any thread)
+	int savepointTilesScanned() const { return m_savepointTilesScanned.loadAcquire(); }
+
 	//! Restore layer stack to a previous savepoint
 	void restoreSavepoint(const Savepoint *savepoint);
 
+	//! Append the tiles of hidden layers to the list of swap candidates (see tileswap.h)
+	void findSwappableTiles(QVector<const Tile*> &tiles) const;
+
 	//! Set layer view mode
 	void setViewMode(ViewMode mode);
 
@@ -183,9 +261,17 @@ public:
 	};
 
 signals:
-	//! Emitted when the visible layers are edited
+	/**
+	 * @brief Emitted when the visible layers are edited
+	 *
+	 * Further changes are accumulated without emitting this again until
+	 * the view calls takeChangedArea(), which returns the whole changed area.
+	 */
 	void areaChanged(const QRect &area);
 
+	//! A new render snapshot can be taken (see takeSnapshot())
+	void snapshotPublished();
+
 	//! Layer width/height changed
 	void resized(int xoffset, int yoffset, const QSize &oldsize);
 
@@ -201,8 +287,28 @@ signals:
 	//! All (or at least a lot of) layers have just changed
 	void layersChanged(const QList<LayerInfo> &layers);
 
+private slots:
+	void publishRequestedSnapshot();
+
 private:
-	void flattenTile(quint32 *data, int xindex, int yindex) const;
+	struct FlatCacheEntry;
+	struct FlattenJob;
+
+	QVector<FlatTile> flattenChangedTiles(const QRect &rect, bool clean, int maxTiles=-1);
+	void takeChangedTiles(FlattenJob &job, const QRect &rect, bool clean, int maxTiles);
+	QVector<FlatTile> flattenTiles(FlattenJob &job) const;
+	void storeFlatCache(const FlattenJob &job);
+	void prepareSnapshot(FlattenJob &job);
+	void publishSnapshot(FlattenJob &job);
+	void addChangedArea(const QRect &area);
+
+	void flattenTile(Tile &dest, int xindex, int yindex) const;
+	void flattenLayers(Tile &dest, int xindex, int yindex, int first, int last) const;
+	bool flattenTileCached(Tile &dest, int xindex, int yindex, FlatCacheEntry &entry) const;
+	quint64 layerRangeKey(int xindex, int yindex, int first, int last) const;
+	int hotLayerAt(int xindex, int yindex) const;
+	int occludingLayerAt(int xindex, int yindex, int first, int last) const;
+	static bool hasSublayerContent(const Layer *layer, int xindex, int yindex);
 
 	bool isVisible(int idx) const;
 	int layerOpacity(int idx) const;
@@ -217,6 +323,10 @@ private:
 	QBitArray _dirtytiles;
 	QRect m_dirtyrect;
 
+	// When each tile was last marked dirty (in units of m_dirtyClock)
+	QVector<quint32> m_dirtyStamps;
+	quint32 m_dirtyClock;
+
 	ViewMode _viewmode;
 	int _viewlayeridx;
 	int _onionskinsBelow, _onionskinsAbove;
@@ -225,6 +335,40 @@ private:
 
 	QMutex m_mutex;
 	bool m_locked;
+
+	BrushMaskCache m_brushMaskCache;
+
+	// Cached composites below the most recently changed layer (per tile)
+	QCache<int, FlatCacheEntry> m_flatCache;
+
+	// Downscaled flattened images for zoomed out views
+	LodPyramid m_lod;
+
+	// Render snapshot published for the view, but not taken yet
+	QAtomicPointer<RenderSnapshot> m_snapshot;
+
+	// Set when a snapshot was skipped because the view hadn't taken the previous one
+	QAtomicInt m_snapshotWanted;
+
+	// The areas the view wants flattened and the area changed since
+	// the view last asked (protected by m_viewLock)
+	QMutex m_viewLock;
+	QRect m_viewArea;
+	QRect m_requestedArea;
+	QRect m_changedArea;
+
+	// Flattening time allowed per snapshot (microseconds) and the recent average per tile
+	QAtomicInt m_frameBudget;
+	qreal m_tileCost;
+
+	// Canvas size in the last published snapshot
+	QSize m_publishedSize;
+
+	// The layer whose attributes (opacity, blend mode, visibility) changed last
+	int m_hotLayerId;
+	quint64 m_hotLayerGeneration;
+
+	QAtomicInt m_savepointTilesScanned;
 };
 
 /// Layer stack savepoint for undo use
@@ -236,10 +380,47 @@ public:
 	void toDatastream(QDataStream &out) const;
 	static Savepoint *fromDatastream(QDataStream &in, LayerStack *owner);
 
+	/**
+	 * @brief Find the tiles whose memory is held only by this savepoint
+	 *
+	 * The returned tiles can be compressed in a background thread with
+	 * compressTiles() and then moved into cold storage with storeColdTiles().
+	 * After this, isCold() returns true.
+	 */
+	QList<ColdTile> findColdTiles();
+
+	//! Compress tiles returned by findColdTiles(). This is thread safe.
+	static void compressTiles(QList<ColdTile> &tiles);
+
+	/**
+	 * @brief Replace tiles with their compressed versions
+	 *
+	 * Tiles that have changed or have become shared since findColdTiles()
+	 * was called are skipped.
+	 */
+	void storeColdTiles(QList<ColdTile> &tiles);
+
+	//! Has this savepoint been checked for cold tiles?
+	bool isCold() const { return cold; }
+
+	//! Get the compressed tiles of this savepoint
+	const TileStore &coldTiles() const { return coldtiles; }
+
+	//! Append the tiles of this savepoint to the list of swap candidates (see tileswap.h)
+	void findSwappableTiles(QVector<const Tile*> &tiles) const;
+
 private:
-	Savepoint() {}
+	Savepoint() : cold(false) {}
+
+	//! Get a copy of a layer, with its compressed tiles restored
+	Layer *restoredLayer(int index) const;
+
 	QList<Layer*> layers;
 	int width, height;
+
+	// Compressed tiles (replaced with null tiles in the layers)
+	TileStore coldtiles;
+	bool cold;
 };
 
 }
@@ -0,0 +1,141 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lodpyramid.h"
+#include "tile.h"
+
+#include <cmath>
+
+namespace paintcore {
+
+namespace {
+
+//! Average of four pixels (per channel)
+inline quint32 average(quint32 a, quint32 b, quint32 c, quint32 d)
+{
+	const quint32 rb = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+	const quint32 ag = ((a>>8) & 0x00ff00ff) + ((b>>8) & 0x00ff00ff) + ((c>>8) & 0x00ff00ff) + ((d>>8) & 0x00ff00ff) + 0x00020002;
+	return ((rb >> 2) & 0x00ff00ff) | ((ag << 6) & 0xff00ff00);
+}
+
+//! Width and height of a tile in the given level
+inline int tileSize(int level)
+{
+	return Tile::SIZE >> level;
+}
+
+}
+
+void LodPyramid::resize(int width, int height)
+{
+	m_levels.clear();
+
+	if(width<=0 || height<=0)
+		return;
+
+	while(m_levels.size() < MAX_LEVELS && (width > Tile::SIZE || height > Tile::SIZE)) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+
+		QImage level(width, height, QImage::Format_ARGB32_Premultiplied);
+		level.fill(0);
+		m_levels.append(level);
+	}
+}
+
+int LodPyramid::levelForScale(qreal scale) const
+{
+	if(scale <= 0 || m_levels.isEmpty())
+		return 0;
+
+	const int level = int(std::floor(std::log2(1.0 / scale)));
+	return qBound(0, level, m_levels.size());
+}
+
+QVector<quint32> LodPyramid::downsampleTile(int tx, int ty, const Tile &tile) const
+{
+	int length = 0;
+	for(int i=1;i<=m_levels.size();++i)
+		length += tileSize(i) * tileSize(i);
+
+	QVector<quint32> lod(length);
+	if(lod.isEmpty())
+		return lod;
+
+	// Level 1 is downsampled straight from the tile
+	quint32 *out = lod.data();
+	const quint32 *src = tile.data();
+	const bool premultiply = !isPremultipliedStorage();
+	const int half = tileSize(1);
+
+	for(int y=0;y<half;++y) {
+		const quint32 *row0 = src + 2*y * Tile::SIZE;
+		const quint32 *row1 = row0 + Tile::SIZE;
+
+		for(int x=0;x<half;++x) {
+			const quint32 p = average(row0[2*x], row0[2*x+1], row1[2*x], row1[2*x+1]);
+			*(out++) = premultiply ? qPremultiply(p) : p;
+		}
+	}
+
+	// The smaller levels are downsampled from the previous one. At the right and
+	// bottom edges of the image, the last pixel of the previous level is repeated.
+	for(int i=2;i<=m_levels.size();++i) {
+		const int srcSize = tileSize(i-1);
+		const int size = tileSize(i);
+		const int srcRight = qBound(0, m_levels.at(i-2).width() - tx*srcSize, srcSize) - 1;
+		const int srcBottom = qBound(0, m_levels.at(i-2).height() - ty*srcSize, srcSize) - 1;
+		const quint32 *prev = out - srcSize * srcSize;
+
+		for(int y=0;y<size;++y) {
+			const quint32 *row0 = prev + 2*y * srcSize;
+			const quint32 *row1 = prev + qMax(0, qMin(2*y+1, srcBottom)) * srcSize;
+
+			for(int x=0;x<size;++x) {
+				const int x0 = 2*x;
+				const int x1 = qMax(0, qMin(x0+1, srcRight));
+				*(out++) = average(row0[x0], row0[x1], row1[x0], row1[x1]);
+			}
+		}
+	}
+
+	return lod;
+}
+
+void LodPyramid::updateTile(int tx, int ty, const QVector<quint32> &lod)
+{
+	const quint32 *src = lod.constData();
+	const quint32 *end = src + lod.size();
+
+	for(int i=1;i<=m_levels.size() && src<end;++i) {
+		QImage &level = m_levels[i-1];
+		const int size = tileSize(i);
+		const int x0 = tx * size;
+		const int y0 = ty * size;
+		const int w = qMin(size, level.width() - x0);
+		const int h = qMin(size, level.height() - y0);
+
+		for(int y=0;y<h;++y)
+			memcpy(level.scanLine(y0 + y) + x0*4, src + y*size, w * 4);
+
+		src += size * size;
+	}
+}
+
+}
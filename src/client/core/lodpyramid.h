@@ -0,0 +1,94 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_LODPYRAMID_H
+#define PAINTCORE_LODPYRAMID_H
+
+#include <QImage>
+#include <QVector>
+#include <QRect>
+
+namespace paintcore {
+
+class Tile;
+
+/**
+ * @brief Downscaled copies of the flattened canvas
+ *
+ * Level 1 is half the size of the canvas, level 2 a quarter, and so on.
+ * Level 0 is the full size image, which is not stored here.
+ *
+ * The levels are updated one flattened tile at a time. Since tiles are
+ * aligned to powers of two, the area a tile covers in each level depends
+ * only on that tile's pixels. The canvas thread can therefore downsample
+ * each tile as it is flattened (see downsampleTile()) and ship the results
+ * to the view, which just copies them into its levels (see updateTile()).
+ *
+ * The images are always in premultiplied ARGB format.
+ */
+class LodPyramid {
+public:
+	//! Maximum number of downscaled levels
+	static const int MAX_LEVELS = 6;
+
+	//! Reallocate the levels for a new canvas size. The levels are cleared.
+	void resize(int width, int height);
+
+	//! Get the number of downscaled levels
+	int levels() const { return m_levels.size(); }
+
+	//! Get a downscaled image (level must be in range 1..levels())
+	const QImage &level(int level) const { return m_levels.at(level-1); }
+
+	/**
+	 * @brief Get the most suitable level for viewing the canvas at the given scale
+	 *
+	 * This is the smallest level whose resolution is still at least
+	 * the viewing resolution, or 0 if the full size image should be used.
+	 */
+	int levelForScale(qreal scale) const;
+
+	/**
+	 * @brief Downsample a flattened tile into each level
+	 *
+	 * This does not modify the pyramid (only its size is used), so different
+	 * tiles may be downsampled in parallel.
+	 *
+	 * @param tx tile X index
+	 * @param ty tile Y index
+	 * @param tile the flattened tile (must have pixel data)
+	 * @return the tile's pixels in each level, packed one level after another
+	 */
+	QVector<quint32> downsampleTile(int tx, int ty, const Tile &tile) const;
+
+	/**
+	 * @brief Copy a downsampled tile into the levels
+	 *
+	 * @param tx tile X index
+	 * @param ty tile Y index
+	 * @param lod the tile's pixels as returned by downsampleTile() for a pyramid of the same size
+	 */
+	void updateTile(int tx, int ty, const QVector<quint32> &lod);
+
+private:
+	QVector<QImage> m_levels;
+};
+
+}
+
+#endif
@@ -18,8 +18,14 @@
 */
 
 #include "rasterop.h"
+#include "rasterop_p.h"
 
 #include <QRgb>
+#include <QDebug>
+
+#if defined(HAVE_SIMD_RASTEROPS) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace paintcore {
 
@@ -63,11 +69,6 @@ inline uint blend_multiply(uchar base, uchar blend) {
 	return qMin(255u, UINT8_MULT(base, blend));
 }
 
-//! Divide color values
-inline uint blend_divide(uchar base, uchar blend) {
-	return qMin(255u, (base*256u + blend/2) / (1+blend));
-}
-
 //! Darken color
 inline uint blend_darken(uchar base, uchar blend) {
 	return qMin(base, blend);
@@ -78,14 +79,43 @@ inline uint blend_lighten(uchar base, uchar blend) {
 	return qMax(base, blend);
 }
 
+/*
+ * The blending functions that need an integer division are precalculated
+ * into lookup tables indexed by [base][blend].
+ * The tables are filled in when the reference operations are created, which
+ * always happens before any raster operations are performed.
+ */
+namespace {
+rasterop::BlendLutTable BLEND_LUT[rasterop::LUT_COUNT];
+}
+
+void initBlendLuts()
+{
+	for(uint base=0;base<256;++base) {
+		for(uint blend=0;blend<256;++blend) {
+			// Divide color values
+			BLEND_LUT[rasterop::LUT_DIVIDE][base][blend] = qMin(255u, (base*256u + blend/2) / (1+blend));
+			// Color dodge
+			BLEND_LUT[rasterop::LUT_DODGE][base][blend] = qMin(255u, base * 256u / (256u - blend));
+			// Color burn
+			BLEND_LUT[rasterop::LUT_BURN][base][blend] = qBound(0, (255 - (int(255-base)*256 / int(blend+1))), 255);
+		}
+	}
+}
+
+//! Divide color values
+inline uint blend_divide(uchar base, uchar blend) {
+	return BLEND_LUT[rasterop::LUT_DIVIDE][base][blend];
+}
+
 //! Color dodge
 inline uint blend_dodge(uchar base, uchar blend) {
-	return qMin(255u, base * 256u / (256u - blend));
+	return BLEND_LUT[rasterop::LUT_DODGE][base][blend];
 }
 
 //! Color burn
 inline uint blend_burn(uchar base, uchar blend) {
-	return qBound(0, (255 - ((255-base)*256 / (blend+1))), 255);
+	return BLEND_LUT[rasterop::LUT_BURN][base][blend];
 }
 
 //! Add colors
@@ -98,6 +128,16 @@ inline uint blend_subtract(uchar base, uchar blend) {
 	return qMax(base-blend, 0);
 }
 
+/*
+ * Note. The straight alpha blending kernels (normal and behind) and the
+ * color erase kernels keep their per-pixel special cases. The general
+ * formula divides by the resulting alpha, which may be zero, and the special
+ * cases define results that differ from what the general formula would give.
+ * These functions are the reference the SIMD versions must match, so the
+ * special cases are part of their output. The SIMD versions compute both
+ * results and select between them without branching.
+ */
+
 // Normal alpha blend
 void doAlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
@@ -255,8 +295,9 @@ void color_erase_helper(fRGBA *src, const fRGBA *color)
 }
 
 // Specialized pixel composition: erase alpha channel
-void doMaskErase(quint32 *base, const uchar *mask, int w, int h, int maskskip, int baseskip)
+void doMaskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
 {
+	Q_UNUSED(color);
 	baseskip *= 4;
 	uchar *dest = reinterpret_cast<uchar*>(base) + 3;
 	for(int y=0;y<h;++y) {
@@ -311,6 +352,9 @@ void doMaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, i
 
 // A generic composition function for special blending modes
 // This doesn't touch the alpha channel.
+// Blending with mask value 0 leaves the pixel unchanged and with 255 yields
+// just the blend op result, so those need no special cases. Fully transparent
+// destination pixels are left alone, unless the mask is fully opaque.
 typedef uint(*BlendOp)(uchar,uchar);
 template<BlendOp BO>
 void doMaskComposite(quint32 *base, quint32 color, const uchar *mask,
@@ -321,36 +365,18 @@ void doMaskComposite(quint32 *base, quint32 color, const uchar *mask,
 	uchar *dest = reinterpret_cast<uchar*>(base);
 	for(int y=0;y<h;++y) {
 		for(int x=0;x<w;++x,++mask) {
-			// Special case: mask pixel is completely transparent
-			if(*mask==0) {
-				dest += 4;
-			}
-			// Special case: mask pixel is completely opaque
-			else if(*mask==255) {
-				*dest = BO(*dest, src[0]); ++dest;
-				*dest = BO(*dest, src[1]); ++dest;
-				*dest = BO(*dest, src[2]); ++dest;
-				++dest;
-			}
-			// The usual case: blending required
-			else {
-				if(dest[3]>0) {
-					*dest = UINT8_BLEND(BO(*dest, src[0]), *dest, *mask); ++dest;
-					*dest = UINT8_BLEND(BO(*dest, src[1]), *dest, *mask); ++dest;
-					*dest = UINT8_BLEND(BO(*dest, src[2]), *dest, *mask); ++dest;
-					++dest;
-				} else {
-					// No need to do anything if destination pixel is fully transparent
-					dest += 4;
-				}
-			}
+			const uint m = *mask & -uint(dest[3]>0 || *mask==255);
+			*dest = UINT8_BLEND(BO(*dest, src[0]), *dest, m); ++dest;
+			*dest = UINT8_BLEND(BO(*dest, src[1]), *dest, m); ++dest;
+			*dest = UINT8_BLEND(BO(*dest, src[2]), *dest, m); ++dest;
+			++dest;
 		}
 		dest += baseskip;
 		mask += maskskip;
 	}
 }
 
-std::array<quint32, 5> sampleMask(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip)
+std::array<quint32, 5> doSampleMask(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip)
 {
 	std::array<quint32, 5> result{ {0, 0, 0, 0, 0} };
 	pixelskip *= 4;
@@ -375,13 +401,14 @@ std::array<quint32, 5> sampleMask(const quint32 *pixels, const uchar *mask, int
 	return result;
 }
 
+template<bool OPAQUE>
 void doPixelAlphaBlend(quint32 *destination, const quint32 *source, uchar opacity, int len)
 {
 	uchar *dest = reinterpret_cast<uchar*>(destination);
 	const uchar *src = reinterpret_cast<const uchar*>(source);
 
 	while(len--) {
-		const uchar a = UINT8_MULT(src[3], opacity);
+		const uchar a = OPAQUE ? src[3] : UINT8_MULT(src[3], opacity);
 		const uchar a2 = UINT8_MULT(dest[3], 255-a);
 		const uchar a_out = a+a2;
 		if(a_out==0) {
@@ -396,6 +423,7 @@ void doPixelAlphaBlend(quint32 *destination, const quint32 *source, uchar opacit
 	}
 }
 
+template<bool OPAQUE>
 void doPixelAlphaUnder(quint32 *destination, const quint32 *source, uchar opacity, int len)
 {
 	uchar *dest = reinterpret_cast<uchar*>(destination);
@@ -403,7 +431,7 @@ void doPixelAlphaUnder(quint32 *destination, const quint32 *source, uchar opacit
 
 	while(len--) {
 		const uchar a2 = dest[3];
-		const uchar a = UINT8_MULT(255-a2, UINT8_MULT(src[3], opacity));
+		const uchar a = UINT8_MULT(255-a2, OPAQUE ? src[3] : UINT8_MULT(src[3], opacity));
 		const uchar a_out = a+a2;
 		if(a_out==0) {
 			src+=4;
@@ -418,18 +446,20 @@ void doPixelAlphaUnder(quint32 *destination, const quint32 *source, uchar opacit
 }
 
 // Specialized pixel composition: erase alpha channel
+template<bool OPAQUE>
 void doPixelErase(quint32 *destination, const quint32 *source, uchar opacity, int len)
 {
 	uchar *dest = reinterpret_cast<uchar*>(destination) + 3;
 	const uchar *src = reinterpret_cast<const uchar*>(source) + 3;
 	while(len--) {
-		uchar a = qMax(0, *dest - int(UINT8_MULT(*src, opacity)));
+		uchar a = qMax(0, *dest - int(OPAQUE ? *src : UINT8_MULT(*src, opacity)));
 		*dest = a;
 		dest += 4;
 		src += 4;
 	}
 }
 
+template<bool OPAQUE>
 void doPixelColorErase(quint32 *destination, const quint32 *source, uchar opacity, int len)
 {
 	const qreal o = opacity / 255.0;
@@ -437,7 +467,8 @@ void doPixelColorErase(quint32 *destination, const quint32 *source, uchar opacit
 	while(len--) {
 		fRGBA d = *destination;
 		fRGBA s = *source;
-		s.a *= o;
+		if(!OPAQUE)
+			s.a *= o;
 		color_erase_helper(&d, &s);
 		*destination = d.toPixel();
 		++destination;
@@ -453,6 +484,18 @@ void tintPixels(quint32 *pixels, int len, quint32 tint)
 	const quint8 a0 = t[3];
 	const quint8 a1 = 255 - a0;
 
+	if(isPremultipliedStorage()) {
+		// The tint color must be premultiplied by the alpha of each pixel
+		while(--len>=0) {
+			const quint8 a = c[3];
+			*c = UINT8_MULT(a1, *c) + UINT8_MULT(UINT8_MULT(a0, t[0]), a); ++c;
+			*c = UINT8_MULT(a1, *c) + UINT8_MULT(UINT8_MULT(a0, t[1]), a); ++c;
+			*c = UINT8_MULT(a1, *c) + UINT8_MULT(UINT8_MULT(a0, t[2]), a); ++c;
+			++c;
+		}
+		return;
+	}
+
 	while(--len>=0) {
 		*c = UINT8_MULT(a1, *c) + UINT8_MULT(a0, t[0]); ++c;
 		*c = UINT8_MULT(a1, *c) + UINT8_MULT(a0, t[1]); ++c;
@@ -461,68 +504,531 @@ void tintPixels(quint32 *pixels, int len, quint32 tint)
 	}
 }
 
-template<BlendOp BO>
+template<BlendOp BO, bool OPAQUE>
 void doPixelComposite(quint32 *destination, const quint32 *source, uchar alpha, int len)
 {
 	const uchar *src = reinterpret_cast<const uchar*>(source);
 	uchar *dest = reinterpret_cast<uchar*>(destination);
 	while(len--) {
-		// Special case: source or destination pixel is completely transparent
-		if(src[3]==0 || dest[3]==0) {
+		// Note: when either pixel is fully transparent, a2 is zero and
+		// the destination pixel is left unchanged.
+		const uchar a = OPAQUE ? src[3] : UINT8_MULT(src[3], alpha);
+		const uchar a2 = UINT8_MULT(a, dest[3]);
+		*dest = UINT8_BLEND(BO(*dest, src[0]), *dest, a2); ++dest;
+		*dest = UINT8_BLEND(BO(*dest, src[1]), *dest, a2); ++dest;
+		*dest = UINT8_BLEND(BO(*dest, src[2]), *dest, a2); ++dest;
+		++dest;
+		src += 4;
+	}
+}
+
+// Composition placeholders for unknown modes and modes that have no meaning for whole tiles
+void doMaskNothing(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	Q_UNUSED(base);
+	Q_UNUSED(color);
+	Q_UNUSED(mask);
+	Q_UNUSED(w);
+	Q_UNUSED(h);
+	Q_UNUSED(maskskip);
+	Q_UNUSED(baseskip);
+}
+
+void doPixelNothing(quint32 *destination, const quint32 *source, uchar opacity, int len)
+{
+	Q_UNUSED(destination);
+	Q_UNUSED(source);
+	Q_UNUSED(opacity);
+	Q_UNUSED(len);
+}
+
+//// Premultiplied alpha versions ////
+
+// Normal alpha blend. No division needed: dest = color*mask + dest*(1-mask)
+void doPremulMaskBlend(quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	baseskip *= 4;
+	const uchar *src = reinterpret_cast<const uchar*>(&color);
+	uchar *dest = reinterpret_cast<uchar*>(base);
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;++x,++mask) {
+			*dest = UINT8_BLEND(src[0], *dest, *mask); ++dest;
+			*dest = UINT8_BLEND(src[1], *dest, *mask); ++dest;
+			*dest = UINT8_BLEND(src[2], *dest, *mask); ++dest;
+			*dest = UINT8_BLEND(255, *dest, *mask); ++dest;
+		}
+		dest += baseskip;
+		mask += maskskip;
+	}
+}
+
+void doPremulMaskUnder(quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	baseskip *= 4;
+	const uchar *src = reinterpret_cast<const uchar*>(&color);
+	uchar *dest = reinterpret_cast<uchar*>(base);
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;++x,++mask) {
+			const uchar a = UINT8_MULT(255-dest[3], *mask);
+			*dest += UINT8_MULT(src[0], a); ++dest;
+			*dest += UINT8_MULT(src[1], a); ++dest;
+			*dest += UINT8_MULT(src[2], a); ++dest;
+			*dest += a; ++dest;
+		}
+		dest += baseskip;
+		mask += maskskip;
+	}
+}
+
+// Reduce the alpha of a premultiplied pixel. The color channels are scaled accordingly.
+inline void premulSetAlpha(uchar *dest, uint alpha)
+{
+	if(dest[3]==0 || dest[3]==alpha)
+		return;
+
+	const uint scale = (alpha << 16) / dest[3];
+	dest[0] = (dest[0] * scale + 0x8000) >> 16;
+	dest[1] = (dest[1] * scale + 0x8000) >> 16;
+	dest[2] = (dest[2] * scale + 0x8000) >> 16;
+	dest[3] = alpha;
+}
+
+void doPremulMaskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	Q_UNUSED(color);
+	baseskip *= 4;
+	uchar *dest = reinterpret_cast<uchar*>(base);
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;++x,++mask) {
+			premulSetAlpha(dest, qMax(0, dest[3] - *mask));
 			dest += 4;
 		}
-		// The usual case: blending required
-		else {
-			const uchar a = UINT8_MULT(src[3], alpha);
-			const uchar a2 = UINT8_MULT(a, dest[3]);
-			*dest = UINT8_BLEND(BO(*dest, src[0]), *dest, a2); ++dest;
-			*dest = UINT8_BLEND(BO(*dest, src[1]), *dest, a2); ++dest;
-			*dest = UINT8_BLEND(BO(*dest, src[2]), *dest, a2); ++dest;
-			++dest;
+		dest += baseskip;
+		mask += maskskip;
+	}
+}
+
+void doPremulMaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	baseskip *= 4;
+	uchar *dest = reinterpret_cast<uchar*>(base);
+	const uchar *src = reinterpret_cast<const uchar*>(&color);
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;++x,++mask) {
+			const uchar a = UINT8_MULT(src[3], *mask);
+			*(dest++) = UINT8_MULT(UINT8_MULT(src[0], *mask), a);
+			*(dest++) = UINT8_MULT(UINT8_MULT(src[1], *mask), a);
+			*(dest++) = UINT8_MULT(UINT8_MULT(src[2], *mask), a);
+			*(dest++) = a;
 		}
+		dest += baseskip;
+		mask += maskskip;
+	}
+}
+
+std::array<quint32, 5> doPremulSampleMask(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip)
+{
+	std::array<quint32, 5> result{ {0, 0, 0, 0, 0} };
+	pixelskip *= 4;
+	const uchar *pix = reinterpret_cast<const uchar*>(pixels);
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;++x,++mask) {
+			const uchar m = *mask;
+			result[0] += m;
+			result[1] += UINT8_MULT(pix[2], m); // red
+			result[2] += UINT8_MULT(pix[1], m); // green
+			result[3] += UINT8_MULT(pix[0], m); // blue
+			result[4] += UINT8_MULT(pix[3], m); // alpha
+			pix += 4;
+		}
+		pix += pixelskip;
+		mask += maskskip;
+	}
+
+	return result;
+}
+
+template<bool OPAQUE>
+void doPremulPixelBlend(quint32 *destination, const quint32 *source, uchar opacity, int len)
+{
+	uchar *dest = reinterpret_cast<uchar*>(destination);
+	const uchar *src = reinterpret_cast<const uchar*>(source);
+
+	while(len--) {
+		const uchar a = 255 - (OPAQUE ? src[3] : UINT8_MULT(src[3], opacity));
+		for(int i=0;i<4;++i,++dest,++src)
+			*dest = (OPAQUE ? *src : UINT8_MULT(*src, opacity)) + UINT8_MULT(*dest, a);
+	}
+}
+
+template<bool OPAQUE>
+void doPremulPixelUnder(quint32 *destination, const quint32 *source, uchar opacity, int len)
+{
+	uchar *dest = reinterpret_cast<uchar*>(destination);
+	const uchar *src = reinterpret_cast<const uchar*>(source);
+
+	while(len--) {
+		const uchar a = 255 - dest[3];
+		for(int i=0;i<4;++i,++dest,++src)
+			*dest += UINT8_MULT(OPAQUE ? *src : UINT8_MULT(*src, opacity), a);
+	}
+}
+
+template<bool OPAQUE>
+void doPremulPixelErase(quint32 *destination, const quint32 *source, uchar opacity, int len)
+{
+	uchar *dest = reinterpret_cast<uchar*>(destination);
+	const uchar *src = reinterpret_cast<const uchar*>(source) + 3;
+	while(len--) {
+		premulSetAlpha(dest, qMax(0, dest[3] - int(OPAQUE ? *src : UINT8_MULT(*src, opacity))));
+		dest += 4;
 		src += 4;
 	}
 }
 
+/*
+ * The remaining modes operate on straight color values. These wrappers
+ * unpremultiply the pixels, call the generic straight alpha function and
+ * premultiply the result. Pixels left unchanged by the blending function
+ * are restored bit-for-bit, so they do not accumulate rounding errors.
+ */
+static const int PREMUL_CHUNK = 64;
+
+template<BlendMode::Mode MODE>
+void doPremulMaskWrapper(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const MaskCompositeFunc straight = rasterop::reference().mask[rasterop::modeSlot(MODE)];
+	quint32 original[PREMUL_CHUNK], unpremultiplied[PREMUL_CHUNK];
+
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<w;x+=PREMUL_CHUNK) {
+			const int n = qMin(PREMUL_CHUNK, w-x);
+			for(int i=0;i<n;++i) {
+				original[i] = base[i];
+				base[i] = unpremultiplied[i] = qUnpremultiply(base[i]);
+			}
+
+			straight(base, color, mask, n, 1, 0, 0);
+
+			for(int i=0;i<n;++i)
+				base[i] = base[i] == unpremultiplied[i] ? original[i] : qPremultiply(base[i]);
+
+			base += n;
+			mask += n;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+template<BlendMode::Mode MODE, bool OPAQUE>
+void doPremulPixelWrapper(quint32 *destination, const quint32 *source, uchar opacity, int len)
+{
+	const PixelCompositeFunc straight = rasterop::reference().pixels[rasterop::modeSlot(MODE)][OPAQUE ? rasterop::FULL_OPACITY : rasterop::PARTIAL_OPACITY];
+	quint32 original[PREMUL_CHUNK], unpremultiplied[PREMUL_CHUNK], src[PREMUL_CHUNK];
+
+	while(len>0) {
+		const int n = qMin(PREMUL_CHUNK, len);
+		for(int i=0;i<n;++i) {
+			original[i] = destination[i];
+			destination[i] = unpremultiplied[i] = qUnpremultiply(destination[i]);
+			src[i] = qUnpremultiply(source[i]);
+		}
+
+		straight(destination, src, opacity, n);
+
+		for(int i=0;i<n;++i)
+			destination[i] = destination[i] == unpremultiplied[i] ? original[i] : qPremultiply(destination[i]);
+
+		destination += n;
+		source += n;
+		len -= n;
+	}
+}
+
+namespace rasterop {
+
+namespace {
+
+Operations makeReference()
+{
+	initBlendLuts();
+
+	Operations ops;
+	ops.name = "generic";
+
+	ops.mask[modeSlot(BlendMode::MODE_ERASE)] = doMaskErase;
+	ops.mask[modeSlot(BlendMode::MODE_NORMAL)] = doAlphaMaskBlend;
+	ops.mask[modeSlot(BlendMode::MODE_MULTIPLY)] = doMaskComposite<blend_multiply>;
+	ops.mask[modeSlot(BlendMode::MODE_DIVIDE)] = doMaskComposite<blend_divide>;
+	ops.mask[modeSlot(BlendMode::MODE_BURN)] = doMaskComposite<blend_burn>;
+	ops.mask[modeSlot(BlendMode::MODE_DODGE)] = doMaskComposite<blend_dodge>;
+	ops.mask[modeSlot(BlendMode::MODE_DARKEN)] = doMaskComposite<blend_darken>;
+	ops.mask[modeSlot(BlendMode::MODE_LIGHTEN)] = doMaskComposite<blend_lighten>;
+	ops.mask[modeSlot(BlendMode::MODE_SUBTRACT)] = doMaskComposite<blend_subtract>;
+	ops.mask[modeSlot(BlendMode::MODE_ADD)] = doMaskComposite<blend_add>;
+	ops.mask[modeSlot(BlendMode::MODE_RECOLOR)] = doMaskComposite<blend_blend>;
+	ops.mask[modeSlot(BlendMode::MODE_BEHIND)] = doAlphaMaskUnder;
+	ops.mask[modeSlot(BlendMode::MODE_COLORERASE)] = doMaskColorErase;
+	ops.mask[modeSlot(BlendMode::MODE_REPLACE)] = doMaskCopy;
+
+	ops.pixels[modeSlot(BlendMode::MODE_ERASE)][PARTIAL_OPACITY] = doPixelErase<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_ERASE)][FULL_OPACITY] = doPixelErase<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][PARTIAL_OPACITY] = doPixelAlphaBlend<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][FULL_OPACITY] = doPixelAlphaBlend<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_MULTIPLY)][PARTIAL_OPACITY] = doPixelComposite<blend_multiply, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_MULTIPLY)][FULL_OPACITY] = doPixelComposite<blend_multiply, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DIVIDE)][PARTIAL_OPACITY] = doPixelComposite<blend_divide, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DIVIDE)][FULL_OPACITY] = doPixelComposite<blend_divide, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_BURN)][PARTIAL_OPACITY] = doPixelComposite<blend_burn, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_BURN)][FULL_OPACITY] = doPixelComposite<blend_burn, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DODGE)][PARTIAL_OPACITY] = doPixelComposite<blend_dodge, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DODGE)][FULL_OPACITY] = doPixelComposite<blend_dodge, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DARKEN)][PARTIAL_OPACITY] = doPixelComposite<blend_darken, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DARKEN)][FULL_OPACITY] = doPixelComposite<blend_darken, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_LIGHTEN)][PARTIAL_OPACITY] = doPixelComposite<blend_lighten, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_LIGHTEN)][FULL_OPACITY] = doPixelComposite<blend_lighten, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_SUBTRACT)][PARTIAL_OPACITY] = doPixelComposite<blend_subtract, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_SUBTRACT)][FULL_OPACITY] = doPixelComposite<blend_subtract, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_ADD)][PARTIAL_OPACITY] = doPixelComposite<blend_add, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_ADD)][FULL_OPACITY] = doPixelComposite<blend_add, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_RECOLOR)][PARTIAL_OPACITY] = doPixelComposite<blend_blend, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_RECOLOR)][FULL_OPACITY] = doPixelComposite<blend_blend, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_BEHIND)][PARTIAL_OPACITY] = doPixelAlphaUnder<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_BEHIND)][FULL_OPACITY] = doPixelAlphaUnder<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_COLORERASE)][PARTIAL_OPACITY] = doPixelColorErase<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_COLORERASE)][FULL_OPACITY] = doPixelColorErase<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_REPLACE)][PARTIAL_OPACITY] = doPixelNothing; // not implemented
+	ops.pixels[modeSlot(BlendMode::MODE_REPLACE)][FULL_OPACITY] = doPixelNothing;
+
+	ops.sampleMask = doSampleMask;
+
+	return ops;
+}
+
+//! Replace the straight alpha operations with premultiplied ones
+void installPremultiplied(Operations &ops)
+{
+	ops.name = "generic/premultiplied";
+
+	ops.mask[modeSlot(BlendMode::MODE_ERASE)] = doPremulMaskErase;
+	ops.mask[modeSlot(BlendMode::MODE_NORMAL)] = doPremulMaskBlend;
+	ops.mask[modeSlot(BlendMode::MODE_MULTIPLY)] = doPremulMaskWrapper<BlendMode::MODE_MULTIPLY>;
+	ops.mask[modeSlot(BlendMode::MODE_DIVIDE)] = doPremulMaskWrapper<BlendMode::MODE_DIVIDE>;
+	ops.mask[modeSlot(BlendMode::MODE_BURN)] = doPremulMaskWrapper<BlendMode::MODE_BURN>;
+	ops.mask[modeSlot(BlendMode::MODE_DODGE)] = doPremulMaskWrapper<BlendMode::MODE_DODGE>;
+	ops.mask[modeSlot(BlendMode::MODE_DARKEN)] = doPremulMaskWrapper<BlendMode::MODE_DARKEN>;
+	ops.mask[modeSlot(BlendMode::MODE_LIGHTEN)] = doPremulMaskWrapper<BlendMode::MODE_LIGHTEN>;
+	ops.mask[modeSlot(BlendMode::MODE_SUBTRACT)] = doPremulMaskWrapper<BlendMode::MODE_SUBTRACT>;
+	ops.mask[modeSlot(BlendMode::MODE_ADD)] = doPremulMaskWrapper<BlendMode::MODE_ADD>;
+	ops.mask[modeSlot(BlendMode::MODE_RECOLOR)] = doPremulMaskWrapper<BlendMode::MODE_RECOLOR>;
+	ops.mask[modeSlot(BlendMode::MODE_COLORERASE)] = doPremulMaskWrapper<BlendMode::MODE_COLORERASE>;
+	ops.mask[modeSlot(BlendMode::MODE_BEHIND)] = doPremulMaskUnder;
+	ops.mask[modeSlot(BlendMode::MODE_REPLACE)] = doPremulMaskCopy;
+
+	ops.pixels[modeSlot(BlendMode::MODE_ERASE)][PARTIAL_OPACITY] = doPremulPixelErase<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_ERASE)][FULL_OPACITY] = doPremulPixelErase<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][PARTIAL_OPACITY] = doPremulPixelBlend<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][FULL_OPACITY] = doPremulPixelBlend<true>;
+	ops.pixels[modeSlot(BlendMode::MODE_MULTIPLY)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_MULTIPLY, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_MULTIPLY)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_MULTIPLY, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DIVIDE)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DIVIDE, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DIVIDE)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DIVIDE, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_BURN)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_BURN, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_BURN)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_BURN, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DODGE)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DODGE, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DODGE)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DODGE, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_DARKEN)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DARKEN, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_DARKEN)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_DARKEN, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_LIGHTEN)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_LIGHTEN, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_LIGHTEN)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_LIGHTEN, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_SUBTRACT)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_SUBTRACT, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_SUBTRACT)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_SUBTRACT, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_ADD)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_ADD, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_ADD)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_ADD, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_RECOLOR)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_RECOLOR, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_RECOLOR)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_RECOLOR, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_COLORERASE)][PARTIAL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_COLORERASE, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_COLORERASE)][FULL_OPACITY] = doPremulPixelWrapper<BlendMode::MODE_COLORERASE, true>;
+	ops.pixels[modeSlot(BlendMode::MODE_BEHIND)][PARTIAL_OPACITY] = doPremulPixelUnder<false>;
+	ops.pixels[modeSlot(BlendMode::MODE_BEHIND)][FULL_OPACITY] = doPremulPixelUnder<true>;
+
+	ops.sampleMask = doPremulSampleMask;
+}
+
+#ifdef HAVE_SIMD_RASTEROPS
+bool cpuHasSse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return info[3] & (1<<26);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+
+	// The OS must support saving the AVX registers too
+	__cpuid(info, 1);
+	const int OSXSAVE_AVX = (1<<27) | (1<<28);
+	if((info[2] & OSXSAVE_AVX) != OSXSAVE_AVX || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return info[1] & (1<<5);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+const Operations *selectImplementation(bool premultiplied)
+{
+	const QByteArray forced = qgetenv("DRAWPILE_RASTEROPS");
+	const Operations *ops = nullptr;
+
+	if(!forced.isEmpty()) {
+		ops = implementation(forced.constData(), premultiplied);
+		if(!ops)
+			qWarning() << "Raster operation implementation" << forced << "not available!";
+	}
+
+#ifdef HAVE_SIMD_RASTEROPS
+	if(!ops)
+		ops = implementation("avx2", premultiplied);
+	if(!ops)
+		ops = implementation("sse2", premultiplied);
+#endif
+	if(!ops)
+		ops = implementation("generic", premultiplied);
+
+	return ops;
+}
+
+bool premultipliedStorage = false;
+
+}
+
+const Operations &reference()
+{
+	static const Operations ops = makeReference();
+	return ops;
+}
+
+const BlendLutTable &blendLut(BlendLut lut)
+{
+	return BLEND_LUT[lut];
+}
+
+const Operations *implementation(const char *name, bool premultiplied)
+{
+	if(qstrcmp(name, "generic")==0) {
+		if(!premultiplied)
+			return &reference();
+
+		static const Operations generic = [] { Operations ops = reference(); installPremultiplied(ops); return ops; }();
+		return &generic;
+	}
+
+#ifdef HAVE_SIMD_RASTEROPS
+	if(qstrcmp(name, "sse2")==0 && cpuHasSse2()) {
+		if(premultiplied) {
+			static const Operations sse2 = [] { Operations ops = *implementation("generic", true); installSse2(ops, true); return ops; }();
+			return &sse2;
+		} else {
+			static const Operations sse2 = [] { Operations ops = reference(); installSse2(ops, false); return ops; }();
+			return &sse2;
+		}
+	}
+
+	if(qstrcmp(name, "avx2")==0 && cpuHasAvx2()) {
+		if(premultiplied) {
+			static const Operations avx2 = [] { Operations ops = *implementation("generic", true); installAvx2(ops, true); return ops; }();
+			return &avx2;
+		} else {
+			static const Operations avx2 = [] { Operations ops = reference(); installAvx2(ops, false); return ops; }();
+			return &avx2;
+		}
+	}
+#endif
+
+	return nullptr;
+}
+
+const Operations &active()
+{
+	if(premultipliedStorage) {
+		static const Operations *ops = selectImplementation(true);
+		return *ops;
+	} else {
+		static const Operations *ops = selectImplementation(false);
+		return *ops;
+	}
+}
+
+}
+
+void setPremultipliedStorage(bool premultiplied)
+{
+	rasterop::premultipliedStorage = premultiplied;
+}
+
+bool isPremultipliedStorage()
+{
+	return rasterop::premultipliedStorage;
+}
+
+const char *rasterOpsName()
+{
+	return rasterop::active().name;
+}
+
+MaskCompositeFunc maskCompositor(BlendMode::Mode mode)
+{
+	const int slot = rasterop::modeSlot(mode);
+	if(slot >= rasterop::MODE_SLOTS)
+		return doMaskNothing;
+
+	return rasterop::active().mask[slot];
+}
+
+PixelCompositeFunc pixelCompositor(BlendMode::Mode mode, uchar opacity)
+{
+	const int slot = rasterop::modeSlot(mode);
+	if(slot >= rasterop::MODE_SLOTS)
+		return doPixelNothing;
+
+	return rasterop::active().pixels[slot][rasterop::opacityClass(opacity)];
+}
+
 void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
 {
-	switch(mode) {
-	case BlendMode::MODE_ERASE: doMaskErase(base, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_NORMAL: doAlphaMaskBlend(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_MULTIPLY: doMaskComposite<blend_multiply>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_DIVIDE: doMaskComposite<blend_divide>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_BURN: doMaskComposite<blend_burn>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_DODGE: doMaskComposite<blend_dodge>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_DARKEN: doMaskComposite<blend_darken>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_LIGHTEN: doMaskComposite<blend_lighten>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_SUBTRACT: doMaskComposite<blend_subtract>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_ADD: doMaskComposite<blend_add>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_RECOLOR: doMaskComposite<blend_blend>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_BEHIND: doAlphaMaskUnder(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_COLORERASE: doMaskColorErase(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_REPLACE: doMaskCopy(base, color, mask, w, h, maskskip, baseskip); break;
-	}
+	maskCompositor(mode)(base, color, mask, w, h, maskskip, baseskip);
 }
 
 void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
 {
-	switch(mode) {
-	case BlendMode::MODE_ERASE: doPixelErase(base, over, opacity, len); break;
-	case BlendMode::MODE_NORMAL: doPixelAlphaBlend(base, over, opacity, len); break;
-	case BlendMode::MODE_MULTIPLY: doPixelComposite<blend_multiply>(base, over, opacity, len); break;
-	case BlendMode::MODE_DIVIDE: doPixelComposite<blend_divide>(base, over, opacity, len); break;
-	case BlendMode::MODE_BURN: doPixelComposite<blend_burn>(base, over, opacity, len); break;
-	case BlendMode::MODE_DODGE: doPixelComposite<blend_dodge>(base, over, opacity, len); break;
-	case BlendMode::MODE_DARKEN: doPixelComposite<blend_darken>(base, over, opacity, len); break;
-	case BlendMode::MODE_LIGHTEN: doPixelComposite<blend_lighten>(base, over, opacity, len); break;
-	case BlendMode::MODE_SUBTRACT: doPixelComposite<blend_subtract>(base, over, opacity, len); break;
-	case BlendMode::MODE_ADD: doPixelComposite<blend_add>(base, over, opacity, len); break;
-	case BlendMode::MODE_RECOLOR: doPixelComposite<blend_blend>(base, over, opacity, len); break;
-	case BlendMode::MODE_BEHIND: doPixelAlphaUnder(base, over, opacity, len); break;
-	case BlendMode::MODE_COLORERASE: doPixelColorErase(base, over, opacity, len); break;
-	case BlendMode::MODE_REPLACE: /* not implemented */ break;
-	}
+	pixelCompositor(mode, opacity)(base, over, opacity, len);
+}
+
+std::array<quint32, 5> sampleMask(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip)
+{
+	return rasterop::active().sampleMask(pixels, mask, w, h, maskskip, pixelskip);
 }
 
 }
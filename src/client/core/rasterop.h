@@ -26,6 +26,46 @@
 
 namespace paintcore {
 
+/**
+ * @brief Select the tile pixel storage format
+ *
+ * By default, pixels are stored as straight (non-premultiplied) ARGB.
+ * When premultiplied storage is enabled, all the raster operations below
+ * expect and produce premultiplied pixel data. Color arguments are always
+ * straight ARGB.
+ *
+ * This must be called at startup, before any tiles are created.
+ */
+void setPremultipliedStorage(bool premultiplied);
+
+//! Are tile pixels stored with premultiplied alpha?
+bool isPremultipliedStorage();
+
+//! Get the name of the raster operation implementation in use (for debugging)
+const char *rasterOpsName();
+
+//! A mask compositing kernel. See compositeMask() for the parameters
+typedef void (*MaskCompositeFunc)(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+
+//! A pixel compositing kernel. See compositePixels() for the parameters
+typedef void (*PixelCompositeFunc)(quint32 *base, const quint32 *over, uchar opacity, int len);
+
+/**
+ * @brief Get the mask compositing kernel for the given blending mode
+ *
+ * When compositing many blocks with the same mode, fetch the kernel once
+ * and call it directly instead of using compositeMask().
+ */
+MaskCompositeFunc maskCompositor(BlendMode::Mode mode);
+
+/**
+ * @brief Get the pixel compositing kernel for the given blending mode and opacity
+ *
+ * Fully opaque compositing has its own specialized kernels.
+ * The same opacity value must also be passed to the returned kernel.
+ */
+PixelCompositeFunc pixelCompositor(BlendMode::Mode mode, uchar opacity);
+
 /**
  * Composite a color using a mask onto an image.
  * @param mode composition mode
@@ -0,0 +1,132 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// This file is compiled with AVX2 instructions enabled.
+// See rasterop_simd.h for details.
+
+#include <immintrin.h>
+
+#include "rasterop_simd.h"
+
+namespace paintcore {
+namespace rasterop {
+
+namespace {
+
+// Note: the AVX2 pack and unpack instructions work within 128 bit lanes.
+// This is fine, since every unpack is paired with a matching pack.
+struct Avx2 {
+	typedef __m256i I;
+	static const int PIXELS = 8;
+
+	static I load(const quint32 *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+	static void store(quint32 *p, I v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+
+	static I expandMask(const uchar *mask) {
+		const I v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask)));
+		return _mm256_shuffle_epi8(v, _mm256_set_epi8(
+			12, 12, 12, 12, 8, 8, 8, 8, 4, 4, 4, 4, 0, 0, 0, 0,
+			12, 12, 12, 12, 8, 8, 8, 8, 4, 4, 4, 4, 0, 0, 0, 0
+			));
+	}
+
+	static I zero() { return _mm256_setzero_si256(); }
+	static I set1_8(int v) { return _mm256_set1_epi8(char(v)); }
+	static I set1_16(short v) { return _mm256_set1_epi16(v); }
+	static I set1_32(quint32 v) { return _mm256_set1_epi32(int(v)); }
+	static I alphaWords() { return _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0); }
+
+	static I and_(I a, I b) { return _mm256_and_si256(a, b); }
+	static I or_(I a, I b) { return _mm256_or_si256(a, b); }
+	static I andnot(I a, I b) { return _mm256_andnot_si256(a, b); }
+
+	static I cmpeq8(I a, I b) { return _mm256_cmpeq_epi8(a, b); }
+	static I cmpeq32(I a, I b) { return _mm256_cmpeq_epi32(a, b); }
+	static bool allSet8(I a) { return _mm256_movemask_epi8(a) == -1; }
+
+	static I lo8(I a) { return _mm256_unpacklo_epi8(a, _mm256_setzero_si256()); }
+	static I hi8(I a) { return _mm256_unpackhi_epi8(a, _mm256_setzero_si256()); }
+	static I pack16(I lo, I hi) { return _mm256_packus_epi16(lo, hi); }
+	static I lo16(I a) { return _mm256_unpacklo_epi16(a, _mm256_setzero_si256()); }
+	static I hi16(I a) { return _mm256_unpackhi_epi16(a, _mm256_setzero_si256()); }
+
+	static I add16(I a, I b) { return _mm256_add_epi16(a, b); }
+	static I sub16(I a, I b) { return _mm256_sub_epi16(a, b); }
+	static I mul16(I a, I b) { return _mm256_mullo_epi16(a, b); }
+	static I srl16(I a, int n) { return _mm256_srli_epi16(a, n); }
+	static I min16(I a, I b) { return _mm256_min_epi16(a, b); }
+	static I max16(I a, I b) { return _mm256_max_epi16(a, b); }
+	static I subs16(I a, I b) { return _mm256_subs_epu16(a, b); }
+	static I subs8(I a, I b) { return _mm256_subs_epu8(a, b); }
+	static I add32(I a, I b) { return _mm256_add_epi32(a, b); }
+
+	static I div16(I n, I d) {
+		// Single precision division is exact here, since both operands are below 2^16
+		const __m256i z = _mm256_setzero_si256();
+		const __m256i lo = _mm256_cvttps_epi32(_mm256_div_ps(
+			_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(n, z)),
+			_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(d, z))
+			));
+		const __m256i hi = _mm256_cvttps_epi32(_mm256_div_ps(
+			_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(n, z)),
+			_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(d, z))
+			));
+		return _mm256_packs_epi32(lo, hi);
+	}
+
+	static I alpha16(I a) {
+		return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	}
+
+	typedef __m256d D;
+	static const int DPIXELS = 4;
+
+	static __m128i loadD(const quint32 *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	static void storeD(quint32 *p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+	static D cvtD(__m128i v) { return _mm256_cvtepi32_pd(v); }
+	static __m128i cvttD(D v) { return _mm256_cvttpd_epi32(v); }
+
+	static D dset1(double v) { return _mm256_set1_pd(v); }
+	static D dadd(D a, D b) { return _mm256_add_pd(a, b); }
+	static D dsub(D a, D b) { return _mm256_sub_pd(a, b); }
+	static D dmul(D a, D b) { return _mm256_mul_pd(a, b); }
+	static D ddiv(D a, D b) { return _mm256_div_pd(a, b); }
+	static D dmax(D a, D b) { return _mm256_max_pd(a, b); }
+	static D dcmplt(D a, D b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+	static D dcmpgt(D a, D b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+	static D dselect(D mask, D a, D b) { return _mm256_blendv_pd(b, a, mask); }
+};
+
+}
+
+void installAvx2(Operations &ops, bool premultiplied)
+{
+	if(premultiplied) {
+		ops.name = "avx2/premultiplied";
+		installPremultipliedOperations<Avx2>(ops);
+	} else {
+		ops.name = "avx2";
+		installMaskOperations<Avx2>(ops);
+		installPixelOperations<Avx2, false>(ops);
+		installPixelOperations<Avx2, true>(ops);
+	}
+}
+
+}
+}
@@ -0,0 +1,132 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RASTEROP_P_H
+#define PAINTCORE_RASTEROP_P_H
+
+#include <QtGlobal>
+#include <array>
+
+#include "rasterop.h"
+
+/*
+ * Internal interface between the generic raster operations and their
+ * instruction set specific implementations.
+ *
+ * Note: this header is also included by translation units that are compiled
+ * with extended instruction sets enabled. To keep those instructions from
+ * leaking into generic code through the linker's choice of inline function
+ * copies, everything defined here must have internal linkage.
+ */
+
+namespace paintcore {
+namespace rasterop {
+
+typedef std::array<quint32, 5> (*SampleMaskFunc)(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip);
+
+//! Number of blend mode slots in an operation table
+static const int MODE_SLOTS = BlendMode::MODE_COLORERASE + 2;
+
+//! Get the operation table slot of a blending mode (MODE_REPLACE is stored last)
+static inline int modeSlot(BlendMode::Mode mode)
+{
+	return mode == BlendMode::MODE_REPLACE ? MODE_SLOTS-1 : int(mode);
+}
+
+//! Pixel compositing functions are specialized for these opacity classes
+enum OpacityClass {
+	PARTIAL_OPACITY,
+	FULL_OPACITY,
+	OPACITY_CLASSES
+};
+
+//! Get the opacity class of an opacity value
+static inline int opacityClass(uchar opacity)
+{
+	return opacity == 255 ? FULL_OPACITY : PARTIAL_OPACITY;
+}
+
+//! Blending functions that are precalculated into lookup tables
+enum BlendLut { LUT_DIVIDE, LUT_DODGE, LUT_BURN, LUT_COUNT };
+
+//! A precalculated blending function, indexed by [base][blend]
+typedef uchar BlendLutTable[256][256];
+
+/**
+ * @brief Get a precalculated blending function
+ *
+ * The tables are filled in when the reference implementation is created.
+ */
+const BlendLutTable &blendLut(BlendLut lut);
+
+/**
+ * @brief A set of raster operation implementations
+ */
+struct Operations {
+	//! Name of the implementation (for debugging)
+	const char *name;
+
+	//! Mask compositing functions for each blending mode
+	MaskCompositeFunc mask[MODE_SLOTS];
+
+	//! Pixel compositing functions for each blending mode and opacity class
+	PixelCompositeFunc pixels[MODE_SLOTS][OPACITY_CLASSES];
+
+	//! Weighted pixel sampling function
+	SampleMaskFunc sampleMask;
+};
+
+/**
+ * @brief Get the generic implementation
+ *
+ * This is the reference all other implementations must produce bit-identical
+ * results with. The optimized implementations also use these functions
+ * to handle leftover pixels.
+ */
+const Operations &reference();
+
+/**
+ * @brief Get the implementation in use
+ *
+ * The best implementation supported by the CPU is selected on first use.
+ * The selection can be overridden with the DRAWPILE_RASTEROPS environment variable.
+ * If premultiplied tile storage is enabled, the premultiplied alpha version is returned.
+ */
+const Operations &active();
+
+/**
+ * @brief Get the implementation with the given name
+ *
+ * @param name implementation name (generic, sse2 or avx2)
+ * @param premultiplied get the version for premultiplied alpha tile storage
+ * @return null if not supported by this CPU
+ */
+const Operations *implementation(const char *name, bool premultiplied=false);
+
+#ifdef HAVE_SIMD_RASTEROPS
+//! Replace the operations that have an SSE2 implementation
+void installSse2(Operations &ops, bool premultiplied);
+
+//! Replace the operations that have an AVX2 implementation
+void installAvx2(Operations &ops, bool premultiplied);
+#endif
+
+}
+}
+
+#endif
@@ -0,0 +1,833 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RASTEROP_SIMD_H
+#define PAINTCORE_RASTEROP_SIMD_H
+
+/*
+ * Vectorized raster operations.
+ *
+ * The kernels in this file are written against an abstract vector type V
+ * and are instantiated by the instruction set specific translation units
+ * (rasterop_sse2.cpp and rasterop_avx2.cpp), which define V and are compiled
+ * with the matching compiler flags.
+ *
+ * Each kernel must produce bit-identical results with the generic version
+ * in rasterop.cpp. The generic functions are used to process the pixels
+ * left over at the end of each row.
+ *
+ * The integer kernels unpack pixels into 16 bit channels. The vector type
+ * must provide the following:
+ *
+ * I                       integer vector type
+ * PIXELS                  number of pixels in I
+ * load, store             unaligned pixel load/store
+ * expandMask(m)           load PIXELS mask values and broadcast each to all bytes of its pixel
+ * zero, set1_8, set1_16, set1_32, alphaWords
+ * and_, or_, andnot       (andnot(a,b) is ~a & b)
+ * cmpeq8, cmpeq32, allSet8
+ * lo8, hi8, pack16        widen bytes to words / narrow words to bytes (unsigned saturation)
+ * lo16, hi16              widen words to doublewords
+ * add16, sub16, mul16, srl16, min16, max16, subs16, subs8
+ * add32
+ * div16(n, d)             truncated division of unsigned 16 bit values
+ * alpha16(x)              broadcast the alpha channel of each unpacked pixel to all its channels
+ *
+ * The floating point (color erase) kernels use:
+ *
+ * D                       double precision vector type
+ * DPIXELS                 number of doubles in D
+ * loadD, storeD           load/store DPIXELS pixels to/from an __m128i
+ * cvtD, cvttD             convert DPIXELS ints to doubles and back (truncating)
+ * dset1, dadd, dsub, dmul, ddiv, dmax, dcmplt, dcmpgt, dselect
+ */
+
+#include "rasterop_p.h"
+
+#include <cstring>
+
+namespace paintcore {
+namespace rasterop {
+namespace {
+
+// Note. All values passed to these functions are unpacked to 16 bit words
+// and are in range 0..255 unless otherwise noted.
+
+template<class V> inline typename V::I select(typename V::I mask, typename V::I a, typename V::I b)
+{
+	return V::or_(V::and_(mask, a), V::andnot(mask, b));
+}
+
+//! Vector version of UINT8_MULT
+template<class V> inline typename V::I mul8(typename V::I a, typename V::I b)
+{
+	const typename V::I c = V::add16(V::mul16(a, b), V::set1_16(0x80));
+	return V::srl16(V::add16(V::srl16(c, 8), c), 8);
+}
+
+//! Vector version of UINT8_BLEND
+template<class V> inline typename V::I blend8(typename V::I a, typename V::I b, typename V::I alpha)
+{
+	// (a-b)*alpha + (b<<8) - b == a*alpha + b*(255-alpha), which fits in 16 bits
+	const typename V::I c = V::add16(
+		V::add16(V::mul16(a, alpha), V::mul16(b, V::sub16(V::set1_16(255), alpha))),
+		V::set1_16(0x80)
+		);
+	return V::srl16(V::add16(V::srl16(c, 8), c), 8);
+}
+
+//! Vector version of UINT8_DIVIDE
+template<class V> inline typename V::I divide8(typename V::I a, typename V::I b)
+{
+	// a*255 + b/2 is at most 65152, so the numerator fits in 16 bits
+	return V::div16(V::add16(V::mul16(a, V::set1_16(255)), V::srl16(b, 1)), b);
+}
+
+//! Apply layer opacity to an alpha value, unless the layer is known to be fully opaque
+template<class V, bool OPAQUE> inline typename V::I applyOpacity(typename V::I alpha, typename V::I opacity)
+{
+	return OPAQUE ? alpha : mul8<V>(alpha, opacity);
+}
+
+/*
+ * Vector versions of the separable blending functions.
+ * Parameters are base and blend values as unpacked words.
+ */
+struct OpBlend {
+	template<class V> static typename V::I apply(typename V::I, typename V::I blend) { return blend; }
+};
+
+struct OpMultiply {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) { return mul8<V>(base, blend); }
+};
+
+/**
+ * Blending functions that need an integer division use the same lookup
+ * tables as the generic versions. There is no byte gather instruction,
+ * so the values are looked up one at a time.
+ */
+template<BlendLut LUT>
+struct OpLut {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) {
+		static const BlendLutTable &lut = blendLut(LUT);
+		quint16 b[V::PIXELS*2], s[V::PIXELS*2];
+		V::store(reinterpret_cast<quint32*>(b), base);
+		V::store(reinterpret_cast<quint32*>(s), blend);
+		for(int i=0;i<V::PIXELS*2;++i)
+			b[i] = lut[b[i]][s[i]];
+		return V::load(reinterpret_cast<const quint32*>(b));
+	}
+};
+
+typedef OpLut<LUT_DIVIDE> OpDivide;
+typedef OpLut<LUT_DODGE> OpDodge;
+typedef OpLut<LUT_BURN> OpBurn;
+
+struct OpDarken {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) { return V::min16(base, blend); }
+};
+
+struct OpLighten {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) { return V::max16(base, blend); }
+};
+
+struct OpAdd {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) {
+		return V::min16(V::add16(base, blend), V::set1_16(255));
+	}
+};
+
+struct OpSubtract {
+	template<class V> static typename V::I apply(typename V::I base, typename V::I blend) { return V::subs16(base, blend); }
+};
+
+//// Mask compositing ////
+
+template<class V>
+void maskAlphaBlend(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(BlendMode::MODE_NORMAL)];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I alphaWords = V::alphaWords();
+	const I one = V::set1_16(1);
+	const I c255 = V::set1_16(255);
+	const I col16 = V::lo8(V::set1_32(color));
+	const I colorOpaque = V::set1_32(color | 0xff000000);
+	const I colorRgb = V::set1_32(color & 0x00ffffff);
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			const I mZero = V::cmpeq8(m, zero);
+			if(V::allSet8(mZero))
+				continue;
+
+			const I d = V::load(base);
+
+			// The usual case: blend colors and alpha
+			I half[2];
+			for(int i=0;i<2;++i) {
+				const I a = i ? V::hi8(m) : V::lo8(m);
+				const I d16 = i ? V::hi8(d) : V::lo8(d);
+				const I a2 = mul8<V>(V::alpha16(d16), V::sub16(c255, a));
+				const I a_out = V::add16(a, a2);
+				const I c = divide8<V>(
+					V::add16(mul8<V>(a, col16), mul8<V>(a2, d16)),
+					V::max16(a_out, one) // zero only when the result is not used
+					);
+				half[i] = select<V>(alphaWords, a_out, c);
+			}
+			I result = V::pack16(half[0], half[1]);
+
+			// Special case: target is completely transparent
+			const I transparent = V::or_(colorRgb, V::and_(m, alphaMask));
+			result = select<V>(V::cmpeq32(V::and_(d, alphaMask), zero), transparent, result);
+
+			// Special case: mask pixel is completely opaque
+			result = select<V>(V::cmpeq8(m, V::set1_8(0xff)), colorOpaque, result);
+
+			// Special case: mask pixel is completely transparent
+			result = select<V>(mZero, d, result);
+
+			V::store(base, result);
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+template<class V>
+void maskAlphaUnder(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(BlendMode::MODE_BEHIND)];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I alphaWords = V::alphaWords();
+	const I one = V::set1_16(1);
+	const I c255 = V::set1_16(255);
+	const I col16 = V::lo8(V::set1_32(color));
+	const I colorRgb = V::set1_32(color & 0x00ffffff);
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			const I mZero = V::cmpeq8(m, zero);
+			if(V::allSet8(mZero))
+				continue;
+
+			const I d = V::load(base);
+			const I dAlpha = V::and_(d, alphaMask);
+
+			// The usual case: blend colors and alpha
+			I half[2];
+			for(int i=0;i<2;++i) {
+				const I m16 = i ? V::hi8(m) : V::lo8(m);
+				const I d16 = i ? V::hi8(d) : V::lo8(d);
+				const I a2 = V::alpha16(d16);
+				const I a = mul8<V>(V::sub16(c255, a2), m16);
+				const I a_out = V::add16(a, a2);
+				const I c = divide8<V>(
+					V::add16(mul8<V>(a, col16), mul8<V>(a2, d16)),
+					V::max16(a_out, one) // zero only when the result is not used
+					);
+				half[i] = select<V>(alphaWords, a_out, c);
+			}
+			I result = V::pack16(half[0], half[1]);
+
+			// Special case: target is completely transparent
+			const I transparent = V::or_(colorRgb, V::and_(m, alphaMask));
+			result = select<V>(V::cmpeq32(dAlpha, zero), transparent, result);
+
+			// Special case: transparent mask pixel or opaque destination pixel
+			result = select<V>(V::or_(mZero, V::cmpeq32(dAlpha, alphaMask)), d, result);
+
+			V::store(base, result);
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+template<class V>
+void maskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(BlendMode::MODE_ERASE)];
+	const I alphaMask = V::set1_32(0xff000000);
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::and_(V::expandMask(mask), alphaMask);
+			V::store(base, V::subs8(V::load(base), m));
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+template<class V>
+void maskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(BlendMode::MODE_REPLACE)];
+	const I col16 = V::lo8(V::set1_32(color));
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			V::store(base, V::pack16(
+				mul8<V>(col16, V::lo8(m)),
+				mul8<V>(col16, V::hi8(m))
+			));
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+// A generic composition function for special blending modes.
+// This doesn't touch the alpha channel.
+template<class V, class Op, BlendMode::Mode MODE>
+void maskComposite(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(MODE)];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I col16 = V::lo8(V::set1_32(color));
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			const I mZero = V::cmpeq8(m, zero);
+			if(V::allSet8(mZero))
+				continue;
+
+			const I d = V::load(base);
+
+			// Note: blending with a fully opaque mask value yields just the
+			// blend op result and a fully transparent one the original value,
+			// so those special cases need no extra handling here.
+			const I dlo = V::lo8(d);
+			const I dhi = V::hi8(d);
+			I result = V::pack16(
+				blend8<V>(Op::template apply<V>(dlo, col16), dlo, V::lo8(m)),
+				blend8<V>(Op::template apply<V>(dhi, col16), dhi, V::hi8(m))
+				);
+
+			// Alpha channel is never changed
+			result = select<V>(alphaMask, d, result);
+
+			// Fully transparent destination pixels are left alone, except
+			// when the mask is fully opaque
+			const I keep = V::andnot(
+				V::cmpeq8(m, V::set1_8(0xff)),
+				V::cmpeq32(V::and_(d, alphaMask), zero)
+				);
+			result = select<V>(keep, d, result);
+
+			V::store(base, result);
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+//// Color erase ////
+
+template<class V>
+inline typename V::D colorEraseChannel(typename V::D src, typename V::D color)
+{
+	typedef typename V::D D;
+	const D one = V::dset1(1.0);
+
+	const D above = V::ddiv(V::dsub(src, color), V::dsub(one, color));
+	const D below = V::ddiv(V::dsub(color, src), color);
+
+	D alpha = V::dselect(V::dcmplt(src, color), below, V::dset1(0.0));
+	alpha = V::dselect(V::dcmpgt(src, color), above, alpha);
+	return V::dselect(V::dcmplt(color, V::dset1(0.0001)), src, alpha);
+}
+
+/**
+ * Vector version of color_erase_helper.
+ *
+ * All operations are done in the same order as in the generic version
+ * to get identical results.
+ */
+template<class V>
+inline void colorErase(typename V::D *src, const typename V::D *color)
+{
+	typedef typename V::D D;
+
+	const D alphaR = colorEraseChannel<V>(src[0], color[0]);
+	const D alphaG = colorEraseChannel<V>(src[1], color[1]);
+	const D alphaB = colorEraseChannel<V>(src[2], color[2]);
+
+	const D a = V::dadd(
+		V::dsub(V::dset1(1.0), color[3]),
+		V::dmul(V::dmax(V::dmax(alphaR, alphaG), alphaB), color[3])
+		);
+
+	const D keep = V::dcmplt(a, V::dset1(0.0001));
+
+	for(int i=0;i<3;++i)
+		src[i] = V::dselect(keep, src[i], V::dadd(V::ddiv(V::dsub(src[i], color[i]), a), color[i]));
+
+	src[3] = V::dselect(keep, a, V::dmul(a, src[3]));
+}
+
+//! Vector version of fRGBA(pixel). Channel order is R, G, B, A
+template<class V>
+inline void unpackD(const __m128i pixels, typename V::D *channels)
+{
+	const __m128i byteMask = _mm_set1_epi32(0xff);
+	const typename V::D d255 = V::dset1(255.0);
+	channels[0] = V::ddiv(V::cvtD(_mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask)), d255);
+	channels[1] = V::ddiv(V::cvtD(_mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask)), d255);
+	channels[2] = V::ddiv(V::cvtD(_mm_and_si128(pixels, byteMask)), d255);
+	channels[3] = V::ddiv(V::cvtD(_mm_srli_epi32(pixels, 24)), d255);
+}
+
+//! Vector version of fRGBA::toPixel()
+template<class V>
+inline __m128i packD(const typename V::D *channels)
+{
+	const __m128i byteMask = _mm_set1_epi32(0xff);
+	const typename V::D d255 = V::dset1(255.0);
+	const __m128i r = _mm_and_si128(V::cvttD(V::dmul(channels[0], d255)), byteMask);
+	const __m128i g = _mm_and_si128(V::cvttD(V::dmul(channels[1], d255)), byteMask);
+	const __m128i b = _mm_and_si128(V::cvttD(V::dmul(channels[2], d255)), byteMask);
+	const __m128i a = _mm_and_si128(V::cvttD(V::dmul(channels[3], d255)), byteMask);
+	return _mm_or_si128(
+		_mm_or_si128(_mm_slli_epi32(a, 24), _mm_slli_epi32(r, 16)),
+		_mm_or_si128(_mm_slli_epi32(g, 8), b)
+		);
+}
+
+template<class V>
+void maskColorErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::D D;
+	const MaskCompositeFunc tail = reference().mask[modeSlot(BlendMode::MODE_COLORERASE)];
+
+	D col[4];
+	unpackD<V>(_mm_set1_epi32(color), col);
+	const __m128i colA = _mm_set1_epi32(color >> 24);
+	const __m128i c80 = _mm_set1_epi32(0x80);
+	const D d255 = V::dset1(255.0);
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::DPIXELS;x+=V::DPIXELS, base+=V::DPIXELS, mask+=V::DPIXELS) {
+			// col.a = UINT8_MULT(col_a, *mask) / 255.0
+			qint32 m[4] = {0, 0, 0, 0};
+			for(int i=0;i<V::DPIXELS;++i)
+				m[i] = mask[i];
+			__m128i ca = _mm_add_epi32(_mm_mullo_epi16(colA, _mm_loadu_si128(reinterpret_cast<const __m128i*>(m))), c80);
+			ca = _mm_srli_epi32(_mm_add_epi32(_mm_srli_epi32(ca, 8), ca), 8);
+			col[3] = V::ddiv(V::cvtD(ca), d255);
+
+			D src[4];
+			unpackD<V>(V::loadD(base), src);
+			colorErase<V>(src, col);
+			V::storeD(base, packD<V>(src));
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+//// Pixel compositing ////
+
+template<class V, bool OPAQUE>
+void pixelAlphaBlend(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::I I;
+	const PixelCompositeFunc tail = reference().pixels[modeSlot(BlendMode::MODE_NORMAL)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I alphaWords = V::alphaWords();
+	const I one = V::set1_16(1);
+	const I c255 = V::set1_16(255);
+	const I opacity16 = V::set1_16(opacity);
+
+	int x=0;
+	for(;x<=len-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, over+=V::PIXELS) {
+		const I s = V::load(over);
+		const I d = V::load(base);
+
+		I half[2];
+		for(int i=0;i<2;++i) {
+			const I s16 = i ? V::hi8(s) : V::lo8(s);
+			const I d16 = i ? V::hi8(d) : V::lo8(d);
+			const I a = applyOpacity<V, OPAQUE>(V::alpha16(s16), opacity16);
+			const I a2 = mul8<V>(V::alpha16(d16), V::sub16(c255, a));
+			const I a_out = V::add16(a, a2);
+			const I c = divide8<V>(
+				V::add16(mul8<V>(a, s16), mul8<V>(a2, d16)),
+				V::max16(a_out, one) // zero only when the result is not used
+				);
+			half[i] = select<V>(alphaWords, a_out, c);
+		}
+		const I result = V::pack16(half[0], half[1]);
+
+		// Special case: resulting pixel is fully transparent
+		V::store(base, select<V>(V::cmpeq32(V::and_(result, alphaMask), zero), d, result));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+template<class V, bool OPAQUE>
+void pixelAlphaUnder(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::I I;
+	const PixelCompositeFunc tail = reference().pixels[modeSlot(BlendMode::MODE_BEHIND)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I alphaWords = V::alphaWords();
+	const I one = V::set1_16(1);
+	const I c255 = V::set1_16(255);
+	const I opacity16 = V::set1_16(opacity);
+
+	int x=0;
+	for(;x<=len-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, over+=V::PIXELS) {
+		const I s = V::load(over);
+		const I d = V::load(base);
+
+		I half[2];
+		for(int i=0;i<2;++i) {
+			const I s16 = i ? V::hi8(s) : V::lo8(s);
+			const I d16 = i ? V::hi8(d) : V::lo8(d);
+			const I a2 = V::alpha16(d16);
+			const I a = mul8<V>(V::sub16(c255, a2), applyOpacity<V, OPAQUE>(V::alpha16(s16), opacity16));
+			const I a_out = V::add16(a, a2);
+			const I c = divide8<V>(
+				V::add16(mul8<V>(a, s16), mul8<V>(a2, d16)),
+				V::max16(a_out, one) // zero only when the result is not used
+				);
+			half[i] = select<V>(alphaWords, a_out, c);
+		}
+		const I result = V::pack16(half[0], half[1]);
+
+		// Special case: resulting pixel is fully transparent
+		V::store(base, select<V>(V::cmpeq32(V::and_(result, alphaMask), zero), d, result));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+template<class V, bool OPAQUE>
+void pixelErase(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::I I;
+	const PixelCompositeFunc tail = reference().pixels[modeSlot(BlendMode::MODE_ERASE)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const I alphaMask = V::set1_32(0xff000000);
+	const I opacity16 = V::set1_16(opacity);
+
+	int x=0;
+	for(;x<=len-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, over+=V::PIXELS) {
+		const I s = V::load(over);
+		const I a = V::and_(V::pack16(
+			applyOpacity<V, OPAQUE>(V::alpha16(V::lo8(s)), opacity16),
+			applyOpacity<V, OPAQUE>(V::alpha16(V::hi8(s)), opacity16)
+			), alphaMask);
+		V::store(base, V::subs8(V::load(base), a));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+// A generic composition function for special blending modes.
+// This doesn't touch the alpha channel.
+template<class V, class Op, BlendMode::Mode MODE, bool OPAQUE>
+void pixelComposite(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::I I;
+	const PixelCompositeFunc tail = reference().pixels[modeSlot(MODE)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const I zero = V::zero();
+	const I alphaMask = V::set1_32(0xff000000);
+	const I opacity16 = V::set1_16(opacity);
+
+	int x=0;
+	for(;x<=len-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, over+=V::PIXELS) {
+		const I s = V::load(over);
+		const I d = V::load(base);
+
+		I half[2];
+		for(int i=0;i<2;++i) {
+			const I s16 = i ? V::hi8(s) : V::lo8(s);
+			const I d16 = i ? V::hi8(d) : V::lo8(d);
+			const I a = applyOpacity<V, OPAQUE>(V::alpha16(s16), opacity16);
+			const I a2 = mul8<V>(a, V::alpha16(d16));
+			half[i] = blend8<V>(Op::template apply<V>(d16, s16), d16, a2);
+		}
+
+		// Alpha channel is never changed
+		I result = select<V>(alphaMask, d, V::pack16(half[0], half[1]));
+
+		// Special case: source or destination pixel is completely transparent
+		const I keep = V::or_(
+			V::cmpeq32(V::and_(s, alphaMask), zero),
+			V::cmpeq32(V::and_(d, alphaMask), zero)
+			);
+		V::store(base, select<V>(keep, d, result));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+template<class V, bool OPAQUE>
+void pixelColorErase(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::D D;
+	const PixelCompositeFunc tail = reference().pixels[modeSlot(BlendMode::MODE_COLORERASE)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const D o = V::dset1(opacity / 255.0);
+
+	int x=0;
+	for(;x<=len-V::DPIXELS;x+=V::DPIXELS, base+=V::DPIXELS, over+=V::DPIXELS) {
+		D dest[4], src[4];
+		unpackD<V>(V::loadD(base), dest);
+		unpackD<V>(V::loadD(over), src);
+		if(!OPAQUE)
+			src[3] = V::dmul(src[3], o);
+		colorErase<V>(dest, src);
+		V::storeD(base, packD<V>(dest));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+//// Premultiplied alpha compositing ////
+
+template<class V>
+void premulMaskBlend(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	typedef typename V::I I;
+	const MaskCompositeFunc tail = implementation("generic", true)->mask[modeSlot(BlendMode::MODE_NORMAL)];
+
+	const I zero = V::zero();
+	const I col16 = V::lo8(V::set1_32(color | 0xff000000));
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			if(V::allSet8(V::cmpeq8(m, zero)))
+				continue;
+
+			const I d = V::load(base);
+			V::store(base, V::pack16(
+				blend8<V>(col16, V::lo8(d), V::lo8(m)),
+				blend8<V>(col16, V::hi8(d), V::hi8(m))
+				));
+		}
+		if(x<w) {
+			tail(base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+template<class V, bool OPAQUE>
+void premulPixelBlend(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	typedef typename V::I I;
+	const PixelCompositeFunc tail = implementation("generic", true)->pixels[modeSlot(BlendMode::MODE_NORMAL)][OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY];
+
+	const I c255 = V::set1_16(255);
+	const I opacity16 = V::set1_16(opacity);
+
+	int x=0;
+	for(;x<=len-V::PIXELS;x+=V::PIXELS, base+=V::PIXELS, over+=V::PIXELS) {
+		const I s = V::load(over);
+		const I d = V::load(base);
+
+		I half[2];
+		for(int i=0;i<2;++i) {
+			const I s16 = applyOpacity<V, OPAQUE>(i ? V::hi8(s) : V::lo8(s), opacity16);
+			const I d16 = i ? V::hi8(d) : V::lo8(d);
+			half[i] = V::add16(s16, mul8<V>(d16, V::sub16(c255, V::alpha16(s16))));
+		}
+		V::store(base, V::pack16(half[0], half[1]));
+	}
+	if(x<len)
+		tail(base, over, opacity, len-x);
+}
+
+//// Sampling ////
+
+template<class V>
+std::array<quint32, 5> sampleMask(const quint32 *pixels, const uchar *mask, int w, int h, int maskskip, int pixelskip)
+{
+	typedef typename V::I I;
+	const SampleMaskFunc tail = reference().sampleMask;
+
+	const I alphaWords = V::alphaWords();
+	I sum = V::zero();
+	I weights = V::zero();
+	std::array<quint32, 5> result{ {0, 0, 0, 0, 0} };
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-V::PIXELS;x+=V::PIXELS, pixels+=V::PIXELS, mask+=V::PIXELS) {
+			const I m = V::expandMask(mask);
+			const I p = V::load(pixels);
+
+			for(int i=0;i<2;++i) {
+				const I m16 = i ? V::hi8(m) : V::lo8(m);
+				const I p16 = i ? V::hi8(p) : V::lo8(p);
+				const I a = V::alpha16(p16);
+
+				// premultiply colors to avoid darkening transparent areas
+				const I v = mul8<V>(select<V>(alphaWords, a, mul8<V>(p16, a)), m16);
+
+				sum = V::add32(V::add32(sum, V::lo16(v)), V::hi16(v));
+				weights = V::add32(V::add32(weights, V::lo16(m16)), V::hi16(m16));
+			}
+		}
+		if(x<w) {
+			const std::array<quint32, 5> t = tail(pixels, mask, w-x, 1, 0, 0);
+			for(int i=0;i<5;++i)
+				result[i] += t[i];
+			pixels += w-x;
+			mask += w-x;
+		}
+		pixels += pixelskip;
+		mask += maskskip;
+	}
+
+	// Each doubleword lane accumulates a single channel (in B, G, R, A order)
+	quint32 s[V::PIXELS], ws[V::PIXELS];
+	V::store(s, sum);
+	V::store(ws, weights);
+	for(int i=0;i<V::PIXELS;i+=4) {
+		result[0] += ws[i];
+		result[1] += s[i+2];
+		result[2] += s[i+1];
+		result[3] += s[i];
+		result[4] += s[i+3];
+	}
+
+	return result;
+}
+
+template<class V>
+void installMaskOperations(Operations &ops)
+{
+	ops.mask[modeSlot(BlendMode::MODE_ERASE)] = maskErase<V>;
+	ops.mask[modeSlot(BlendMode::MODE_NORMAL)] = maskAlphaBlend<V>;
+	ops.mask[modeSlot(BlendMode::MODE_MULTIPLY)] = maskComposite<V, OpMultiply, BlendMode::MODE_MULTIPLY>;
+	ops.mask[modeSlot(BlendMode::MODE_DIVIDE)] = maskComposite<V, OpDivide, BlendMode::MODE_DIVIDE>;
+	ops.mask[modeSlot(BlendMode::MODE_BURN)] = maskComposite<V, OpBurn, BlendMode::MODE_BURN>;
+	ops.mask[modeSlot(BlendMode::MODE_DODGE)] = maskComposite<V, OpDodge, BlendMode::MODE_DODGE>;
+	ops.mask[modeSlot(BlendMode::MODE_DARKEN)] = maskComposite<V, OpDarken, BlendMode::MODE_DARKEN>;
+	ops.mask[modeSlot(BlendMode::MODE_LIGHTEN)] = maskComposite<V, OpLighten, BlendMode::MODE_LIGHTEN>;
+	ops.mask[modeSlot(BlendMode::MODE_SUBTRACT)] = maskComposite<V, OpSubtract, BlendMode::MODE_SUBTRACT>;
+	ops.mask[modeSlot(BlendMode::MODE_ADD)] = maskComposite<V, OpAdd, BlendMode::MODE_ADD>;
+	ops.mask[modeSlot(BlendMode::MODE_RECOLOR)] = maskComposite<V, OpBlend, BlendMode::MODE_RECOLOR>;
+	ops.mask[modeSlot(BlendMode::MODE_BEHIND)] = maskAlphaUnder<V>;
+	ops.mask[modeSlot(BlendMode::MODE_COLORERASE)] = maskColorErase<V>;
+	ops.mask[modeSlot(BlendMode::MODE_REPLACE)] = maskCopy<V>;
+
+	ops.sampleMask = sampleMask<V>;
+}
+
+template<class V, bool OPAQUE>
+void installPixelOperations(Operations &ops)
+{
+	const int oc = OPAQUE ? FULL_OPACITY : PARTIAL_OPACITY;
+	ops.pixels[modeSlot(BlendMode::MODE_ERASE)][oc] = pixelErase<V, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][oc] = pixelAlphaBlend<V, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_MULTIPLY)][oc] = pixelComposite<V, OpMultiply, BlendMode::MODE_MULTIPLY, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_DIVIDE)][oc] = pixelComposite<V, OpDivide, BlendMode::MODE_DIVIDE, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_BURN)][oc] = pixelComposite<V, OpBurn, BlendMode::MODE_BURN, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_DODGE)][oc] = pixelComposite<V, OpDodge, BlendMode::MODE_DODGE, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_DARKEN)][oc] = pixelComposite<V, OpDarken, BlendMode::MODE_DARKEN, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_LIGHTEN)][oc] = pixelComposite<V, OpLighten, BlendMode::MODE_LIGHTEN, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_SUBTRACT)][oc] = pixelComposite<V, OpSubtract, BlendMode::MODE_SUBTRACT, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_ADD)][oc] = pixelComposite<V, OpAdd, BlendMode::MODE_ADD, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_RECOLOR)][oc] = pixelComposite<V, OpBlend, BlendMode::MODE_RECOLOR, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_BEHIND)][oc] = pixelAlphaUnder<V, OPAQUE>;
+	ops.pixels[modeSlot(BlendMode::MODE_COLORERASE)][oc] = pixelColorErase<V, OPAQUE>;
+	// MODE_REPLACE has no pixel compositing implementation
+}
+
+template<class V>
+void installPremultipliedOperations(Operations &ops)
+{
+	ops.mask[modeSlot(BlendMode::MODE_NORMAL)] = premulMaskBlend<V>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][PARTIAL_OPACITY] = premulPixelBlend<V, false>;
+	ops.pixels[modeSlot(BlendMode::MODE_NORMAL)][FULL_OPACITY] = premulPixelBlend<V, true>;
+}
+
+}
+}
+}
+
+#endif
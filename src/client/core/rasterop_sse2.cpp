@@ -0,0 +1,130 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// This file is compiled with SSE2 instructions enabled.
+// See rasterop_simd.h for details.
+
+#include <emmintrin.h>
+
+#include "rasterop_simd.h"
+
+namespace paintcore {
+namespace rasterop {
+
+namespace {
+
+struct Sse2 {
+	typedef __m128i I;
+	static const int PIXELS = 4;
+
+	static I load(const quint32 *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	static void store(quint32 *p, I v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+	static I expandMask(const uchar *mask) {
+		int m;
+		memcpy(&m, mask, 4);
+		I v = _mm_cvtsi32_si128(m);
+		v = _mm_unpacklo_epi8(v, v);
+		return _mm_unpacklo_epi16(v, v);
+	}
+
+	static I zero() { return _mm_setzero_si128(); }
+	static I set1_8(int v) { return _mm_set1_epi8(char(v)); }
+	static I set1_16(short v) { return _mm_set1_epi16(v); }
+	static I set1_32(quint32 v) { return _mm_set1_epi32(int(v)); }
+	static I alphaWords() { return _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0); }
+
+	static I and_(I a, I b) { return _mm_and_si128(a, b); }
+	static I or_(I a, I b) { return _mm_or_si128(a, b); }
+	static I andnot(I a, I b) { return _mm_andnot_si128(a, b); }
+
+	static I cmpeq8(I a, I b) { return _mm_cmpeq_epi8(a, b); }
+	static I cmpeq32(I a, I b) { return _mm_cmpeq_epi32(a, b); }
+	static bool allSet8(I a) { return _mm_movemask_epi8(a) == 0xffff; }
+
+	static I lo8(I a) { return _mm_unpacklo_epi8(a, _mm_setzero_si128()); }
+	static I hi8(I a) { return _mm_unpackhi_epi8(a, _mm_setzero_si128()); }
+	static I pack16(I lo, I hi) { return _mm_packus_epi16(lo, hi); }
+	static I lo16(I a) { return _mm_unpacklo_epi16(a, _mm_setzero_si128()); }
+	static I hi16(I a) { return _mm_unpackhi_epi16(a, _mm_setzero_si128()); }
+
+	static I add16(I a, I b) { return _mm_add_epi16(a, b); }
+	static I sub16(I a, I b) { return _mm_sub_epi16(a, b); }
+	static I mul16(I a, I b) { return _mm_mullo_epi16(a, b); }
+	static I srl16(I a, int n) { return _mm_srli_epi16(a, n); }
+	static I min16(I a, I b) { return _mm_min_epi16(a, b); }
+	static I max16(I a, I b) { return _mm_max_epi16(a, b); }
+	static I subs16(I a, I b) { return _mm_subs_epu16(a, b); }
+	static I subs8(I a, I b) { return _mm_subs_epu8(a, b); }
+	static I add32(I a, I b) { return _mm_add_epi32(a, b); }
+
+	static I div16(I n, I d) {
+		// Single precision division is exact here, since both operands are below 2^16
+		const __m128i z = _mm_setzero_si128();
+		const __m128i lo = _mm_cvttps_epi32(_mm_div_ps(
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(n, z)),
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(d, z))
+			));
+		const __m128i hi = _mm_cvttps_epi32(_mm_div_ps(
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(n, z)),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(d, z))
+			));
+		return _mm_packs_epi32(lo, hi);
+	}
+
+	static I alpha16(I a) {
+		return _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	}
+
+	typedef __m128d D;
+	static const int DPIXELS = 2;
+
+	static __m128i loadD(const quint32 *p) { return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)); }
+	static void storeD(quint32 *p, __m128i v) { _mm_storel_epi64(reinterpret_cast<__m128i*>(p), v); }
+	static D cvtD(__m128i v) { return _mm_cvtepi32_pd(v); }
+	static __m128i cvttD(D v) { return _mm_cvttpd_epi32(v); }
+
+	static D dset1(double v) { return _mm_set1_pd(v); }
+	static D dadd(D a, D b) { return _mm_add_pd(a, b); }
+	static D dsub(D a, D b) { return _mm_sub_pd(a, b); }
+	static D dmul(D a, D b) { return _mm_mul_pd(a, b); }
+	static D ddiv(D a, D b) { return _mm_div_pd(a, b); }
+	static D dmax(D a, D b) { return _mm_max_pd(a, b); }
+	static D dcmplt(D a, D b) { return _mm_cmplt_pd(a, b); }
+	static D dcmpgt(D a, D b) { return _mm_cmpgt_pd(a, b); }
+	static D dselect(D mask, D a, D b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+};
+
+}
+
+void installSse2(Operations &ops, bool premultiplied)
+{
+	if(premultiplied) {
+		ops.name = "sse2/premultiplied";
+		installPremultipliedOperations<Sse2>(ops);
+	} else {
+		ops.name = "sse2";
+		installMaskOperations<Sse2>(ops);
+		installPixelOperations<Sse2, false>(ops);
+		installPixelOperations<Sse2, true>(ops);
+	}
+}
+
+}
+}
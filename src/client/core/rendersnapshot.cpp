@@ -0,0 +1,68 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rendersnapshot.h"
+#include "lodpyramid.h"
+
+#include <QPainter>
+
+namespace paintcore {
+
+RenderSnapshot::RenderSnapshot(const QSize &size, const QVector<FlatTile> &tiles)
+	: m_size(size), m_tiles(tiles)
+{
+}
+
+QRect RenderSnapshot::changedArea() const
+{
+	QRect area;
+	for(const FlatTile &t : m_tiles)
+		area |= QRect(t.x*Tile::SIZE, t.y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+	return area;
+}
+
+void RenderSnapshot::paint(QPaintDevice *target, LodPyramid *lod) const
+{
+	if(m_tiles.isEmpty())
+		return;
+
+	// The tiles were downsampled when the snapshot was made
+	if(lod) {
+		for(const FlatTile &t : m_tiles)
+			lod->updateTile(t.x, t.y, t.lod);
+	}
+
+	// With premultiplied storage, the tiles can be drawn without format conversion
+	const QImage::Format format = isPremultipliedStorage() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_ARGB32;
+	QPainter painter(target);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+	for(const FlatTile &t : m_tiles) {
+		painter.drawImage(
+			t.x*Tile::SIZE,
+			t.y*Tile::SIZE,
+			QImage(reinterpret_cast<const uchar*>(t.tile.data()),
+				Tile::SIZE, Tile::SIZE,
+				format
+			)
+		);
+	}
+}
+
+}
+
@@ -0,0 +1,80 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RENDERSNAPSHOT_H
+#define PAINTCORE_RENDERSNAPSHOT_H
+
+#include "tile.h"
+
+#include <QVector>
+#include <QSize>
+#include <QRect>
+
+class QPaintDevice;
+
+namespace paintcore {
+
+class LodPyramid;
+
+//! A flattened tile ready to be drawn
+struct FlatTile {
+	int x, y; // tile indices
+	Tile tile;
+	QVector<quint32> lod; // the tile downsampled for each LOD level (see LodPyramid::downsampleTile())
+};
+
+/**
+ * @brief Flattened tiles published by the canvas thread for the view
+ *
+ * A snapshot contains the tiles flattened since the previous one. The view
+ * keeps the accumulated image in its own cache, so a snapshot is all it needs
+ * to bring it up to date. Snapshots are immutable once published, so the view
+ * can paint them without locking the layer stack. (See LayerStack::takeSnapshot())
+ */
+class RenderSnapshot {
+public:
+	RenderSnapshot(const QSize &size, const QVector<FlatTile> &tiles);
+
+	//! Get the size of the canvas when this snapshot was made
+	QSize size() const { return m_size; }
+
+	//! Get the flattened tiles
+	const QVector<FlatTile> &tiles() const { return m_tiles; }
+
+	//! Get the bounding rectangle of the flattened tiles (in pixels)
+	QRect changedArea() const;
+
+	/**
+	 * @brief Draw the flattened tiles
+	 *
+	 * @param target the device to draw onto
+	 * @param lod if not null, the downsampled tiles are copied into this pyramid
+	 */
+	void paint(QPaintDevice *target, LodPyramid *lod=nullptr) const;
+
+private:
+	QSize m_size;
+	QVector<FlatTile> m_tiles;
+};
+
+}
+
+Q_DECLARE_TYPEINFO(paintcore::FlatTile, Q_MOVABLE_TYPE);
+
+#endif
+
@@ -21,18 +21,56 @@
 #include <QImage>
 #include <QPainter>
 
+#include <algorithm>
+
 #include "tile.h"
+#include "tileintern.h"
 #include "rasterop.h"
 
+#include <atomic>
+
 namespace paintcore {
 
+namespace {
+
+// Source of unique tile write generations. Zero is reserved for null tiles.
+std::atomic<quint64> lastGeneration(0);
+
+//! Can compositing in this mode make opaque pixels translucent?
+bool canDecreaseOpacity(BlendMode::Mode mode)
+{
+	return findBlendMode(mode).flags.testFlag(BlendMode::DecrOpacity);
+}
+
+//! Is this an eraser mode that can only decrease opacity?
+bool isEraser(BlendMode::Mode mode)
+{
+	const BlendMode::Flags flags = findBlendMode(mode).flags;
+	return flags.testFlag(BlendMode::DecrOpacity) && !flags.testFlag(BlendMode::IncrOpacity);
+}
+
+/**
+ * @brief Get the coverage of a tile after compositing something onto it
+ * @param before the coverage before compositing
+ * @param decreases can the operation make pixels more transparent
+ * @param eraser can the operation only make pixels more transparent
+ */
+Tile::Coverage coverageAfter(Tile::Coverage before, bool decreases, bool eraser)
+{
+	if(before == Tile::COVER_OPAQUE && !decreases)
+		return Tile::COVER_OPAQUE;
+	if(before == Tile::COVER_TRANSPARENT && eraser)
+		return Tile::COVER_TRANSPARENT;
+	return Tile::COVER_MIXED;
+}
+
+}
+
 Tile::Tile(const QColor& color)
-	: _data(new TileData)
+	: _data(0), _color(fromArgb(color.rgba())), _coverage(COVER_TRANSPARENT), _optimized(true), _generation(0)
 {
-	quint32 *ptr = _data->data;
-	quint32 col = color.rgba();
-	for(int i=0;i<SIZE*SIZE;++i)
-		*(ptr++) = col;
+	if(_color)
+		touch();
 }
 
 /**
@@ -44,8 +82,9 @@ Tile::Tile(const QColor& color)
  * @param yoff source image offset
  */
 Tile::Tile(const QImage& image, int xoff, int yoff)
-	: _data(new TileData)
+	: _data(new TileData), _color(0), _coverage(COVER_MIXED), _optimized(false), _generation(0)
 {
+	touch();
 	Q_ASSERT(xoff>=0 && xoff < image.width());
 	Q_ASSERT(yoff>=0 && yoff < image.height());
 	Q_ASSERT(image.format() == QImage::Format_ARGB32);
@@ -53,7 +92,7 @@ Tile::Tile(const QImage& image, int xoff, int yoff)
 	const int w = xoff + SIZE > image.width() ? image.width() - xoff : SIZE;
 	const int h = yoff + SIZE > image.height() ? image.height() - yoff : SIZE;
 
-	uchar *ptr = reinterpret_cast<uchar*>(_data->data);
+	uchar *ptr = reinterpret_cast<uchar*>(_data->pixels());
 	memset(ptr, 0, BYTES);
 
 	const uchar *src = image.scanLine(yoff) + xoff*4;
@@ -62,13 +101,28 @@ Tile::Tile(const QImage& image, int xoff, int yoff)
 		ptr += SIZE*4;
 		src += image.bytesPerLine();
 	}
+
+	if(isPremultipliedStorage()) {
+		quint32 *pixel = _data->pixels();
+		for(int i=0;i<LENGTH;++i,++pixel)
+			*pixel = qPremultiply(*pixel);
+	}
+
+	if(w==SIZE && h==SIZE) {
+		const quint32 *pixel = _data->pixels();
+		const quint32 *end = pixel + LENGTH;
+		while(pixel<end && (*pixel & 0xff000000) == 0xff000000)
+			++pixel;
+		if(pixel==end)
+			_coverage = COVER_OPAQUE;
+	}
 }
 
 void Tile::fillChecker(quint32 *data, const QColor& dark, const QColor& light)
 {
 	const int HALF = SIZE/2;
-	quint32 d = dark.rgba();
-	quint32 l = light.rgba();
+	quint32 d = fromArgb(dark.rgba());
+	quint32 l = fromArgb(light.rgba());
 	quint32 *q1 = data, *q2 = data+HALF, *q3 = data + SIZE*HALF, *q4 = data + SIZE*(HALF)+HALF;
 	for(int y=0;y<HALF;++y) {
 		for(int x=0;x<HALF;++x) {
@@ -85,8 +139,10 @@ void Tile::copyTo(quint32 *data) const
 {
 	if(isNull())
 		memset(data, 0, BYTES);
+	else if(isUniform())
+		std::fill(data, data+LENGTH, _color);
 	else
-		memcpy(data, _data->data, BYTES);
+		memcpy(data, _data->pixels(), BYTES);
 }
 
 void Tile::copyToImage(QImage& image, int x, int y) const {
@@ -99,8 +155,26 @@ void Tile::copyToImage(QImage& image, int x, int y) const {
 			memset(targ, 0, w);
 			targ += image.bytesPerLine();
 		}
+	} else if(isUniform()) {
+		const quint32 color = toArgb(_color);
+		for(int y=0;y<h;++y) {
+			quint32 *t = reinterpret_cast<quint32*>(targ);
+			std::fill(t, t+w/4, color);
+			targ += image.bytesPerLine();
+		}
+
+	} else if(isPremultipliedStorage()) {
+		const quint32 *ptr = _data->pixels();
+		for(int y=0;y<h;++y) {
+			quint32 *t = reinterpret_cast<quint32*>(targ);
+			for(int x=0;x<w/4;++x)
+				t[x] = qUnpremultiply(ptr[x]);
+			targ += image.bytesPerLine();
+			ptr += SIZE;
+		}
+
 	} else {
-		const quint32 *ptr = _data->data;
+		const quint32 *ptr = _data->pixels();
 		for(int y=0;y<h;++y) {
 			memcpy(targ, ptr, w);
 			targ += image.bytesPerLine();
@@ -119,11 +193,52 @@ void Tile::copyToImage(QImage& image, int x, int y) const {
  * @param skip values to skip to reach the next line
  */
 void Tile::composite(BlendMode::Mode mode, const uchar *values, const QColor& color, int x, int y, int w, int h, int skip)
+{
+	composite(mode, maskCompositor(mode), values, color, x, y, w, h, skip);
+}
+
+/**
+ * @param mode the blending mode the kernel was selected for
+ * @param kernel compositing kernel returned by maskCompositor(mode)
+ */
+void Tile::composite(BlendMode::Mode mode, MaskCompositeFunc kernel, const uchar *values, const QColor& color, int x, int y, int w, int h, int skip)
 {
 	Q_ASSERT(x>=0 && x<SIZE && y>=0 && y<SIZE);
 	Q_ASSERT((x+w)<=SIZE && (y+h)<=SIZE);
-	compositeMask(mode, getOrCreateData() + y * SIZE + x,
+	const Coverage before = coverage();
+	kernel(getOrCreateData() + y * SIZE + x,
 			color.rgba(), values, w, h, skip, SIZE-w);
+	_coverage = coverageAfter(before, canDecreaseOpacity(mode), isEraser(mode));
+}
+
+/**
+ * Compositing a uniform tile produces another uniform tile, so only
+ * a single pixel needs to be calculated.
+ *
+ * @param mode the blending mode the kernel was selected for
+ * @param kernel compositing kernel returned by maskCompositor(mode)
+ * @param value mask value
+ * @param color composite color
+ */
+void Tile::fill(BlendMode::Mode mode, MaskCompositeFunc kernel, uchar value, const QColor &color)
+{
+	if(isUniform()) {
+		quint32 pixel = _color;
+		kernel(&pixel, color.rgba(), &value, 1, 1, 0, 0);
+		setUniform(pixel);
+		touch();
+
+	} else {
+		touch();
+		uchar mask[LENGTH];
+		memset(mask, value, LENGTH);
+		kernel(_data->pixels(), color.rgba(), mask, SIZE, SIZE, 0, 0);
+
+		if(value==255 && qAlpha(color.rgba())==255 && mode == BlendMode::MODE_NORMAL)
+			_coverage = COVER_OPAQUE;
+		else
+			_coverage = coverageAfter(Coverage(_coverage), canDecreaseOpacity(mode), isEraser(mode));
+	}
 }
 
 /**
@@ -151,8 +266,14 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
 
 		return {{weightsum, 0, 0, 0, 0}};
 
+	} else if(isUniform()) {
+		// Sample the same row of pixels over and over
+		quint32 row[SIZE];
+		std::fill(row, row+w, _color);
+		return sampleMask(row, weights, w, h, skip, -w);
+
 	} else {
-		return sampleMask(_data->data + y * SIZE + x, weights,
+		return sampleMask(_data->pixels() + y * SIZE + x, weights,
 			w, h, skip, SIZE-w);
 	}
 }
@@ -165,7 +286,45 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
 void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
 {
 	if(!tile.isNull())
-		compositePixels(blend, getOrCreateData(), tile.data(), SIZE*SIZE, opacity);
+		merge(tile, opacity, blend, pixelCompositor(blend, opacity));
+}
+
+/**
+ * @param tile the tile which will be composited over this tile
+ * @param opacity opacity modifier of tile
+ * @param blend the blending mode the kernel was selected for
+ * @param kernel compositing kernel returned by pixelCompositor() for this mode and opacity
+ */
+void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend, PixelCompositeFunc kernel)
+{
+	if(tile.isNull())
+		return;
+
+	const Coverage before = coverage();
+	const Coverage after = (opacity==255 && tile.isOpaque() && blend == BlendMode::MODE_NORMAL)
+		? COVER_OPAQUE
+		: coverageAfter(before, canDecreaseOpacity(blend), isEraser(blend));
+
+	if(!tile.isUniform()) {
+		kernel(getOrCreateData(), tile.data(), opacity, SIZE*SIZE);
+		_coverage = after;
+
+	} else if(isUniform()) {
+		// Uniform over uniform is still uniform
+		quint32 pixel = _color;
+		kernel(&pixel, &tile._color, opacity, 1);
+		setUniform(pixel);
+		touch();
+
+	} else {
+		touch();
+		quint32 row[SIZE];
+		std::fill(row, row+SIZE, tile._color);
+		quint32 *ptr = _data->pixels();
+		for(int y=0;y<SIZE;++y,ptr+=SIZE)
+			kernel(ptr, row, opacity, SIZE);
+		_coverage = after;
+	}
 }
 
 /**
@@ -173,10 +332,13 @@ void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
  */
 bool Tile::isBlank() const
 {
-	if(isNull())
-		return true;
+	if(isUniform())
+		return !(_color & 0xff000000);
 
-	const quint32 *pixel = _data->data;
+	if(_coverage != COVER_MIXED)
+		return _coverage == COVER_TRANSPARENT;
+
+	const quint32 *pixel = _data->pixels();
 	const quint32 *end = pixel + SIZE*SIZE;
 	while(pixel<end) {
 		if((*pixel & 0xff000000))
@@ -186,19 +348,125 @@ bool Tile::isBlank() const
 	return true;
 }
 
+void Tile::optimize()
+{
+	if(isOptimized())
+		return;
+
+	_optimized = true;
+
+	if(isBlank()) {
+		setUniform(0);
+		return;
+	}
+
+	// Note: read through constData to avoid detaching shared pixel data
+	const quint32 *pixel = _data.constData()->pixels();
+	const quint32 first = *pixel;
+	const quint32 *end = pixel + LENGTH;
+	while(++pixel<end) {
+		if(*pixel != first)
+			break;
+	}
+
+	if(pixel==end) {
+		setUniform(first);
+		return;
+	}
+
+	// Pixel data remains: refine the coverage
+	if(_coverage == COVER_MIXED) {
+		pixel = _data.constData()->pixels();
+		while(pixel<end && (*pixel & 0xff000000) == 0xff000000)
+			++pixel;
+		if(pixel==end)
+			_coverage = COVER_OPAQUE;
+	}
+}
+
 quint32 *Tile::getOrCreateData() {
+	// The caller may write to the returned pointer
+	touch();
+
 	if(!_data) {
 		_data = new TileData;
-		memset(_data->data, 0, BYTES);
+		if(_color)
+			std::fill(_data->pixels(), _data->pixels()+LENGTH, _color);
+		else
+			memset(_data->pixels(), 0, BYTES);
+		_color = 0;
 	}
-	return _data->data;
+
+	// Caller may write anything
+	_coverage = COVER_MIXED;
+	return _data->pixels();
+}
+
+/**
+ * Note: optimize() uses this too, so the generation is not changed here.
+ */
+void Tile::setUniform(quint32 color)
+{
+	_data = 0;
+	_color = color;
 }
 
-#ifndef NDEBUG
-QAtomicInt TileData::_count;
-TileData::TileData() { _count.fetchAndAddOrdered(1); }
-TileData::TileData(const TileData &td) : QSharedData() { memcpy(data, td.data, sizeof data); _count.fetchAndAddOrdered(1); }
-TileData::~TileData() { _count.fetchAndAddOrdered(-1); }
-#endif
+quint64 Tile::nextGeneration()
+{
+	return lastGeneration.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void Tile::touch()
+{
+	_generation = nextGeneration();
+	_optimized = false;
+
+	// Interned data must not be modified in place
+	if(_data && _data.constData()->interned)
+		tileintern::release(_data);
+}
+
+void Tile::intern()
+{
+	if(!isInterned() && tileintern::isEnabled())
+		tileintern::intern(_data);
+}
+
+bool Tile::swapOut() const
+{
+	return _data && tileswap::swapOut(_data.constData());
+}
+
+TileData::TileData()
+	: hash(0), interned(false), folded(0),
+	  pixeldata(static_cast<quint32*>(tilepool::allocate())), swapslot(-1), lastuse(tileswap::nextUseStamp())
+{
+	tileswap::checkLimit();
+}
+
+TileData::TileData(const TileData &other)
+	: QSharedData(other), hash(0), interned(false), folded(0),
+	  pixeldata(static_cast<quint32*>(tilepool::allocate())), swapslot(-1), lastuse(tileswap::nextUseStamp())
+{
+	memcpy(pixeldata.load(std::memory_order_relaxed), other.pixels(), Tile::BYTES);
+	tileswap::checkLimit();
+}
+
+TileData::~TileData()
+{
+	if(interned)
+		tileintern::forget(this);
+
+	quint32 *p = pixeldata.load(std::memory_order_acquire);
+	if(p)
+		tilepool::release(p);
+	else
+		tileswap::discard(swapslot);
+}
+
+float TileData::megabytesSaved()
+{
+	return tileintern::savedCount() * Tile::BYTES / float(1024*1024);
+}
 
 }
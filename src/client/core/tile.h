@@ -20,14 +20,15 @@
 #define TILE_H
 
 #include "blendmodes.h"
+#include "rasterop.h"
+#include "tilepool.h"
+#include "tileswap.h"
 
 #include <QSharedDataPointer>
-
-#ifndef NDEBUG
-#include <QAtomicInt>
-#endif
+#include <QRgb>
 
 #include <array>
+#include <atomic>
 
 class QColor;
 class QImage;
@@ -36,24 +37,58 @@ namespace paintcore {
 
 /// Shared tile data
 struct TileData : public QSharedData {
-	quint32 data[64*64];
-
-#ifndef NDEBUG // Debug tool for measuring memory usage
 	TileData();
-	TileData(const TileData &td);
+
+	//! Copy the pixels (copies are not interned)
+	TileData(const TileData &other);
+
 	~TileData();
 
-	static int globalCount() { return _count.load() ; }
-	static float megabytesUsed() { return globalCount() * sizeof data / float(1024*1024); }
-private:
-	static QAtomicInt _count;
-#endif
+	//! Get the pixels. Pixels in the swap file are paged back in. (See tileswap.h)
+	quint32 *pixels() const {
+		quint32 *p = pixeldata.load(std::memory_order_acquire);
+		return Q_LIKELY(p) ? p : tileswap::pageIn(this);
+	}
+
+	// Interning state (see tileintern.h.) This is not part of the content,
+	// so it may be changed even when the data is shared.
+	mutable quint64 hash;
+	mutable bool interned;
+	mutable int folded; // number of blocks freed by sharing this one
+
+	// Swap state (see tileswap.h.) The pixel block comes from the tile pool
+	// and is null while the pixels are in the swap file.
+	mutable std::atomic<quint32*> pixeldata;
+	mutable int swapslot; // swap file slot or -1 if resident
+	mutable std::atomic<quint32> lastuse; // use stamp of the last allocation or page-in
+
+	//! Number of tile pixel blocks currently in memory
+	static int globalCount() { return tilepool::liveCount(); }
+
+	//! Number of free tile pixel blocks held in reserve
+	static int pooledCount() { return tilepool::pooledCount(); }
+
+	//! Highest number of tile pixel blocks in memory at once
+	static int peakCount() { return tilepool::peakCount(); }
+
+	static float megabytesUsed() { return globalCount() * (64*64*sizeof(quint32)) / float(1024*1024); }
+
+	//! Approximate amount of memory saved by interning
+	static float megabytesSaved();
 };
 
 /**
  * @brief A piece of an image
- * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB.
+ * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB,
+ * or premultiplied ARGB if premultiplied storage is enabled.
+ * (See setPremultipliedStorage().)
+ *
+ * The image and color based functions convert the pixel format as needed,
+ * but raw pixel data is always in the storage format.
  *
+ * A tile filled with a single color is stored without pixel data
+ * (see isUniform()). Pixel data is created when the tile is first written to.
+ * A null tile is a uniform tile whose color is fully transparent black.
  */
 class Tile {
 	public:
@@ -66,6 +101,13 @@ class Tile {
 		//! The length of the tile data in bytes
 		static const int BYTES = LENGTH * sizeof(quint32);
 
+		//! Pixel alpha coverage of a tile
+		enum Coverage {
+			COVER_TRANSPARENT, // every pixel is fully transparent
+			COVER_MIXED,       // some pixels are (or may be) translucent
+			COVER_OPAQUE       // every pixel is fully opaque
+		};
+
 		/** @brief Round i upwards to SIZE boundary
 		 * @param i coordinate
 		 * @return i rounded up to nearest multiple of SIZE
@@ -96,40 +138,78 @@ class Tile {
 		}
 
 		//! Construct a null tile
-		Tile() : _data(0) { }
+		Tile() : _data(0), _color(0), _coverage(COVER_TRANSPARENT), _optimized(true), _generation(0) { }
 
-		//! Construct a tile filled with the given color
+		//! Construct a uniform tile filled with the given color
 		explicit Tile(const QColor& color);
 
 		//! Construct a tile from an image
 		Tile(const QImage& image, int xoff, int yoff);
 
-		//! Get a pixel value from this tile
-		quint32 pixel(int x, int y) const {
+		//! Get a pixel value (straight ARGB) from this tile
+		quint32 pixel(int x, int y) const { return toArgb(rawPixel(x, y)); }
+
+		//! Get a pixel value in the tile storage format
+		quint32 rawPixel(int x, int y) const {
 			Q_ASSERT(x>=0 && x<SIZE);
 			Q_ASSERT(y>=0 && y<SIZE);
 			if(_data)
-				return *(_data->data + y * SIZE + x);
-			return 0;
+				return _data->pixels()[y * SIZE + x];
+			return _color;
+		}
+
+		//! Convert a straight ARGB value to the tile storage format
+		static quint32 fromArgb(quint32 argb) {
+			return isPremultipliedStorage() ? qPremultiply(argb) : argb;
+		}
+
+		//! Convert a pixel value from the tile storage format to straight ARGB
+		static quint32 toArgb(quint32 pixel) {
+			return isPremultipliedStorage() ? qUnpremultiply(pixel) : pixel;
 		}
 
 		//! Composite values multiplied by color onto this tile
 		void composite(BlendMode::Mode mode, const uchar *values, const QColor& color, int x, int y, int w, int h, int skip);
 
+		//! Composite values multiplied by color onto this tile using a preselected kernel
+		void composite(BlendMode::Mode mode, MaskCompositeFunc kernel, const uchar *values, const QColor& color, int x, int y, int w, int h, int skip);
+
+		//! Composite a color onto the whole tile using a constant mask value
+		void fill(BlendMode::Mode mode, MaskCompositeFunc kernel, uchar value, const QColor &color);
+
 		//! Get a weighted average of the tile pixels
 		std::array<quint32, 5> weightedAverage(const uchar *weights, int x, int y, int w, int h, int skip) const;
 
 		//! Composite another tile with this tile
 		void merge(const Tile &tile, uchar opacity, BlendMode::Mode mode);
 
+		//! Composite another tile with this tile using a preselected kernel (see pixelCompositor())
+		void merge(const Tile &tile, uchar opacity, BlendMode::Mode mode, PixelCompositeFunc kernel);
+
 		//! Copy the contents of this tile onto the given spot on an image
 		void copyToImage(QImage& image, int x, int y) const;
 
-		//! Get read access to the raw pixel data
-		const quint32 *data() const { Q_ASSERT( _data); return _data->data; }
+		//! Get read access to the raw pixel data (the tile must not be uniform)
+		const quint32 *data() const { Q_ASSERT( _data); return _data->pixels(); }
+
+		//! Get read/write access to the raw pixel data. Pixel data is created if needed.
+		quint32 *data() { return getOrCreateData(); }
 
-		//! Get read/write access to the raw pixel data
-		quint32 *data() { Q_ASSERT(_data); return _data->data; }
+		//! Make sure this tile has pixel data of its own
+		void detach() { getOrCreateData(); }
+
+		/**
+		 * @brief Get the write generation of this tile
+		 *
+		 * The generation changes every time the tile content may have been
+		 * modified. Copies of a tile share the generation until one of them
+		 * is written to, so two tiles with the same generation have the same
+		 * content. Null tiles have generation zero.
+		 */
+		quint64 generation() const { return _generation; }
+
+		//! Reserve a new write generation that is newer than any existing one
+		static quint64 nextGeneration();
 
 		//! Copy the contents of this tile
 		void copyTo(quint32 *data) const;
@@ -141,11 +221,83 @@ class Tile {
 		 * to be completely transparent.
 		 * @return true if there is no pixel data
 		 */
-		bool isNull() const { return !_data; }
+		bool isNull() const { return !_data && !_color; }
+
+		/**
+		 * @brief Is this tile filled with a single color without pixel data?
+		 *
+		 * Note that a tile with pixel data may also contain just one color.
+		 * Call optimize() to convert such tiles to the uniform representation.
+		 */
+		bool isUniform() const { return !_data; }
+
+		/**
+		 * @brief Share pixel data with other tiles that have identical content
+		 *
+		 * This does nothing if interning is disabled. (See tileintern.h)
+		 */
+		void intern();
+
+		//! Is the pixel data of this tile shared with other tiles?
+		bool isShared() const { return _data && _data.constData()->ref.load() > 1; }
+
+		//! Is the pixel data of this tile interned? Uniform tiles have nothing to intern.
+		bool isInterned() const { return !_data || _data.constData()->interned; }
+
+		/**
+		 * @brief Move the pixel data of this tile to the swap file
+		 *
+		 * The pixels are paged back in when next accessed. The caller must
+		 * make sure no one is holding a pointer to the pixel data.
+		 * (See tileswap.h)
+		 * @return false if the pixel data is shared, already swapped out or there is no swap file
+		 */
+		bool swapOut() const;
+
+		//! Get the use stamp of the pixel data (see tileswap::nextUseStamp())
+		quint32 lastUse() const { return _data ? _data.constData()->lastuse.load(std::memory_order_relaxed) : 0; }
 
 		//! Check if this tile is completely transparent
 		bool isBlank() const;
 
+		/**
+		 * @brief Get the alpha coverage of this tile
+		 *
+		 * The coverage is updated as the tile is written to, without
+		 * rescanning the pixels. It is conservative: a tile whose
+		 * coverage is not known is reported as COVER_MIXED.
+		 * Calling optimize() refines the coverage of such tiles.
+		 */
+		Coverage coverage() const {
+			if(_data)
+				return Coverage(_coverage);
+			if(!(_color & 0xff000000))
+				return COVER_TRANSPARENT;
+			return (_color & 0xff000000) == 0xff000000 ? COVER_OPAQUE : COVER_MIXED;
+		}
+
+		//! Is this tile known to be fully opaque?
+		bool isOpaque() const { return coverage() == COVER_OPAQUE; }
+
+		/**
+		 * @brief Drop the pixel data if it is all the same color
+		 *
+		 * A completely transparent tile becomes a null tile.
+		 * The coverage of a tile that keeps its pixel data is recalculated.
+		 *
+		 * The pixels are only scanned if the tile has been written to
+		 * since it was last optimized. (See isOptimized().)
+		 */
+		void optimize();
+
+		/**
+		 * @brief Has this tile been optimized since it was last written to?
+		 *
+		 * An optimized tile with pixel data contains more than one color.
+		 * Uniform tiles are always optimized.
+		 */
+		bool isOptimized() const { return !_data || _optimized; }
+
 		//! Fill a tile sized memory buffer with a checker pattern
 		static void fillChecker(quint32 *data, const QColor& dark, const QColor& light);
 
@@ -154,16 +306,31 @@ class Tile {
 		 *
 		 * This is an identity comparison. This will return false even
 		 * if the tiles have identical contents but have different data pointers.
+		 * Uniform tiles are equal if they have the same color.
 		 * @param other
 		 * @return true if tiles share data pointers
 		 */
-		bool operator==(const Tile &other) const { return _data == other._data; }
+		bool operator==(const Tile &other) const { return _data == other._data && _color == other._color; }
 		bool operator!=(const Tile &other) const { return !(*this == other); }
 
 	private:
 		quint32 *getOrCreateData();
+		void setUniform(quint32 color);
+		void touch();
 
 		QSharedDataPointer<TileData> _data;
+
+		// Color (in storage format) of a uniform tile. Always zero when pixel data exists.
+		quint32 _color;
+
+		// Coverage of the pixel data (uniform tile coverage is derived from _color)
+		quint8 _coverage;
+
+		// Pixel data has not been written to since the last optimize() call
+		bool _optimized;
+
+		// Write generation (see generation())
+		quint64 _generation;
 };
 
 }
@@ -0,0 +1,200 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tileintern.h"
+#include "tile.h"
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QHash>
+
+#include <cstring>
+
+namespace paintcore {
+namespace tileintern {
+
+namespace {
+
+bool enabled = true;
+
+// The intern table. Entries are removed when the data is deleted or released.
+QMutex tableLock;
+QHash<quint64, const TileData*> table;
+
+QAtomicInt savedBlocks;
+
+/**
+ * @brief Take a reference to data found in the table
+ *
+ * Data whose reference count has already dropped to zero is about to be
+ * deleted (its destructor is waiting for the table lock) and must not be revived.
+ */
+bool tryRef(const TileData *data)
+{
+	int count = data->ref.load();
+	while(count > 0) {
+		if(data->ref.testAndSetOrdered(count, count+1))
+			return true;
+		count = data->ref.load();
+	}
+	return false;
+}
+
+//! Remove data from the table. The table lock must be held.
+void removeEntry(const TileData *data)
+{
+	const auto i = table.find(data->hash);
+	if(i != table.end() && i.value() == data)
+		table.erase(i);
+
+	savedBlocks.fetchAndAddRelaxed(-data->folded);
+	data->folded = 0;
+	data->interned = false;
+}
+
+inline quint64 mix(quint64 h)
+{
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return h;
+}
+
+}
+
+void setEnabled(bool enable)
+{
+	enabled = enable;
+}
+
+bool isEnabled()
+{
+	return enabled;
+}
+
+quint64 contentHash(const quint32 *data)
+{
+	static const quint64 PRIME = Q_UINT64_C(0x9e3779b97f4a7c15);
+
+	// Four independent lanes, so the multiplications can overlap
+	quint64 h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+
+	for(int i=0;i<Tile::LENGTH;i+=8) {
+		quint64 w[4];
+		memcpy(w, data + i, sizeof w);
+		h0 = (h0 ^ w[0]) * PRIME;
+		h1 = (h1 ^ w[1]) * PRIME;
+		h2 = (h2 ^ w[2]) * PRIME;
+		h3 = (h3 ^ w[3]) * PRIME;
+	}
+
+	return mix(h0 ^ mix(h1 ^ mix(h2 ^ mix(h3))));
+}
+
+void intern(QSharedDataPointer<TileData> &data)
+{
+	const TileData *d = data.constData();
+	Q_ASSERT(d && !d->interned);
+
+	const quint64 hash = contentHash(d->pixels());
+
+	QMutexLocker lock(&tableLock);
+
+	const TileData *&entry = table[hash];
+	if(entry) {
+		// A hash collision: leave this data alone
+		if(memcmp(entry->pixels(), d->pixels(), Tile::BYTES) != 0)
+			return;
+
+		if(tryRef(entry)) {
+			// Note: the old data is not interned, so deleting it here
+			// does not call forget() and the lock is not taken again.
+			const bool freed = d->ref.load() == 1;
+			const TileData *shared = entry;
+			data = QSharedDataPointer<TileData>(const_cast<TileData*>(shared));
+			shared->ref.deref();
+
+			if(freed) {
+				++shared->folded;
+				savedBlocks.ref();
+			}
+			return;
+		}
+
+		// The old entry is being deleted: this data replaces it
+	}
+
+	entry = d;
+	d->hash = hash;
+	d->interned = true;
+	d->folded = 0;
+}
+
+void release(QSharedDataPointer<TileData> &data)
+{
+	while(data.constData()->interned) {
+		{
+			QMutexLocker lock(&tableLock);
+			if(data.constData()->ref.load() == 1) {
+				// No one else can see this data once it is out of the table,
+				// so it can be modified in place
+				removeEntry(data.constData());
+				return;
+			}
+		}
+
+		// Copies are not interned. (If the other users went away in the
+		// meantime, no copy is made and the loop takes the branch above.)
+		data.detach();
+	}
+}
+
+void forget(TileData *data)
+{
+	QMutexLocker lock(&tableLock);
+	removeEntry(data);
+}
+
+bool withdraw(const TileData *data)
+{
+	QMutexLocker lock(&tableLock);
+	if(data->ref.load() != 1)
+		return false;
+
+	if(data->interned)
+		removeEntry(data);
+	return true;
+}
+
+int internedCount()
+{
+	QMutexLocker lock(&tableLock);
+	return table.size();
+}
+
+int savedCount()
+{
+	return savedBlocks.load();
+}
+
+}
+}
+
@@ -0,0 +1,95 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEINTERN_H
+#define PAINTCORE_TILEINTERN_H
+
+#include <QSharedDataPointer>
+
+namespace paintcore {
+
+struct TileData;
+
+/**
+ * @brief Content based tile data deduplication
+ *
+ * Interned tile data is entered into a global table keyed by a hash of its
+ * pixels. When a tile with identical content is interned, it is made to
+ * share the pixel data already in the table and its own copy is freed.
+ *
+ * The table does not keep tile data alive: data is removed from it when
+ * it is deleted. Interned data is never modified in place. Tiles call
+ * release() before writing, which either takes the data back out of the
+ * table (if no one else uses it) or detaches a private copy.
+ */
+namespace tileintern {
+
+//! Enable or disable interning (enabled by default)
+void setEnabled(bool enable);
+
+//! Is interning enabled?
+bool isEnabled();
+
+//! Calculate a 64 bit hash of tile content
+quint64 contentHash(const quint32 *data);
+
+/**
+ * @brief Intern tile data
+ *
+ * If identical data is already in the table, the pointer is changed
+ * to point to it. Otherwise the data is entered into the table.
+ *
+ * @param data pointer to non-null, not yet interned data
+ */
+void intern(QSharedDataPointer<TileData> &data);
+
+/**
+ * @brief Prepare interned data for writing
+ *
+ * After this, the pointer refers to data that is not interned.
+ * @param data pointer to interned data
+ */
+void release(QSharedDataPointer<TileData> &data);
+
+//! Remove deleted data from the table (called by the TileData destructor)
+void forget(TileData *data);
+
+/**
+ * @brief Take data out of the table if no one else uses it
+ *
+ * This is used to make sure no other thread can start using the data.
+ * @return false if the data is shared
+ */
+bool withdraw(const TileData *data);
+
+//! Get the number of tile data blocks in the table
+int internedCount();
+
+/**
+ * @brief Get the number of tile data blocks freed by interning
+ *
+ * This is an estimate: the count is reduced when the shared data is
+ * deleted, not when the tiles that were folded into it are rewritten.
+ */
+int savedCount();
+
+}
+}
+
+#endif
+
@@ -0,0 +1,95 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilemap.h"
+
+#include <algorithm>
+
+namespace paintcore {
+
+TileMap::TileMap(int xtiles, int ytiles, const Tile &fill)
+	: m_xtiles(xtiles), m_ytiles(ytiles),
+	  m_xblocks((xtiles + TileBlock::SIZE - 1) / TileBlock::SIZE),
+	  m_fill(fill), m_trackTouched(false)
+{
+	Q_ASSERT(xtiles>=0 && ytiles>=0);
+	const int yblocks = (ytiles + TileBlock::SIZE - 1) / TileBlock::SIZE;
+	m_blocks.resize(m_xblocks * yblocks);
+}
+
+Tile &TileMap::rtile(int x, int y)
+{
+	Q_ASSERT(x>=0 && x<m_xtiles);
+	Q_ASSERT(y>=0 && y<m_ytiles);
+
+	if(m_trackTouched)
+		m_touched.insert(y * m_xtiles + x);
+
+	QSharedDataPointer<TileBlock> &b = m_blocks[blockIndex(x, y)];
+	if(!b) {
+		b = new TileBlock;
+		std::fill(b->tiles, b->tiles + TileBlock::SIZE*TileBlock::SIZE, m_fill);
+	}
+
+	// Note: non-const access detaches the block if it is shared
+	return b->tiles[tileInBlock(x, y)];
+}
+
+void TileMap::fill(const Tile &tile)
+{
+	m_fill = tile;
+	std::fill(m_blocks.begin(), m_blocks.end(), QSharedDataPointer<TileBlock>());
+	m_touched.clear();
+}
+
+void TileMap::setTouchTracking(bool track)
+{
+	if(track == m_trackTouched)
+		return;
+
+	m_touched.clear();
+	if(track) {
+		// Tiles written before tracking was enabled count as touched
+		forEachStored([this](int i, const Tile&) { m_touched.insert(i); });
+	}
+	m_trackTouched = track;
+}
+
+int TileMap::storedCount() const
+{
+	int count = 0;
+	forEachStored([&count](int, const Tile&) { ++count; });
+	return count;
+}
+
+void TileMap::compact()
+{
+	for(int i=0;i<m_blocks.size();++i) {
+		const TileBlock *b = m_blocks.at(i).constData();
+		if(!b)
+			continue;
+
+		const Tile *end = b->tiles + TileBlock::SIZE*TileBlock::SIZE;
+		if(std::find_if(b->tiles, end, [this](const Tile &t) { return t != m_fill; }) == end)
+			m_blocks[i] = QSharedDataPointer<TileBlock>();
+	}
+}
+
+}
+
@@ -0,0 +1,170 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEMAP_H
+#define PAINTCORE_TILEMAP_H
+
+#include "tile.h"
+
+#include <QVector>
+#include <QSet>
+#include <QSharedDataPointer>
+
+namespace paintcore {
+
+//! A square block of tiles in a TileMap
+struct TileBlock : public QSharedData {
+	//! Block width and height in tiles
+	static const int SIZE = 16;
+
+	Tile tiles[SIZE*SIZE];
+};
+
+/**
+ * @brief A sparse grid of tiles
+ *
+ * The grid is divided into blocks of TileBlock::SIZE*TileBlock::SIZE tiles.
+ * Blocks are allocated only when a tile in them is written to. Tiles
+ * in unallocated blocks have the value of the fill tile.
+ *
+ * Both the block directory and the blocks are implicitly shared, so
+ * copying a tile map is cheap and writing to a copy only duplicates
+ * the blocks that are written to.
+ */
+class TileMap {
+public:
+	//! Construct an empty map
+	TileMap() : m_xtiles(0), m_ytiles(0), m_xblocks(0), m_trackTouched(false) { }
+
+	//! Construct a map where every tile is the given fill tile
+	TileMap(int xtiles, int ytiles, const Tile &fill=Tile());
+
+	int xtiles() const { return m_xtiles; }
+	int ytiles() const { return m_ytiles; }
+
+	//! Get the total number of tiles in the grid
+	int size() const { return m_xtiles * m_ytiles; }
+
+	//! Get a tile
+	const Tile &tile(int x, int y) const {
+		Q_ASSERT(x>=0 && x<m_xtiles);
+		Q_ASSERT(y>=0 && y<m_ytiles);
+		const TileBlock *b = m_blocks.at(blockIndex(x, y)).constData();
+		return b ? b->tiles[tileInBlock(x, y)] : m_fill;
+	}
+
+	/**
+	 * @brief Is this map the only user of the tile's pixel data?
+	 *
+	 * This is the case when neither the tile's block nor its pixel data
+	 * are shared with other maps or tiles. Freeing such a tile frees memory.
+	 */
+	bool isExclusive(int index) const {
+		const int x = index % m_xtiles;
+		const int y = index / m_xtiles;
+		const TileBlock *b = m_blocks.at(blockIndex(x, y)).constData();
+		if(!b || !m_blocks.isDetached() || b->ref.load() != 1)
+			return false;
+		const Tile &t = b->tiles[tileInBlock(x, y)];
+		return !t.isUniform() && !t.isShared();
+	}
+
+	//! Get a tile
+	const Tile &tile(int index) const { return tile(index % m_xtiles, index / m_xtiles); }
+
+	//! Get an editable reference to a tile. The tile's block is allocated if needed.
+	Tile &rtile(int x, int y);
+
+	//! Get an editable reference to a tile. The tile's block is allocated if needed.
+	Tile &rtile(int index) { return rtile(index % m_xtiles, index / m_xtiles); }
+
+	//! Set every tile to the given tile. All blocks are freed.
+	void fill(const Tile &tile);
+
+	//! Get the value of tiles in unallocated blocks
+	const Tile &fillTile() const { return m_fill; }
+
+	//! Is the tile at the given index stored in an allocated block?
+	bool isStored(int index) const { return m_blocks.at(blockIndex(index % m_xtiles, index / m_xtiles)); }
+
+	/**
+	 * @brief Enable touched tile tracking
+	 *
+	 * When enabled, the indices of the tiles returned by rtile() are
+	 * recorded until fill() is called. This makes forEachStored() proportional
+	 * to the number of touched tiles rather than the number of allocated
+	 * blocks, which is useful for short lived maps such as stroke sublayers.
+	 */
+	void setTouchTracking(bool track);
+
+	bool isTrackingTouches() const { return m_trackTouched; }
+
+	//! Get the number of tiles visited by forEachStored()
+	int storedCount() const;
+
+	/**
+	 * @brief Call fn(index, tile) for each tile that may differ from the fill tile
+	 *
+	 * These are the tiles in allocated blocks, or just the touched tiles
+	 * if touch tracking is enabled. Tiles not visited have the value of fillTile().
+	 */
+	template<typename Fn> void forEachStored(Fn fn) const {
+		if(m_trackTouched) {
+			for(const int i : m_touched)
+				fn(i, tile(i));
+			return;
+		}
+
+		for(int by=0;by*TileBlock::SIZE<m_ytiles;++by) {
+			for(int bx=0;bx<m_xblocks;++bx) {
+				const TileBlock *b = m_blocks.at(by*m_xblocks+bx).constData();
+				if(!b)
+					continue;
+
+				const int x0 = bx*TileBlock::SIZE;
+				const int y0 = by*TileBlock::SIZE;
+				const int x1 = qMin(x0+TileBlock::SIZE, m_xtiles);
+				const int y1 = qMin(y0+TileBlock::SIZE, m_ytiles);
+				for(int y=y0;y<y1;++y) {
+					for(int x=x0;x<x1;++x)
+						fn(y*m_xtiles+x, b->tiles[tileInBlock(x, y)]);
+				}
+			}
+		}
+	}
+
+	//! Free blocks whose tiles are all identical to the fill tile
+	void compact();
+
+private:
+	int blockIndex(int x, int y) const { return (y / TileBlock::SIZE) * m_xblocks + x / TileBlock::SIZE; }
+	static int tileInBlock(int x, int y) { return (y % TileBlock::SIZE) * TileBlock::SIZE + x % TileBlock::SIZE; }
+
+	int m_xtiles, m_ytiles;
+	int m_xblocks;
+	Tile m_fill;
+	QVector<QSharedDataPointer<TileBlock>> m_blocks;
+
+	bool m_trackTouched;
+	QSet<int> m_touched;
+};
+
+}
+
+#endif
+
@@ -0,0 +1,281 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilepool.h"
+#include "tile.h"
+
+#include <QAtomicInt>
+#include <QMutex>
+
+#include <new>
+
+namespace paintcore {
+namespace tilepool {
+
+namespace {
+
+static const size_t BLOCK_SIZE = Tile::BYTES;
+
+//! Maximum number of free blocks in a per-thread cache
+static const int THREAD_CACHE_SIZE = 64;
+
+//! Number of blocks moved between a thread cache and the global list at once
+static const int BATCH_SIZE = THREAD_CACHE_SIZE / 2;
+
+//! Free blocks are linked together through their first bytes
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+QAtomicInt liveBlocks;
+QAtomicInt pooledBlocks;
+QAtomicInt peakBlocks;
+
+// The global free list
+QMutex globalLock;
+FreeBlock *globalList = nullptr;
+int globalCount = 0;
+int globalHighWaterMark = 1024;
+
+/**
+ * @brief Per-thread free block cache
+ *
+ * This struct is trivial so it remains usable (in the "dead" state) even
+ * after the flusher below has been destroyed at thread exit.
+ */
+struct ThreadCache {
+	FreeBlock *list;
+	int count;
+	bool registered;
+	bool dead;
+};
+
+thread_local ThreadCache threadCache = { nullptr, 0, false, false };
+
+void freeToSystem(FreeBlock *list)
+{
+	while(list) {
+		FreeBlock *next = list->next;
+		::operator delete(list);
+		list = next;
+	}
+}
+
+/**
+ * @brief Remove blocks above the high-water mark from the global list
+ *
+ * The global lock must be held.
+ * @param count number of removed blocks
+ * @return chain of removed blocks
+ */
+FreeBlock *trimGlobal(int &count)
+{
+	FreeBlock *surplus = nullptr;
+	count = 0;
+	while(globalCount > globalHighWaterMark) {
+		FreeBlock *b = globalList;
+		globalList = b->next;
+		b->next = surplus;
+		surplus = b;
+		--globalCount;
+		++count;
+	}
+	return surplus;
+}
+
+/**
+ * @brief Put a chain of blocks into the global free list
+ *
+ * Blocks above the high-water mark are returned to the system.
+ */
+void pushGlobal(FreeBlock *first, FreeBlock *last, int count)
+{
+	int surplusCount;
+
+	globalLock.lock();
+	last->next = globalList;
+	globalList = first;
+	globalCount += count;
+	FreeBlock *surplus = trimGlobal(surplusCount);
+	globalLock.unlock();
+
+	if(surplusCount) {
+		pooledBlocks.fetchAndAddRelaxed(-surplusCount);
+		freeToSystem(surplus);
+	}
+}
+
+/**
+ * @brief Take up to count blocks from the global free list
+ * @param count maximum number of blocks to take
+ * @param taken number of blocks actually taken
+ * @return chain of free blocks or null if the global list was empty
+ */
+FreeBlock *takeGlobal(int count, int &taken)
+{
+	QMutexLocker lock(&globalLock);
+	FreeBlock *first = globalList;
+	FreeBlock *last = nullptr;
+	taken = 0;
+	while(globalList && taken < count) {
+		last = globalList;
+		globalList = globalList->next;
+		++taken;
+	}
+	if(last)
+		last->next = nullptr;
+	globalCount -= taken;
+	return taken ? first : nullptr;
+}
+
+//! Move blocks from the thread cache to the global list
+void flushThreadCache(int count)
+{
+	ThreadCache &tc = threadCache;
+	if(count > tc.count)
+		count = tc.count;
+	if(count<=0)
+		return;
+
+	FreeBlock *first = tc.list;
+	FreeBlock *last = first;
+	for(int i=1;i<count;++i)
+		last = last->next;
+	tc.list = last->next;
+	tc.count -= count;
+
+	pushGlobal(first, last, count);
+}
+
+//! Returns the thread cache to the global list when the thread exits
+struct ThreadCacheFlusher {
+	~ThreadCacheFlusher() {
+		flushThreadCache(threadCache.count);
+		threadCache.dead = true;
+	}
+	void touch() { }
+};
+
+thread_local ThreadCacheFlusher threadCacheFlusher;
+
+//! Make sure the thread cache is flushed when this thread exits
+inline void registerThreadCache(ThreadCache &tc)
+{
+	if(!tc.registered) {
+		threadCacheFlusher.touch();
+		tc.registered = true;
+	}
+}
+
+void updatePeak(int live)
+{
+	int peak = peakBlocks.load();
+	while(live > peak && !peakBlocks.testAndSetRelaxed(peak, live))
+		peak = peakBlocks.load();
+}
+
+}
+
+void *allocate()
+{
+	updatePeak(liveBlocks.fetchAndAddRelaxed(1) + 1);
+
+	ThreadCache &tc = threadCache;
+
+	if(!tc.dead) {
+		if(!tc.list) {
+			registerThreadCache(tc);
+			int taken;
+			tc.list = takeGlobal(BATCH_SIZE, taken);
+			tc.count = taken;
+		}
+
+		if(tc.list) {
+			FreeBlock *b = tc.list;
+			tc.list = b->next;
+			--tc.count;
+			pooledBlocks.fetchAndAddRelaxed(-1);
+			return b;
+		}
+
+	} else {
+		int taken;
+		FreeBlock *b = takeGlobal(1, taken);
+		if(b) {
+			pooledBlocks.fetchAndAddRelaxed(-1);
+			return b;
+		}
+	}
+
+	return ::operator new(BLOCK_SIZE);
+}
+
+void release(void *block)
+{
+	if(!block)
+		return;
+
+	liveBlocks.fetchAndAddRelaxed(-1);
+	pooledBlocks.fetchAndAddRelaxed(1);
+
+	FreeBlock *b = static_cast<FreeBlock*>(block);
+	ThreadCache &tc = threadCache;
+
+	if(tc.dead) {
+		pushGlobal(b, b, 1);
+		return;
+	}
+
+	registerThreadCache(tc);
+
+	b->next = tc.list;
+	tc.list = b;
+	if(++tc.count > THREAD_CACHE_SIZE)
+		flushThreadCache(BATCH_SIZE);
+}
+
+void setHighWaterMark(int blocks)
+{
+	if(blocks<0)
+		blocks = 0;
+
+	int surplusCount;
+
+	globalLock.lock();
+	globalHighWaterMark = blocks;
+	FreeBlock *surplus = trimGlobal(surplusCount);
+	globalLock.unlock();
+
+	pooledBlocks.fetchAndAddRelaxed(-surplusCount);
+	freeToSystem(surplus);
+}
+
+int highWaterMark()
+{
+	QMutexLocker lock(&globalLock);
+	return globalHighWaterMark;
+}
+
+int liveCount() { return liveBlocks.load(); }
+int pooledCount() { return pooledBlocks.load(); }
+int peakCount() { return peakBlocks.load(); }
+
+}
+}
+
@@ -0,0 +1,70 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEPOOL_H
+#define PAINTCORE_TILEPOOL_H
+
+namespace paintcore {
+namespace tilepool {
+
+/**
+ * @brief Get a tile data block
+ *
+ * Blocks are recycled from the calling thread's cache or the global free list
+ * when possible. A new block is allocated only when both are empty.
+ *
+ * @return pointer to an uninitialized block (never null)
+ */
+void *allocate();
+
+/**
+ * @brief Return a tile data block to the pool
+ *
+ * The block goes to the calling thread's cache. Overflowing blocks are moved
+ * to the global free list, and blocks above the high-water mark are returned
+ * to the system.
+ *
+ * @param block a block previously returned by allocate()
+ */
+void release(void *block);
+
+/**
+ * @brief Set the maximum number of free blocks kept in the global free list
+ *
+ * Surplus blocks are freed immediately.
+ * @param blocks high-water mark (in tiles)
+ */
+void setHighWaterMark(int blocks);
+
+//! Get the global free list high-water mark
+int highWaterMark();
+
+//! Get the number of tile blocks currently in use
+int liveCount();
+
+//! Get the number of free blocks held by the pool (including per-thread caches)
+int pooledCount();
+
+//! Get the highest number of simultaneously used tile blocks seen so far
+int peakCount();
+
+}
+}
+
+#endif
+
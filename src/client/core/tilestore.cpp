@@ -0,0 +1,168 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilestore.h"
+
+#include <QAtomicInt>
+#include <QVector>
+#include <QDebug>
+
+#include <algorithm>
+#include <cstring>
+
+namespace paintcore {
+
+namespace {
+
+// The compressed format is a sequence of native endian 32 bit words.
+// Each chunk starts with a header word: the low bits are the pixel count
+// and the high bit tells if the chunk is a run of a single pixel value
+// (followed by one word) or a literal sequence (followed by count words.)
+static const quint32 RUN = 0x80000000;
+
+// Shortest run worth encoding as a run chunk
+static const int MIN_RUN = 3;
+
+// Tiles that don't compress to less than this are not worth storing
+static const int MAX_COMPRESSED_WORDS = Tile::LENGTH * 3 / 4;
+
+QAtomicInt totalBytes;
+QAtomicInt totalTiles;
+
+void appendLiteral(QVector<quint32> &out, const quint32 *pixels, int count)
+{
+	if(count>0) {
+		out.append(quint32(count));
+		const int pos = out.size();
+		out.resize(pos + count);
+		memcpy(out.data() + pos, pixels, count * sizeof(quint32));
+	}
+}
+
+}
+
+TileStore::TileStore()
+	: m_bytes(0)
+{
+}
+
+TileStore::~TileStore()
+{
+	totalBytes.fetchAndAddRelaxed(-m_bytes);
+	totalTiles.fetchAndAddRelaxed(-m_tiles.size());
+}
+
+QByteArray TileStore::compress(const Tile &tile)
+{
+	Q_ASSERT(!tile.isUniform());
+	const quint32 *pixels = tile.data();
+
+	QVector<quint32> out;
+	out.reserve(MAX_COMPRESSED_WORDS + Tile::SIZE);
+
+	int literal = 0;
+	int i = 0;
+	while(i<Tile::LENGTH) {
+		const quint32 *end = std::find_if(pixels+i+1, pixels+Tile::LENGTH, [pixels, i](quint32 p) { return p != pixels[i]; });
+		const int run = end - (pixels+i);
+
+		if(run >= MIN_RUN) {
+			appendLiteral(out, pixels+literal, i-literal);
+			out.append(RUN | quint32(run));
+			out.append(pixels[i]);
+			literal = i + run;
+		}
+		i += run;
+
+		if(out.size() > MAX_COMPRESSED_WORDS)
+			return QByteArray();
+	}
+	appendLiteral(out, pixels+literal, Tile::LENGTH-literal);
+
+	if(out.size() > MAX_COMPRESSED_WORDS)
+		return QByteArray();
+
+	return QByteArray(reinterpret_cast<const char*>(out.constData()), out.size() * sizeof(quint32));
+}
+
+Tile TileStore::decompress(const QByteArray &data)
+{
+	const quint32 *in = reinterpret_cast<const quint32*>(data.constData());
+	const int words = data.size() / sizeof(quint32);
+
+	Tile tile;
+	quint32 *out = tile.data();
+
+	int pos = 0;
+	int i = 0;
+	while(i<words) {
+		const quint32 header = in[i++];
+		const int count = header & ~RUN;
+
+		if(count > Tile::LENGTH - pos)
+			break;
+
+		if(header & RUN) {
+			if(i>=words)
+				break;
+			std::fill(out+pos, out+pos+count, in[i++]);
+
+		} else {
+			if(count > words - i)
+				break;
+			memcpy(out+pos, in+i, count * sizeof(quint32));
+			i += count;
+		}
+		pos += count;
+	}
+
+	if(pos != Tile::LENGTH || i != words) {
+		qWarning() << "Invalid compressed tile of" << data.size() << "bytes";
+		return Tile();
+	}
+
+	return tile;
+}
+
+void TileStore::insert(int layer, int index, const QByteArray &data)
+{
+	Q_ASSERT(!data.isEmpty());
+	const quint64 k = key(layer, index);
+
+	const int oldSize = m_tiles.value(k).size();
+	if(!oldSize)
+		totalTiles.ref();
+
+	m_tiles[k] = data;
+	m_bytes += data.size() - oldSize;
+	totalBytes.fetchAndAddRelaxed(data.size() - oldSize);
+}
+
+int TileStore::totalCompressedBytes()
+{
+	return totalBytes.load();
+}
+
+qint64 TileStore::totalUncompressedBytes()
+{
+	return qint64(totalTiles.load()) * Tile::BYTES;
+}
+
+}
+
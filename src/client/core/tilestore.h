@@ -0,0 +1,98 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILESTORE_H
+#define PAINTCORE_TILESTORE_H
+
+#include "tile.h"
+
+#include <QHash>
+#include <QByteArray>
+
+namespace paintcore {
+
+//! A tile on its way into a TileStore
+struct ColdTile {
+	int layer;
+	int index;
+	Tile tile;       // the tile to compress
+	QByteArray data; // the compressed tile (empty if compression didn't pay off)
+};
+
+/**
+ * @brief Compressed storage for rarely used tiles
+ *
+ * The tiles are compressed with a simple run length encoding of the pixel
+ * values. It is fast enough to be practically free compared to copying the
+ * tile, and works well on typical artwork, where most tiles are largely
+ * transparent or filled with flat color.
+ */
+class TileStore {
+public:
+	TileStore();
+	~TileStore();
+
+	/**
+	 * @brief Compress a tile
+	 *
+	 * @param tile a tile with pixel data
+	 * @return compressed data or an empty array if the tile does not compress well
+	 */
+	static QByteArray compress(const Tile &tile);
+
+	//! Decompress a tile. A null tile is returned if the data is invalid.
+	static Tile decompress(const QByteArray &data);
+
+	//! Add a compressed tile
+	void insert(int layer, int index, const QByteArray &data);
+
+	//! Call fn(index, tile) with each decompressed tile of the given layer
+	template<typename Fn> void forEachTile(int layer, Fn fn) const {
+		for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+			if(int(i.key() >> 32) == layer)
+				fn(int(i.key() & 0xffffffff), decompress(i.value()));
+		}
+	}
+
+	bool isEmpty() const { return m_tiles.isEmpty(); }
+
+	//! Get the size of the compressed tiles in this store
+	int compressedBytes() const { return m_bytes; }
+
+	//! Get the size the tiles in this store would take uncompressed
+	qint64 uncompressedBytes() const { return qint64(m_tiles.size()) * Tile::BYTES; }
+
+	//! Get the size of the compressed tiles in all stores
+	static int totalCompressedBytes();
+
+	//! Get the size the tiles in all stores would take uncompressed
+	static qint64 totalUncompressedBytes();
+
+private:
+	Q_DISABLE_COPY(TileStore)
+
+	static quint64 key(int layer, int index) { return quint64(layer) << 32 | quint32(index); }
+
+	QHash<quint64, QByteArray> m_tiles;
+	int m_bytes;
+};
+
+}
+
+#endif
+
@@ -0,0 +1,250 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tileswap.h"
+#include "tile.h"
+#include "tileintern.h"
+
+#include <QTemporaryFile>
+#include <QAtomicInt>
+#include <QVector>
+#include <QMutex>
+#include <QDir>
+#include <QDebug>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace paintcore {
+namespace tileswap {
+
+namespace {
+
+//! The swap file grows in segments of this many tiles (64 MB)
+static const int SEGMENT_SLOTS = 4096;
+static const qint64 SEGMENT_BYTES = qint64(SEGMENT_SLOTS) * Tile::BYTES;
+
+// The swap file and its mapped segments. The lock also protects
+// the pixel pointer and slot of tile data that is being swapped.
+QMutex swapLock;
+QTemporaryFile *swapFile = nullptr;
+QVector<uchar*> segments;
+QVector<int> freeSlots;
+
+int limitMegabytes = 0;
+std::atomic<quint32> useClock(0);
+
+// Has overLimit been emitted since the last swapOutLeastRecentlyUsed() call?
+std::atomic<bool> overLimitNotified(false);
+
+QAtomicInt swappedTiles;
+QAtomicInt swapOuts;
+QAtomicInt pageIns;
+
+uchar *slotAddress(int slot)
+{
+	return segments.at(slot / SEGMENT_SLOTS) + (slot % SEGMENT_SLOTS) * Tile::BYTES;
+}
+
+//! Get a free slot, growing the file if needed. The swap lock must be held.
+int allocateSlot()
+{
+	if(freeSlots.isEmpty()) {
+		const int segment = segments.size();
+		if(!swapFile->resize((segment+1) * SEGMENT_BYTES)) {
+			qWarning() << "Couldn't grow tile swap file:" << swapFile->errorString();
+			return -1;
+		}
+
+		uchar *ptr = swapFile->map(segment * SEGMENT_BYTES, SEGMENT_BYTES);
+		if(!ptr) {
+			qWarning() << "Couldn't map tile swap file:" << swapFile->errorString();
+			return -1;
+		}
+
+		segments.append(ptr);
+		freeSlots.reserve(SEGMENT_SLOTS);
+		for(int i=SEGMENT_SLOTS-1;i>=0;--i)
+			freeSlots.append(segment * SEGMENT_SLOTS + i);
+	}
+
+	return freeSlots.takeLast();
+}
+
+}
+
+Notifier *notifier()
+{
+	static Notifier n;
+	return &n;
+}
+
+bool open(const QString &dir)
+{
+	QMutexLocker lock(&swapLock);
+	if(swapFile)
+		return true;
+
+	const QString path = dir.isEmpty() ? QDir::tempPath() : dir;
+	QDir().mkpath(path);
+
+	QTemporaryFile *file = new QTemporaryFile(QDir(path).filePath("drawpile-tileswap-XXXXXX"));
+	if(!file->open()) {
+		qWarning() << "Couldn't create tile swap file in" << path << ":" << file->errorString();
+		delete file;
+		return false;
+	}
+
+	swapFile = file;
+	return true;
+}
+
+bool isEnabled()
+{
+	QMutexLocker lock(&swapLock);
+	return swapFile != nullptr;
+}
+
+void setResidentLimit(int megabytes)
+{
+	limitMegabytes = qMax(0, megabytes);
+}
+
+int residentLimit()
+{
+	return limitMegabytes;
+}
+
+qint64 residentBytes()
+{
+	return qint64(tilepool::liveCount()) * Tile::BYTES;
+}
+
+bool isOverLimit()
+{
+	return limitMegabytes > 0 && residentBytes() > qint64(limitMegabytes) * 1024 * 1024;
+}
+
+void checkLimit()
+{
+	if(limitMegabytes > 0 && !overLimitNotified.load(std::memory_order_relaxed) && isOverLimit()) {
+		if(!overLimitNotified.exchange(true, std::memory_order_relaxed))
+			emit notifier()->overLimit();
+	}
+}
+
+int swapOutLeastRecentlyUsed(QVector<const Tile*> &candidates)
+{
+	overLimitNotified.store(false, std::memory_order_relaxed);
+
+	if(!isOverLimit() || !isEnabled())
+		return 0;
+
+	std::sort(candidates.begin(), candidates.end(), [](const Tile *a, const Tile *b) {
+		return a->lastUse() < b->lastUse();
+	});
+
+	int count = 0;
+	for(const Tile *t : candidates) {
+		if(!isOverLimit())
+			break;
+		if(t->swapOut())
+			++count;
+	}
+
+	return count;
+}
+
+bool swapOut(const TileData *data)
+{
+	// Data used by other tiles may be read by another thread right now
+	if(data->ref.load() != 1)
+		return false;
+	if(data->interned && !tileintern::withdraw(data))
+		return false;
+
+	QMutexLocker lock(&swapLock);
+
+	quint32 *pixels = data->pixeldata.load(std::memory_order_relaxed);
+	if(!swapFile || !pixels)
+		return false;
+
+	const int slot = allocateSlot();
+	if(slot<0)
+		return false;
+
+	memcpy(slotAddress(slot), pixels, Tile::BYTES);
+	data->swapslot = slot;
+	data->pixeldata.store(nullptr, std::memory_order_release);
+	tilepool::release(pixels);
+
+	swappedTiles.ref();
+	swapOuts.ref();
+	return true;
+}
+
+quint32 *pageIn(const TileData *data)
+{
+	quint32 *pixels;
+	{
+		QMutexLocker lock(&swapLock);
+
+		// Another thread may have paged the data in while we were waiting
+		pixels = data->pixeldata.load(std::memory_order_relaxed);
+		if(pixels)
+			return pixels;
+
+		Q_ASSERT(data->swapslot >= 0);
+		pixels = static_cast<quint32*>(tilepool::allocate());
+		memcpy(pixels, slotAddress(data->swapslot), Tile::BYTES);
+
+		freeSlots.append(data->swapslot);
+		data->swapslot = -1;
+		data->lastuse.store(nextUseStamp(), std::memory_order_relaxed);
+		data->pixeldata.store(pixels, std::memory_order_release);
+
+		swappedTiles.deref();
+		pageIns.ref();
+	}
+
+	checkLimit();
+	return pixels;
+}
+
+void discard(int slot)
+{
+	Q_ASSERT(slot>=0);
+	QMutexLocker lock(&swapLock);
+	freeSlots.append(slot);
+	swappedTiles.deref();
+}
+
+quint32 nextUseStamp()
+{
+	return useClock.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+int swappedCount() { return swappedTiles.load(); }
+int swapOutCount() { return swapOuts.load(); }
+int pageInCount() { return pageIns.load(); }
+
+}
+}
+
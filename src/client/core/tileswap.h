@@ -0,0 +1,141 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILESWAP_H
+#define PAINTCORE_TILESWAP_H
+
+#include <QContainerFwd>
+#include <QObject>
+
+class QString;
+
+namespace paintcore {
+
+struct TileData;
+class Tile;
+
+/**
+ * @brief Memory mapped swap file for tile pixel data
+ *
+ * Very large sessions can keep more tile data around than fits in memory:
+ * hidden layers, old savepoints and loaded index snapshots are rarely looked
+ * at but must be kept intact. When a resident memory limit is set, the least
+ * recently allocated or paged in of these tiles are moved to a scratch file and
+ * paged back in transparently the next time their pixels are accessed.
+ *
+ * The limit is checked whenever a tile pixel block is allocated or paged in.
+ * Going over it emits Notifier::overLimit(), and the receiver swaps out tiles
+ * in its own thread. The limit is not a hard cap: tiles of visible layers are
+ * never swapped out, and memory can grow until the receiver gets to run.
+ *
+ * Swapping out data is only safe when no one holds a raw pointer to its
+ * pixels, so it must be done on the canvas thread with the layer stack locked.
+ * Only data used by a single tile is swapped out. Interned data is taken out
+ * of the intern table first, so layer stacks in other threads can't pick it up.
+ * Paging in can happen from any thread.
+ */
+namespace tileswap {
+
+/**
+ * @brief Resident memory limit notifications
+ *
+ * Use a queued connection: the signal is emitted from whichever thread
+ * allocated or paged in the tile that went over the limit.
+ */
+class Notifier : public QObject {
+	Q_OBJECT
+signals:
+	/**
+	 * @brief Resident tile memory went over the limit
+	 *
+	 * This is emitted just once until swapOutLeastRecentlyUsed() is called again.
+	 */
+	void overLimit();
+};
+
+//! Get the global notifier
+Notifier *notifier();
+
+/**
+ * @brief Create the swap file
+ *
+ * Swapping is disabled until this is called.
+ * @param dir directory to create the file in (the system temp dir if empty)
+ * @return false if the file couldn't be created
+ */
+bool open(const QString &dir);
+
+//! Is the swap file in use?
+bool isEnabled();
+
+//! Set the resident tile memory limit in megabytes (0 for no limit)
+void setResidentLimit(int megabytes);
+
+//! Get the resident tile memory limit in megabytes
+int residentLimit();
+
+/**
+ * @brief Get the amount of memory used by tile pixel blocks
+ *
+ * Free blocks held in reserve by the tile pool are not counted: their
+ * number is capped separately by the pool's high-water mark.
+ */
+qint64 residentBytes();
+
+//! Is the resident tile memory over the limit?
+bool isOverLimit();
+
+//! Notify if over the limit (called when a pixel block is allocated or paged in)
+void checkLimit();
+
+/**
+ * @brief Swap out the least recently allocated or paged in of the given tiles
+ *
+ * Tiles are swapped out until resident memory drops under the limit.
+ * The candidate tiles must not be modified while this runs.
+ * @param candidates the tiles that may be swapped out. Reordered by use.
+ * @return number of tiles swapped out
+ */
+int swapOutLeastRecentlyUsed(QVector<const Tile*> &candidates);
+
+//! Move pixel data to the swap file (see Tile::swapOut())
+bool swapOut(const TileData *data);
+
+//! Read swapped out pixel data back into memory (called by TileData::pixels())
+quint32 *pageIn(const TileData *data);
+
+//! Free the swap slot of deleted data (called by the TileData destructor)
+void discard(int slot);
+
+//! Get a new use stamp. Higher stamps are more recent.
+quint32 nextUseStamp();
+
+//! Get the number of tiles currently in the swap file
+int swappedCount();
+
+//! Get the total number of tiles swapped out so far
+int swapOutCount();
+
+//! Get the total number of tiles paged in so far
+int pageInCount();
+
+}
+}
+
+#endif
+
@@ -98,6 +98,7 @@ void Document::initCanvas()
 	connect(qApp, SIGNAL(settingsChanged()), m_canvas, SLOT(updateLayerViewOptions()));
 
 	m_canvas->stateTracker()->setMaxHistorySize(1024*1024*10u);
+	m_canvas->stateTracker()->setSavepointMemoryBudget(QSettings().value("settings/savepointmemory", 512).toInt());
 
 	emit canvasChanged(m_canvas);
 
@@ -28,6 +28,9 @@
 #include "canvas/register.h"
 #include "quick/register.h"
 #include "core/register.h"
+#include "core/rasterop.h"
+#include "core/tilepool.h"
+#include "core/tileswap.h"
 #include "../shared/net/message.h"
 
 #ifdef Q_OS_MAC
@@ -216,6 +219,18 @@ int main(int argc, char *argv[]) {
 	protocol::registerTypes();
 	paintcore::registerTypes();
 
+	// The tile storage format must be selected before any canvas is created
+	paintcore::setPremultipliedStorage(QSettings().value("settings/premultipliedtiles", false).toBool());
+
+	// Number of freed tiles (64x64 pixels, 16 KiB each) to keep around for reuse
+	paintcore::tilepool::setHighWaterMark(QSettings().value("settings/tilepoolsize", 1024).toInt());
+
+	// Optional swap file for tiles of hidden layers and old savepoints (limit in megabytes)
+	if(QSettings().value("settings/tileswap", false).toBool()) {
+		paintcore::tileswap::setResidentLimit(QSettings().value("settings/tileswaplimit", 2048).toInt());
+		paintcore::tileswap::open(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+	}
+
 	icon::selectThemeVariant();
 
 #ifdef Q_OS_MAC
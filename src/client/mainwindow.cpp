@@ -56,6 +56,9 @@
 
 #ifndef NDEBUG
 #include "core/tile.h"
+#include "core/tilestore.h"
+#include "core/tileswap.h"
+#include "core/rasterop.h"
 #endif
 
 #ifdef Q_OS_OSX
@@ -198,8 +201,25 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	{
 		QLabel *tilemem = new QLabel(this);
 		QTimer *tilememtimer = new QTimer(this);
-		connect(tilememtimer, &QTimer::timeout, [tilemem]() {
-			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+		connect(tilememtimer, &QTimer::timeout, [this, tilemem]() {
+			const paintcore::LayerStack *layers = m_doc->canvas() ? m_doc->canvas()->layerStack() : nullptr;
+			const int scanned = layers ? layers->savepointTilesScanned() : 0;
+			const quint64 stampHits = layers ? layers->brushMaskCache().hits() : 0;
+			const quint64 stampMisses = layers ? layers->brushMaskCache().misses() : 0;
+			tilemem->setText(QStringLiteral("Tiles: %1 Mb (peak %2, pooled %3, scanned %4, shared %5 Mb, cold %6/%7 Mb, swapped %8, out %9, in %10, stamp hits %11/%12) %13")
+				.arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2)
+				.arg(paintcore::TileData::peakCount())
+				.arg(paintcore::TileData::pooledCount())
+				.arg(scanned)
+				.arg(paintcore::TileData::megabytesSaved(), 0, 'f', 2)
+				.arg(paintcore::TileStore::totalCompressedBytes() / float(1024*1024), 0, 'f', 2)
+				.arg(paintcore::TileStore::totalUncompressedBytes() / float(1024*1024), 0, 'f', 2)
+				.arg(paintcore::tileswap::swappedCount())
+				.arg(paintcore::tileswap::swapOutCount())
+				.arg(paintcore::tileswap::pageInCount())
+				.arg(stampHits)
+				.arg(stampHits + stampMisses)
+				.arg(QString::fromLatin1(paintcore::rasterOpsName())));
 		});
 		tilememtimer->setInterval(1000);
 		tilememtimer->start(1000);
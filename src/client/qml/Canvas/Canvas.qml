@@ -24,6 +24,7 @@ Rectangle {
 		LayerStack {
 			id: canvas
 			anchors.centerIn: parent
+			viewZoom: canvasinput.contentZoom
 
 			transform: CanvasTransform {
 				origin.x: canvas.width / 2
@@ -23,10 +23,19 @@
 #include "core/layerstack.h"
 
 #include <QPainter>
+#include <QQuickWindow>
 #include <QDebug>
 
+namespace {
+	// Changed tiles this close to the visible area are repainted immediately
+	const int VISIBLE_MARGIN = 64;
+
+	// Height of the offscreen band repainted per paint
+	const int OFFSCREEN_BAND = 128;
+}
+
 LayerStackItem::LayerStackItem(QQuickItem *parent)
-	: QQuickPaintedItem(parent)
+	: QQuickPaintedItem(parent), m_viewZoom(1), m_lodLevel(0)
 {
 }
 
@@ -37,14 +46,14 @@ void LayerStackItem::setModel(paintcore::LayerStack *model)
 		// Disconnect previous model
 		if(m_model) {
 			disconnect(m_model, &paintcore::LayerStack::resized, this, &LayerStackItem::onLayerStackResize);
-			disconnect(m_model, &paintcore::LayerStack::areaChanged, this, &LayerStackItem::update);
+			disconnect(m_model, &paintcore::LayerStack::areaChanged, this, &LayerStackItem::onAreaChanged);
 		}
 
 		m_model = model;
 
 		// Connect new model
 		connect(model, &paintcore::LayerStack::resized, this, &LayerStackItem::onLayerStackResize);
-		connect(model, &paintcore::LayerStack::areaChanged, this, &LayerStackItem::update);
+		connect(model, &paintcore::LayerStack::areaChanged, this, &LayerStackItem::onAreaChanged);
 
 		emit modelChanged();
 	}
@@ -54,12 +63,74 @@ void LayerStackItem::paint(QPainter *painter)
 {
 	paintcore::LayerStack::Locker locker(m_model);
 
-	if(m_cache.isNull())
+	if(m_cache.isNull()) {
 		m_cache = QPixmap(m_model->size());
+		m_cache.fill();
+		m_offscreen = m_cache.rect();
+	}
+
+	// Repaint the visible area right away and the rest a band at a time
+	m_model->paintChangedTiles(visibleArea() & m_cache.rect(), &m_cache);
+
+	if(!m_offscreen.isEmpty()) {
+		QRect band = m_offscreen;
+		band.setHeight(qMin(band.height(), OFFSCREEN_BAND));
+		m_model->paintChangedTiles(band, &m_cache);
 
-	m_model->paintChangedTiles(QRect(QPoint(), m_cache.size()), &m_cache);
+		m_offscreen.setTop(band.bottom() + 1);
+		if(m_offscreen.isEmpty())
+			m_offscreen = QRect();
+		else
+			QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+	}
+
+	const paintcore::LodPyramid &lod = m_model->lodPyramid();
+	if(m_lodLevel>0 && m_lodLevel<=lod.levels())
+		painter->drawImage(QRectF(QPointF(), m_cache.size()), lod.level(m_lodLevel));
+	else
+		painter->drawPixmap(0, 0, m_cache);
+}
 
-	painter->drawPixmap(0, 0, m_cache);
+void LayerStackItem::onAreaChanged(const QRect &area)
+{
+	// Further changes are accumulated until taken
+	m_offscreen |= area | m_model->takeChangedArea();
+	update();
+}
+
+/**
+ * @return the part of the canvas visible in the window, plus a margin
+ */
+QRect LayerStackItem::visibleArea() const
+{
+	if(!window())
+		return QRect(QPoint(), m_cache.size());
+
+	return mapRectFromScene(QRectF(QPointF(), window()->size()))
+		.toAlignedRect()
+		.adjusted(-VISIBLE_MARGIN, -VISIBLE_MARGIN, VISIBLE_MARGIN, VISIBLE_MARGIN);
+}
+
+void LayerStackItem::setViewZoom(qreal zoom)
+{
+	if(zoom != m_viewZoom) {
+		m_viewZoom = zoom;
+		updateLodLevel();
+		emit viewZoomChanged(zoom);
+	}
+}
+
+void LayerStackItem::updateLodLevel()
+{
+	const int level = m_model ? m_model->lodPyramid().levelForScale(m_viewZoom) : 0;
+	if(level != m_lodLevel && m_model) {
+		m_lodLevel = level;
+
+		// The painter is scaled to fit the texture, so paint() can use canvas coordinates
+		const int scale = 1 << level;
+		setTextureSize(QSize((m_model->width() + scale - 1) / scale, (m_model->height() + scale - 1) / scale));
+		update();
+	}
 }
 
 void LayerStackItem::onLayerStackResize(int xoffset, int yoffset, const QSize &oldsize)
@@ -70,4 +141,8 @@ void LayerStackItem::onLayerStackResize(int xoffset, int yoffset, const QSize &o
 	setImplicitWidth(m_model->width());
 	setImplicitHeight(m_model->height());
 	m_cache = QPixmap();
+
+	// The available levels depend on the canvas size
+	m_lodLevel = -1;
+	updateLodLevel();
 }
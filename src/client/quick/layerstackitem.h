@@ -30,6 +30,7 @@
 class LayerStackItem : public QQuickPaintedItem
 {
 	Q_PROPERTY(paintcore::LayerStack* model READ model WRITE setModel NOTIFY modelChanged)
+	Q_PROPERTY(qreal viewZoom READ viewZoom WRITE setViewZoom NOTIFY viewZoomChanged)
 
 	Q_OBJECT
 public:
@@ -38,17 +39,36 @@ public:
 	void setModel(paintcore::LayerStack *model);
 	paintcore::LayerStack *model() const { return m_model.data(); }
 
+	/**
+	 * @brief Set the zoom level the canvas is viewed at
+	 *
+	 * When zoomed out, a downscaled copy of the canvas is painted
+	 * into a smaller texture.
+	 */
+	void setViewZoom(qreal zoom);
+	qreal viewZoom() const { return m_viewZoom; }
+
 	void paint(QPainter *painter);
 
 signals:
 	void modelChanged();
+	void viewZoomChanged(qreal zoom);
 
 private slots:
 	void onLayerStackResize(int xoffset, int yoffset, const QSize &oldsize);
+	void onAreaChanged(const QRect &area);
 
 private:
+	void updateLodLevel();
+	QRect visibleArea() const;
+
 	QPointer<paintcore::LayerStack> m_model;
 	QPixmap m_cache;
+	qreal m_viewZoom;
+	int m_lodLevel;
+
+	// Changed area that may not have been repainted yet
+	QRect m_offscreen;
 };
 
 #endif // CANVASITEM_H
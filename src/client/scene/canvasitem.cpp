@@ -19,13 +19,26 @@
 
 #include "canvasitem.h"
 #include "core/layerstack.h"
+#include "core/rendersnapshot.h"
+#include "framescheduler.h"
 
 #include <QPainter>
 #include <QStyleOptionGraphicsItem>
+#include <QGraphicsScene>
+#include <QGraphicsView>
 #include <QTimer>
+#include <QScopedPointer>
 
 namespace drawingboard {
 
+namespace {
+	// Changed tiles this close to the visible area are repainted immediately
+	const int VISIBLE_MARGIN = 64;
+
+	// Height of the offscreen band repainted at a time when idle
+	const int OFFSCREEN_BAND = 128;
+}
+
 /**
  * @param parent use another QGraphicsItem as a parent
  * @param scene the picture to which this layer belongs to
@@ -33,33 +46,111 @@ namespace drawingboard {
 CanvasItem::CanvasItem(paintcore::LayerStack *layerstack, QGraphicsItem *parent)
 	: QGraphicsObject(parent), m_image(layerstack)
 {
-	connect(m_image, &paintcore::LayerStack::areaChanged, this, &CanvasItem::refreshImage);
+	// Changes and new snapshots are handled at most once per display frame
+	m_frames = new FrameScheduler(this);
+	connect(m_frames, &FrameScheduler::frame, this, &CanvasItem::refreshFrame);
+	connect(m_image, &paintcore::LayerStack::areaChanged, m_frames, &FrameScheduler::schedule);
+	connect(m_image, &paintcore::LayerStack::snapshotPublished, m_frames, &FrameScheduler::schedule);
 	connect(m_image, &paintcore::LayerStack::resized, this, &CanvasItem::canvasResize);
 
-	m_refreshTimer = new QTimer(this);
-	m_refreshTimer->setSingleShot(true);
-	connect(m_refreshTimer, &QTimer::timeout, [this]() { refreshImage(QRect()); });
+	// Leave half of each frame for painting the view
+	m_image->setFrameBudget(m_frames->frameInterval() * 1000 / 2);
+
+	m_idleTimer = new QTimer(this);
+	m_idleTimer->setSingleShot(true);
+	m_idleTimer->setInterval(0);
+	connect(m_idleTimer, &QTimer::timeout, this, &CanvasItem::refreshOffscreen);
 }
 
-void CanvasItem::refreshImage(const QRect &area)
+/**
+ * Bring the view up to date. This is called at most once per display frame.
+ *
+ * The canvas thread flattens the changed tiles in the visible area by itself
+ * and publishes them as a render snapshot. The rest of the changed area
+ * is requested when it is scrolled into view or when idle.
+ */
+void CanvasItem::refreshFrame()
 {
-	m_refresh |= area;
-	if(m_image->lock(5)) {
-		if((m_cache.isNull() || m_cache.size() != m_image->size()) && m_image->size().isValid()) {
-			m_cache = QPixmap(m_image->size());
+	const QRect visible = visibleArea();
+	m_image->setViewArea(visible);
+
+	const QRect changed = m_image->takeChangedArea();
+	if(!changed.isEmpty() && !visible.contains(changed)) {
+		m_offscreen |= changed;
+		m_idleTimer->start();
+	}
+
+	paintSnapshot();
+}
+
+/**
+ * Paint the tiles of the latest render snapshot into the cache.
+ * This never locks the layer stack, so it doesn't have to wait for
+ * the canvas thread to finish what it is doing.
+ */
+void CanvasItem::paintSnapshot()
+{
+	QScopedPointer<paintcore::RenderSnapshot> snapshot(m_image->takeSnapshot());
+	if(!snapshot)
+		return;
+
+	if(m_cache.size() != snapshot->size()) {
+		if(snapshot->size().isEmpty()) {
+			m_cache = QPixmap();
+		} else {
+			m_cache = QPixmap(snapshot->size());
 			m_cache.fill();
 		}
+		m_lod.resize(snapshot->size().width(), snapshot->size().height());
+
+		// Tiles outside the view are flattened when idle
+		m_offscreen = m_cache.rect();
+		update();
+	}
+
+	snapshot->paint(&m_cache, &m_lod);
 
-		m_image->paintChangedTiles(m_refresh, &m_cache, true);
-		m_image->unlock();
+	const QRect changed = snapshot->changedArea();
+	if(!changed.isEmpty())
+		update(changed.adjusted(-2, -2, 2, 2));
 
-		update(m_refresh.adjusted(-2, -2, 2, 2));
-		m_refresh = QRect();
+	if(!m_offscreen.isEmpty())
+		m_idleTimer->start();
+}
+
+/**
+ * Request a band of the changed area outside the views.
+ * The next band is requested when the snapshot arrives.
+ */
+void CanvasItem::refreshOffscreen()
+{
+	if(m_offscreen.isEmpty())
+		return;
 
-	} else if(!m_refreshTimer->isActive()) {
-		// Couldn't get a lock: re-enter the eventloop and try again
-		m_refreshTimer->start(10);
+	QRect band = m_offscreen;
+	band.setHeight(qMin(band.height(), OFFSCREEN_BAND));
+	m_image->requestSnapshot(band);
+
+	m_offscreen.setTop(band.bottom() + 1);
+	if(m_offscreen.isEmpty())
+		m_offscreen = QRect();
+}
+
+/**
+ * @return the part of the canvas visible in any view, plus a margin
+ */
+QRect CanvasItem::visibleArea() const
+{
+	if(!scene() || scene()->views().isEmpty())
+		return boundingRect().toAlignedRect();
+
+	QRectF area;
+	for(const QGraphicsView *view : scene()->views()) {
+		const QRectF viewRect = view->mapToScene(view->viewport()->rect()).boundingRect();
+		area |= mapRectFromScene(viewRect);
 	}
+
+	return area.toAlignedRect().adjusted(-VISIBLE_MARGIN, -VISIBLE_MARGIN, VISIBLE_MARGIN, VISIBLE_MARGIN);
 }
 
 QRectF CanvasItem::boundingRect() const
@@ -73,7 +164,20 @@ void CanvasItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option
 	QRect exposed = option->exposedRect.adjusted(-1, -1, 1, 1).toAlignedRect();
 	exposed &= m_cache.rect();
 
-	painter->drawPixmap(exposed, m_cache, exposed);
+	// Changed tiles scrolled into view are flattened for the next snapshot
+	m_image->setViewArea(visibleArea());
+
+	// When zoomed out, draw a downscaled copy instead of scaling the full size image
+	const int level = m_lod.levelForScale(option->levelOfDetailFromTransform(painter->worldTransform()));
+
+	if(level>0) {
+		const qreal scale = 1 << level;
+		const QRectF source(exposed.x() / scale, exposed.y() / scale, exposed.width() / scale, exposed.height() / scale);
+		painter->drawImage(QRectF(exposed), m_lod.level(level), source);
+
+	} else {
+		painter->drawPixmap(exposed, m_cache, exposed);
+	}
 }
 
 void CanvasItem::canvasResize()
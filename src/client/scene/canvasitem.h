@@ -19,6 +19,8 @@
 #ifndef DP_CANVASITEM_H
 #define DP_CANVASITEM_H
 
+#include "core/lodpyramid.h"
+
 #include <QGraphicsObject>
 
 class QTimer;
@@ -29,6 +31,8 @@ namespace paintcore {
 
 namespace drawingboard {
 
+class FrameScheduler;
+
 /**
  * @brief A graphics item that draws a LayerStack
  */
@@ -42,21 +46,29 @@ public:
 	/** reimplematation */
 	QRectF boundingRect() const;
 
-public slots:
-	void refreshImage(const QRect &area);
-
 private slots:
 	void canvasResize();
+	void refreshFrame();
+	void paintSnapshot();
+	void refreshOffscreen();
 
 protected:
 	/** reimplementation */
 	void paint(QPainter*, const QStyleOptionGraphicsItem*, QWidget*);
 
 private:
+	QRect visibleArea() const;
+
 	paintcore::LayerStack *m_image;
 	QPixmap m_cache;
-	QRect m_refresh;
-	QTimer *m_refreshTimer;
+	FrameScheduler *m_frames;
+
+	// Downscaled copies of the cache for zoomed out views
+	paintcore::LodPyramid m_lod;
+
+	// Changed area outside the views, not yet repainted
+	QRect m_offscreen;
+	QTimer *m_idleTimer;
 };
 
 }
@@ -0,0 +1,57 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "framescheduler.h"
+
+#include <QGuiApplication>
+#include <QScreen>
+#include <QTimer>
+
+namespace drawingboard {
+
+FrameScheduler::FrameScheduler(QObject *parent)
+	: QObject(parent), m_interval(16)
+{
+	const QScreen *screen = QGuiApplication::primaryScreen();
+	if(screen && screen->refreshRate() > 1)
+		m_interval = qMax(1, qRound(1000.0 / screen->refreshRate()));
+
+	m_timer = new QTimer(this);
+	m_timer->setSingleShot(true);
+	m_timer->setTimerType(Qt::PreciseTimer);
+	connect(m_timer, &QTimer::timeout, this, &FrameScheduler::emitFrame);
+}
+
+void FrameScheduler::schedule()
+{
+	if(m_timer->isActive())
+		return;
+
+	const qint64 wait = m_lastFrame.isValid() ? m_interval - m_lastFrame.elapsed() : 0;
+	m_timer->start(int(qBound(qint64(0), wait, qint64(m_interval))));
+}
+
+void FrameScheduler::emitFrame()
+{
+	m_lastFrame.start();
+	emit frame();
+}
+
+}
+
@@ -0,0 +1,67 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_FRAMESCHEDULER_H
+#define DP_FRAMESCHEDULER_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+class QTimer;
+
+namespace drawingboard {
+
+/**
+ * @brief Paces view refreshes to the display refresh rate
+ *
+ * Any number of schedule() calls between two frames result in a single
+ * frame() signal. The first frame after an idle period is emitted right away.
+ *
+ * Qt does not tell QGraphicsView items when vertical blanking happens,
+ * so the frames are timed from the refresh rate of the primary screen.
+ */
+class FrameScheduler : public QObject
+{
+	Q_OBJECT
+public:
+	explicit FrameScheduler(QObject *parent=nullptr);
+
+	//! Get the time between two frames in milliseconds
+	int frameInterval() const { return m_interval; }
+
+public slots:
+	//! Request a frame
+	void schedule();
+
+signals:
+	//! Time to refresh the view
+	void frame();
+
+private slots:
+	void emitFrame();
+
+private:
+	QTimer *m_timer;
+	QElapsedTimer m_lastFrame;
+	int m_interval;
+};
+
+}
+
+#endif
+
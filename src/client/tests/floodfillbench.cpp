@@ -0,0 +1,148 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Flood fill benchmark.
+ *
+ * Draws synthetic line art on a large canvas (a white background layer
+ * and a line art layer) and times flood fills of small and canvas sized
+ * regions in both layer and merged sampling modes, as well as fill expansion.
+ *
+ * Usage: floodfillbench [width height]
+ */
+
+#include "core/layerstack.h"
+#include "core/layer.h"
+#include "core/floodfill.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QPainter>
+#include <QImage>
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace paintcore;
+
+namespace {
+
+static const int ROUNDS = 5;
+
+static const int CELL = 500;
+
+//! Draw line art: a grid of cells with a circle of random size in each
+QImage makeLineArt(int width, int height)
+{
+	std::mt19937 rng(1234);
+
+	QImage image(width, height, QImage::Format_ARGB32);
+	image.fill(0);
+
+	QPainter painter(&image);
+	painter.setRenderHint(QPainter::Antialiasing);
+	painter.setPen(QPen(Qt::black, 3));
+
+	for(int x=CELL;x<width;x+=CELL)
+		painter.drawLine(x, 0, x, height);
+	for(int y=CELL;y<height;y+=CELL)
+		painter.drawLine(0, y, width, y);
+
+	for(int y=0;y<height;y+=CELL) {
+		for(int x=0;x<width;x+=CELL) {
+			const int r = 20 + rng() % (CELL/2 - 40);
+			painter.drawEllipse(QPoint(x + CELL/2, y + CELL/2), r, r);
+		}
+	}
+
+	return image;
+}
+
+//! Run a fill a few times and print the median time
+void bench(const char *name, const LayerStack &stack, const QPoint &point, int layer, bool merge, int expansion)
+{
+	std::vector<qint64> times;
+	FillResult result;
+
+	for(int i=0;i<ROUNDS;++i) {
+		QElapsedTimer timer;
+		timer.start();
+
+		result = floodfill(&stack, point, Qt::red, 0, layer, merge);
+		if(expansion>0)
+			result = expandFill(result, expansion, Qt::red);
+
+		times.push_back(timer.nsecsElapsed());
+	}
+
+	std::sort(times.begin(), times.end());
+	printf("%-28s %5s %9.2f ms  %5dx%-5d\n",
+		name,
+		merge ? "merge" : "layer",
+		times[ROUNDS/2] / 1000000.0,
+		result.bounds.width(),
+		result.bounds.height()
+	);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	int width = 8000, height = 8000;
+	if(argc == 3) {
+		width = QString(argv[1]).toInt();
+		height = QString(argv[2]).toInt();
+	}
+	if(width < 1000 || height < 1000) {
+		fprintf(stderr, "Canvas must be at least 1000x1000\n");
+		return 1;
+	}
+
+	LayerStack stack;
+	stack.resize(0, width, height, 0);
+	stack.createLayer(1, 0, Qt::white, false, false, "Background");
+	Layer *lineart = stack.createLayer(2, 0, Qt::transparent, false, false, "Line art");
+	lineart->putImage(0, 0, makeLineArt(width, height), BlendMode::MODE_REPLACE);
+
+	printf("Canvas %dx%d\n", width, height);
+
+	// The corner of a grid cell, outside the circle
+	const QPoint cellPoint(10, 10);
+
+	// On a grid line: the grid spans the whole canvas
+	const QPoint gridPoint(CELL, 10);
+
+	for(bool merge : {false, true}) {
+		bench("cell", stack, cellPoint, 2, merge, 0);
+		bench("cell, expanded 4", stack, cellPoint, 2, merge, 4);
+		bench("grid lines", stack, gridPoint, 2, merge, 0);
+		bench("grid lines, expanded 4", stack, gridPoint, 2, merge, 4);
+	}
+
+	// The whole (uniform) background layer
+	bench("background", stack, cellPoint, 1, false, 0);
+	bench("background, expanded 4", stack, cellPoint, 1, false, 4);
+
+	return 0;
+}
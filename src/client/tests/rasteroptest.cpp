@@ -0,0 +1,159 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Raster operation conformance test.
+ *
+ * Every instruction set specific implementation must produce bit-identical
+ * results with the generic one. This runs all the mask, pixel and sampling
+ * functions of each implementation supported by this CPU on random data
+ * and compares the outputs with the generic implementation's.
+ */
+
+#include "core/rasterop_p.h"
+
+#include <QRgb>
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace paintcore;
+using namespace paintcore::rasterop;
+
+namespace {
+
+static const int ITERATIONS = 2000;
+
+std::mt19937 rng(1234);
+
+//! Get a random pixel. Fully transparent and opaque pixels are common, since the kernels have special cases for them
+quint32 randomPixel(bool premultiplied)
+{
+	quint32 p = rng();
+	switch(rng() % 6) {
+	case 0: p &= 0x00ffffff; break;
+	case 1: p |= 0xff000000; break;
+	}
+	return premultiplied ? qPremultiply(p) : p;
+}
+
+//! Get a random mask value, favoring the special cases 0 and 255
+uchar randomMask()
+{
+	switch(rng() % 4) {
+	case 0: return 0;
+	case 1: return 255;
+	default: return rng() & 0xff;
+	}
+}
+
+//! Get a random opacity value, favoring the special cases 0 and 255
+uchar randomOpacity()
+{
+	switch(rng() % 4) {
+	case 0: return 255;
+	case 1: return 0;
+	default: return rng() & 0xff;
+	}
+}
+
+std::vector<quint32> randomPixels(int len, bool premultiplied)
+{
+	std::vector<quint32> pixels(len);
+	for(quint32 &p : pixels)
+		p = randomPixel(premultiplied);
+	return pixels;
+}
+
+//! Compare one implementation against the generic one. Returns the number of failures
+int compare(const char *name, bool premultiplied)
+{
+	const Operations *ref = implementation("generic", premultiplied);
+	const Operations *ops = implementation(name, premultiplied);
+	if(!ops) {
+		printf("%s%s: not supported by this CPU, skipped\n", name, premultiplied ? "/premultiplied" : "");
+		return 0;
+	}
+
+	int failures = 0;
+	auto fail = [&failures, ops](const char *what, int slot, int w, int h) {
+		if(++failures <= 20)
+			printf("%s: %s (mode slot %d, %dx%d) differs from generic\n", ops->name, what, slot, w, h);
+	};
+
+	for(int i=0;i<ITERATIONS;++i) {
+		// Odd sizes and skips exercise the leftover pixel handling
+		const int w = 1 + rng() % 70;
+		const int h = 1 + rng() % 5;
+		const int baseskip = rng() % 4;
+		const int maskskip = rng() % 3;
+
+		const std::vector<quint32> base = randomPixels((w+baseskip)*h, premultiplied);
+		std::vector<uchar> mask((w+maskskip)*h);
+		for(uchar &m : mask)
+			m = randomMask();
+
+		// Mask compositing
+		const quint32 color = randomPixel(false);
+		for(int slot=0;slot<MODE_SLOTS;++slot) {
+			std::vector<quint32> expected = base, actual = base;
+			ref->mask[slot](expected.data(), color, mask.data(), w, h, maskskip, baseskip);
+			ops->mask[slot](actual.data(), color, mask.data(), w, h, maskskip, baseskip);
+			if(memcmp(expected.data(), actual.data(), expected.size() * sizeof(quint32)) != 0)
+				fail("mask compositing", slot, w, h);
+		}
+
+		// Pixel compositing
+		const int len = w*h;
+		const std::vector<quint32> over = randomPixels(len, premultiplied);
+		const uchar opacity = randomOpacity();
+		for(int slot=0;slot<MODE_SLOTS;++slot) {
+			for(int oc=0;oc<OPACITY_CLASSES;++oc) {
+				const uchar o = oc == FULL_OPACITY ? 255 : opacity;
+				std::vector<quint32> expected = base, actual = base;
+				ref->pixels[slot][oc](expected.data(), over.data(), o, len);
+				ops->pixels[slot][oc](actual.data(), over.data(), o, len);
+				if(memcmp(expected.data(), actual.data(), expected.size() * sizeof(quint32)) != 0)
+					fail(oc == FULL_OPACITY ? "opaque pixel compositing" : "pixel compositing", slot, w, h);
+			}
+		}
+
+		// Sampling
+		if(ref->sampleMask(base.data(), mask.data(), w, h, maskskip, baseskip) != ops->sampleMask(base.data(), mask.data(), w, h, maskskip, baseskip))
+			fail("mask sampling", -1, w, h);
+	}
+
+	printf("%s: %s\n", ops->name, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+}
+
+int main()
+{
+	int failures = 0;
+	for(const char *name : {"sse2", "avx2"}) {
+		failures += compare(name, false);
+		failures += compare(name, true);
+	}
+
+	return failures ? 1 : 0;
+}
@@ -60,7 +60,7 @@ void FloodFill::begin(const paintcore::Point &point, float zoom)
 
 	fill = paintcore::expandFill(fill, ts->fillExpansion(), color);
 
-	if(fill.image.isNull()) {
+	if(fill.isEmpty()) {
 		QApplication::restoreOverrideCursor();
 		return;
 	}
@@ -83,7 +83,7 @@ void FloodFill::begin(const paintcore::Point &point, float zoom)
 	// consist of large solid areas, meaning they should compress ridiculously well.
 	QList<protocol::MessagePtr> msgs;
 	msgs << protocol::MessagePtr(new protocol::UndoPoint(0));
-	msgs << net::command::putQImage(0, owner.activeLayer(), fill.x, fill.y, fill.image, mode);
+	msgs << net::command::putQImage(0, owner.activeLayer(), fill.bounds.x(), fill.bounds.y(), fill.toImage(), mode);
 	owner.client()->sendMessages(msgs);
 
 	QApplication::restoreOverrideCursor();
@@ -91,9 +91,7 @@ void ShapeTool::updatePreview()
 		Q_ASSERT(pv.size()>1);
 
 		layer->dab(-1, m_brush, pv[0], ss);
-
-		for(int i=1;i<pv.size();++i)
-			layer->drawLine(-1, m_brush, pv[i-1], pv[i], ss);
+		layer->drawLines(-1, m_brush, pv, ss);
 	}
 }
 
@@ -184,8 +184,7 @@ void BrushPreview::updatePreview()
 	layer->fillRect(QRect(0, 0, layer->width(), layer->height()), isTransparentBackground() ? QColor(Qt::transparent) : bgcolor, paintcore::BlendMode::MODE_REPLACE);
 
 	paintcore::StrokeState ss(brush);
-	for(int i=1;i<pointvector.size();++i)
-		layer->drawLine(0, brush, pointvector[i-1], pointvector[i], ss);
+	layer->drawLines(0, brush, pointvector, ss);
 
 	layer->mergeSublayer(0);
 
@@ -193,7 +192,8 @@ void BrushPreview::updatePreview()
 		paintcore::FillResult fr = paintcore::floodfill(_preview, previewRect.center().toPoint(), m_color, _fillTolerance, 0, false);
 		if(_fillExpansion>0)
 			fr = paintcore::expandFill(fr, _fillExpansion, m_color);
-		layer->putImage(fr.x, fr.y, fr.image, _underFill ? paintcore::BlendMode::MODE_BEHIND : paintcore::BlendMode::MODE_NORMAL);
+		if(!fr.isEmpty())
+			layer->putImage(fr.bounds.x(), fr.bounds.y(), fr.toImage(), _underFill ? paintcore::BlendMode::MODE_BEHIND : paintcore::BlendMode::MODE_NORMAL);
 	}
 
 	_needupdate=false;
@@ -135,6 +135,16 @@ Compatibility Reader::open()
 	if(myversion < m_formatversion)
 		return MINOR_INCOMPATIBILITY;
 
+#if DRAWPILE_PROTO_MAJOR_VERSION != 20 || DRAWPILE_PROTO_MINOR_VERSION != 2
+#error Update recording compatability check!
+#endif
+
+	// Older minor versions of the current major version
+	switch(m_formatversion) {
+	case version32(20, 1): // brush stamps were not quantized
+		return MINOR_INCOMPATIBILITY;
+	}
+
 #if 0
 #if DRAWPILE_PROTO_MAJOR_VERSION != 16 || DRAWPILE_PROTO_MINOR_VERSION != 1
 #error Update recording compatability check!
@@ -243,7 +253,8 @@ MessageRecord Reader::readNext()
 		return msg;
 
 	protocol::Message *message;
-	if(m_formatversion != version32(DRAWPILE_PROTO_MAJOR_VERSION, DRAWPILE_PROTO_MINOR_VERSION)) {
+	// The message format changes only with the major version
+	if(majorVersion(m_formatversion) != DRAWPILE_PROTO_MAJOR_VERSION) {
 
 #if 0 // TODO
 		// see protocol changelog in doc/protocol.md